@@ -0,0 +1,65 @@
+#!/bin/sh
+# Builds the interpreter once per configuration and times every script in
+# bench/ with each build. Speedups are relative to the first configuration.
+#
+#   bench/bench.sh [script.lox ...]
+#
+# CC, OPT, RUNS and CONFIGS can be overridden from the environment.
+# CONFIGS is a list of name=flags, with flags separated by commas.
+
+cd "$(dirname "$0")/.." || exit 1
+
+CC=${CC:-gcc}
+OPT=${OPT:--O2}
+RUNS=${RUNS:-5}
+CONFIGS=${CONFIGS:-"switch=-DNO_COMPUTED_GOTO,-DNO_REGISTER_STATE goto=-DNO_REGISTER_STATE register="}
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+build() {
+    name=$1
+    shift
+    $CC $OPT -w -Iinclude "$@" -o "$OUT/$name" src/*.c || exit 1
+}
+
+# Best wall-clock time of $RUNS runs, in seconds.
+best() {
+    bin=$1
+    script=$2
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        start=$(date +%s%N)
+        "$bin" "$script" > /dev/null || exit 1
+        end=$(date +%s%N)
+        echo $((end - start))
+        i=$((i + 1))
+    done | sort -n | head -n 1 | awk '{ printf "%.3f", $1 / 1e9 }'
+}
+
+names=""
+for config in $CONFIGS; do
+    name=${config%%=*}
+    # shellcheck disable=SC2046
+    build "$name" $(echo "${config#*=}" | tr ',' ' ')
+    names="$names $name"
+done
+
+if [ $# -eq 0 ]; then
+    set -- bench/*.lox
+fi
+
+printf "%-24s" "script"
+for name in $names; do printf " %10s" "$name"; done
+printf " %8s\n" "speedup"
+for script in "$@"; do
+    printf "%-24s" "$(basename "$script")"
+    first=""
+    last=""
+    for name in $names; do
+        t=$(best "$OUT/$name" "$script")
+        printf " %9ss" "$t"
+        [ -z "$first" ] && first=$t
+        last=$t
+    done
+    printf " %7.2fx\n" "$(awk "BEGIN { print $first / $last }")"
+done
@@ -0,0 +1,40 @@
+#!/bin/sh
+# Counts the instructions each backend executes for every script in
+# bench/: the stack bytecode run by run() and the register code from
+# compileRegisters(). The reduction is stack / register.
+#
+#   bench/instructions.sh [script.lox ...]
+#
+# CC can be overridden from the environment.
+
+cd "$(dirname "$0")/.." || exit 1
+
+CC=${CC:-gcc}
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+$CC -O2 -w -Iinclude -DCOUNT_INSTRUCTIONS -o "$OUT/clox" src/*.c || exit 1
+
+# Instructions executed by one run; the output has to match the other
+# backend's.
+count() {
+    "$OUT/clox" "$@" > "$OUT/output" 2> "$OUT/count" || exit 1
+    tail -n 1 "$OUT/count" | awk '{ print $1 }'
+}
+
+if [ $# -eq 0 ]; then
+    set -- bench/*.lox
+fi
+
+printf "%-24s %14s %14s %10s\n" "script" "stack" "register" "reduction"
+for script in "$@"; do
+    stack=$(count "$script")
+    cp "$OUT/output" "$OUT/expected"
+    register=$(count --registers "$script")
+    if ! cmp -s "$OUT/output" "$OUT/expected"; then
+        echo "$script: backends disagree" >&2
+        exit 1
+    fi
+    printf "%-24s %14s %14s %9.2fx\n" "$(basename "$script")" \
+        "$stack" "$register" "$(awk "BEGIN { print $stack / $register }")"
+done
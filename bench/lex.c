@@ -0,0 +1,73 @@
+// Lexing throughput: scans a file RUNS times with scanToken() and prints
+// the best rate in MB/s, with a checksum of the token stream that has to
+// match between builds. Built by bench/lex.sh against the scanner alone.
+//
+//   lex file [runs]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../include/common.h"
+#include "../include/scanner.h"
+
+static char* readFile(const char* path, long* size) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+    fseek(file, 0L, SEEK_END);
+    *size = ftell(file);
+    rewind(file);
+    char* buffer = malloc(*size + 1);
+    if (buffer == NULL || fread(buffer, 1, *size, file) != (size_t) *size) {
+        fclose(file);
+        return NULL;
+    }
+    buffer[*size] = '\0';
+    fclose(file);
+    return buffer;
+}
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+int main(int argc, const char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: lex file [runs]\n");
+        return 64;
+    }
+    long size;
+    char* source = readFile(argv[1], &size);
+    if (source == NULL) {
+        fprintf(stderr, "Could not read \"%s\".\n", argv[1]);
+        return 74;
+    }
+    int runs = argc > 2 ? atoi(argv[2]) : 5;
+
+    double best = 0;
+    uint64_t checksum = 0;
+    long tokens = 0;
+    for (int run = 0; run < runs; run++) {
+        double start = now();
+        initScanner(source);
+        checksum = 0;
+        tokens = 0;
+        Token token;
+        do {
+            token = scanToken();
+            // Error tokens carry no position.
+            int position = token.type == TOKEN_ERROR ? 0 : token.charPosition;
+            checksum = checksum * 31 + (uint64_t) token.type * 1000003 +
+                       (uint64_t) token.line * 8191 + (uint64_t) position * 127 +
+                       (uint64_t) token.length;
+            tokens++;
+        } while (token.type != TOKEN_EOF);
+        double rate = size / (now() - start) / 1e6;
+        if (rate > best) best = rate;
+    }
+    printf("%.1f %ld %016llx\n", best, tokens, (unsigned long long) checksum);
+    free(source);
+    return 0;
+}
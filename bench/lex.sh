@@ -0,0 +1,56 @@
+#!/bin/sh
+# Lexing throughput of the scanner in MB/s, on a large synthetic script
+# of declarations, loops, long identifiers, numbers, strings, comments and
+# indentation, for each configuration. Every build has to produce the same
+# tokens. Speedups are relative to the first configuration.
+#
+#   bench/lex.sh [megabytes]
+#
+# CC, OPT, RUNS and CONFIGS can be overridden from the environment, as in
+# bench/bench.sh.
+
+cd "$(dirname "$0")/.." || exit 1
+
+CC=${CC:-gcc}
+OPT=${OPT:--O2}
+RUNS=${RUNS:-5}
+CONFIGS=${CONFIGS:-"scalar=-DNO_SIMD sse2= avx2=-mavx2"}
+MEGABYTES=${1:-32}
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+awk -v bytes=$((MEGABYTES * 1000000)) 'BEGIN {
+    srand(1)
+    while (size < bytes) {
+        n = int(rand() * 1000)
+        line = "var accumulatedValue_" n " = " int(rand() * 100000) "." n ";"
+        line = line "\n// Running total for stage " n ", refreshed every pass"
+        line = line "\nwhile (accumulatedValue_" n " < 1000000) {"
+        line = line "\n        accumulatedValue_" n " = accumulatedValue_" n " * 2 + 17;"
+        line = line "\n        print \"stage " n " is still accumulating, value so far:\";"
+        line = line "\n}\n\n"
+        printf "%s", line
+        size += length(line)
+    }
+}' > "$OUT/source.lox"
+
+printf "%-10s %10s %8s\n" "config" "MB/s" "speedup"
+first=""
+expected=""
+for config in $CONFIGS; do
+    name=${config%%=*}
+    # shellcheck disable=SC2046
+    $CC $OPT -w -Iinclude $(echo "${config#*=}" | tr ',' ' ') \
+        -o "$OUT/$name" bench/lex.c src/scanner.c || exit 1
+    set -- $("$OUT/$name" "$OUT/source.lox" "$RUNS")
+    rate=$1
+    tokens="$2 $3"
+    if [ -z "$expected" ]; then
+        expected=$tokens
+    elif [ "$tokens" != "$expected" ]; then
+        echo "$name: token streams disagree" >&2
+        exit 1
+    fi
+    [ -z "$first" ] && first=$rate
+    printf "%-10s %10s %7.2fx\n" "$name" "$rate" "$(awk "BEGIN { print $rate / $first }")"
+done
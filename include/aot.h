@@ -0,0 +1,15 @@
+#ifndef clox_aot_h
+#define clox_aot_h
+
+#include <stdio.h>
+
+#include "common.h"
+
+// Ahead-of-time backend: compiles source like interpret() would and
+// writes the chunk to out as a standalone C program, one statement per
+// instruction and a goto per jump, built on aot_runtime.h. Link it
+// against libclox.a (make lib). Returns false on a compile error, after
+// reporting it.
+bool emitC(const char* source, FILE* out);
+
+#endif
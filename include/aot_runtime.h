@@ -0,0 +1,163 @@
+#ifndef clox_aot_runtime_h
+#define clox_aot_runtime_h
+
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "object.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+
+// Included by the C that emitC() writes, which links against libclox.a
+// and must be built with the same DEFINES. The generated run() keeps the
+// stack pointer in a local, sp, and every instruction becomes one of the
+// statements below, so each one does what its handler in run() does.
+// Errors carry the source line the emitter looked up for the
+// instruction.
+
+#define PUSH(value) (*sp++ = (value))
+#define PEEK(distance) (sp[-1 - (distance)])
+#define DROP(count) (sp -= (count))
+
+#define NUMBERS_MESSAGE "Operands must be numbers."
+#define ADD_MESSAGE "Operands must be two numbers or two strings"
+
+#define RUNTIME_ERROR(line, ...) \
+        do { \
+            aotError(line, __VA_ARGS__); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } while(false)
+
+#define GET_GLOBAL(line, slot) \
+        do { \
+            if (IS_UNDEFINED(globals[slot])) { \
+                RUNTIME_ERROR(line, "Undefined variable '%s'.", \
+                              aotGlobalName(slot)); \
+            } \
+            PUSH(globals[slot]); \
+        } while(false)
+#define SET_GLOBAL(line, slot) \
+        do { \
+            if (IS_UNDEFINED(globals[slot])) { \
+                RUNTIME_ERROR(line, "Undefined variable '%s'.", \
+                              aotGlobalName(slot)); \
+            } \
+            globals[slot] = PEEK(0); \
+        } while(false)
+
+// function(a, b, &result) is one of the xNumbers() helpers of value.h or
+// aotAdd().
+#define BINARY_OP(line, function, message) \
+        do { \
+            Value result; \
+            if (!function(PEEK(1), PEEK(0), &result)) { \
+                RUNTIME_ERROR(line, message); \
+            } \
+            DROP(1); \
+            PEEK(0) = result; \
+        } while(false)
+#define UNCHECKED_OP(function) \
+        do { \
+            Value result = function(PEEK(1), PEEK(0)); \
+            DROP(1); \
+            PEEK(0) = result; \
+        } while(false)
+#define LOCAL_CONSTANT_OP(line, function, message, slot, constant) \
+        do { \
+            Value result; \
+            if (!function(stack[slot], constants[constant], &result)) { \
+                RUNTIME_ERROR(line, message); \
+            } \
+            PUSH(result); \
+        } while(false)
+
+// Every comparison is a < b with the operands in either order, negated
+// or not: a > b is b < a and a <= b is !(b < a), which holds for NaN too.
+#define COMPARE_OP(line, a, b, negate) \
+        do { \
+            bool holds; \
+            if (!aotLess(a, b, &holds)) RUNTIME_ERROR(line, NUMBERS_MESSAGE); \
+            DROP(1); \
+            PEEK(0) = BOOL_VAL(holds != (negate)); \
+        } while(false)
+// Pops both operands and jumps unless the comparison holds.
+#define COMPARE_JUMP(line, a, b, negate, label) \
+        do { \
+            bool holds; \
+            if (!aotLess(a, b, &holds)) RUNTIME_ERROR(line, NUMBERS_MESSAGE); \
+            DROP(2); \
+            if (holds == (negate)) goto label; \
+        } while(false)
+#define EQUAL_JUMP(equal, label) \
+        do { \
+            DROP(2); \
+            if (valuesEqual(sp[0], sp[1]) == (equal)) goto label; \
+        } while(false)
+
+// counter is the variable itself, which the step is added to in place.
+// The loop continues at label while the counter compares to the bound as
+// COMPARE_OP() would; a bound that is not a number falls through to the
+// loop header, whose condition reports it.
+#define COUNTED_LOOP(line, kinds, slot, counter, step, bound, swap, negate, \
+                     label) \
+        do { \
+            Value left; \
+            if (!addNumbers(counter, step, &left)) { \
+                aotCountedLoopError(line, kinds, slot); \
+                return INTERPRET_RUNTIME_ERROR; \
+            } \
+            counter = left; \
+            Value right = (bound); \
+            bool holds; \
+            if ((swap) ? aotLess(right, left, &holds) \
+                       : aotLess(left, right, &holds)) { \
+                if (holds != (negate)) goto label; \
+            } \
+        } while(false)
+
+// The same message and line report runtimeError() prints.
+void aotError(int line, const char* format, ...);
+void aotCountedLoopError(int line, int kinds, int slot);
+const char* aotGlobalName(int slot);
+// Reserves the next global slot for name, in the order the compiler did.
+void aotGlobal(const char* name, int length);
+
+static inline Value aotDouble(uint64_t bits) {
+    double number;
+    memcpy(&number, &bits, sizeof(number));
+    return NUMBER_VAL(number);
+}
+
+static inline Value aotString(const char* chars, int length) {
+    return OBJ_VAL(copyString(chars, length));
+}
+
+// *holds = a < b, false if either one is not a number.
+static inline bool aotLess(Value a, Value b, bool* holds) {
+    if (LIKELY(ARE_INTS(a, b))) {
+        *holds = AS_INT(a) < AS_INT(b);
+        return true;
+    }
+    double x, y;
+    if (!toDoubles(a, b, &x, &y)) return false;
+    *holds = x < y;
+    return true;
+}
+
+// OP_ADD: two strings concatenate, anything else must be two numbers.
+static inline bool aotAdd(Value a, Value b, Value* result) {
+    if (IS_STRING(a) && IS_STRING(b)) {
+        *result = OBJ_VAL(concatenateStrings(AS_STRING(a), AS_STRING(b)));
+        return true;
+    }
+    return addNumbers(a, b, result);
+}
+
+static inline void aotPrint(Value value) {
+    printValue(value);
+    printf("\n");
+}
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef clox_assembler_h
+#define clox_assembler_h
+
+#include "common.h"
+
+// Native code generation is only wired up for x86-64 on Linux, where the
+// tagged values are NaN-boxed and fit in a general purpose register.
+#if defined(__x86_64__) && defined(__linux__) && defined(NAN_BOXING)
+#define JIT_SUPPORTED
+#endif
+
+typedef enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+} Register;
+
+typedef enum {
+    XMM0, XMM1, XMM2, XMM3, XMM4, XMM5, XMM6, XMM7,
+    XMM8, XMM9, XMM10, XMM11, XMM12, XMM13, XMM14, XMM15,
+} XmmRegister;
+
+// Condition codes, as used in the low nibble of Jcc/SETcc.
+typedef enum {
+    CC_O = 0x0, CC_NO = 0x1, CC_B = 0x2, CC_AE = 0x3,
+    CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7,
+    CC_S = 0x8, CC_NS = 0x9, CC_P = 0xa, CC_NP = 0xb,
+    CC_L = 0xc, CC_GE = 0xd, CC_LE = 0xe, CC_G = 0xf,
+} Condition;
+
+typedef struct {
+    int count;
+    int capacity;
+    uint8_t* code;
+} Assembler;
+
+// Machine code copied into its own executable mapping.
+typedef struct {
+    void* code;
+    size_t size;
+} Executable;
+
+void initAssembler(Assembler* as);
+void freeAssembler(Assembler* as);
+bool makeExecutable(Assembler* as, Executable* executable);
+void freeExecutable(Executable* executable);
+
+void asmByte(Assembler* as, uint8_t byte);
+void asmInt32(Assembler* as, int32_t value);
+void asmInt64(Assembler* as, uint64_t value);
+
+void asmPush(Assembler* as, Register reg);
+void asmPop(Assembler* as, Register reg);
+void asmRet(Assembler* as);
+void asmMovImm32(Assembler* as, Register dst, uint32_t value);
+void asmMovImm64(Assembler* as, Register dst, uint64_t value);
+void asmMovReg(Assembler* as, Register dst, Register src);
+void asmLoad(Assembler* as, Register dst, Register base, int32_t disp);
+void asmStore(Assembler* as, Register base, int32_t disp, Register src);
+void asmAddMem(Assembler* as, Register base, int32_t disp, int32_t value);
+void asmSubMem(Assembler* as, Register base, int32_t disp, int32_t value);
+void asmAddImm(Assembler* as, Register dst, int32_t value);
+void asmSubImm(Assembler* as, Register dst, int32_t value);
+void asmCmp(Assembler* as, Register a, Register b);
+void asmAnd(Assembler* as, Register dst, Register src);
+void asmTest32(Assembler* as, Register a, Register b);
+void asmCall(Assembler* as, void* function);
+
+// Jumps are emitted with a rel32 placeholder. The returned position is
+// handed to asmPatch() once the target is known.
+int asmJump(Assembler* as);
+int asmJumpIf(Assembler* as, Condition condition);
+void asmPatch(Assembler* as, int position, int target);
+
+void asmMovsdReg(Assembler* as, XmmRegister dst, XmmRegister src);
+void asmMovqToXmm(Assembler* as, XmmRegister dst, Register src);
+void asmMovqFromXmm(Assembler* as, Register dst, XmmRegister src);
+void asmAddsd(Assembler* as, XmmRegister dst, XmmRegister src);
+void asmSubsd(Assembler* as, XmmRegister dst, XmmRegister src);
+void asmMulsd(Assembler* as, XmmRegister dst, XmmRegister src);
+void asmDivsd(Assembler* as, XmmRegister dst, XmmRegister src);
+void asmUcomisd(Assembler* as, XmmRegister a, XmmRegister b);
+void asmXorpd(Assembler* as, XmmRegister dst, XmmRegister src);
+
+#endif
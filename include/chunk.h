@@ -2,31 +2,30 @@
 #define clox_chunk_h
 
 #include "common.h"
-#include "utils.h"
 #include "value.h"
 #include "line_tracker.h"
+#include "table.h"
 
-#define CONSTANT_LONG_BYTE_SIZE 4
-
-
+// Slot, constant and count operands are unsigned LEB128 varints: seven
+// bits per byte, least significant group first, with the high bit set on
+// every byte but the last. Anything below 128 takes a single byte. Jump
+// offsets are always two bytes, big-endian, so they can be patched.
 
 typedef enum {
-    OP_CONSTANT_LONG,
     OP_CONSTANT,
+    // Small number literals without a constant-pool entry: a whole
+    // number, and a number with one decimal place as its value times ten.
+    OP_INTEGER,
+    OP_DECIMAL,
 	OP_NIL,
 	OP_TRUE,
 	OP_FALSE,
     OP_POP,
     OP_GET_GLOBAL,
-    OP_GET_GLOBAL_LONG,
     OP_GET_LOCAL,
-    OP_GET_LOCAL_LONG,
     OP_DEFINE_GLOBAL,
-    OP_DEFINE_GLOBAL_LONG,
     OP_SET_GLOBAL,
-    OP_SET_GLOBAL_LONG,
     OP_SET_LOCAL,
-    OP_SET_LOCAL_LONG,
 	OP_EQUAL,
 	OP_GREATER,
 	OP_LESS,
@@ -41,6 +40,45 @@ typedef enum {
     OP_JUMP,
     OP_LOOP,
     OP_RETURN,
+    // Superinstructions, only produced by the peephole pass
+    OP_NOT_EQUAL,
+    OP_GREATER_EQUAL,
+    OP_LESS_EQUAL,
+    OP_POPN,
+    OP_POP_JUMP_IF_FALSE,
+    OP_JUMP_IF_NOT_EQUAL,
+    OP_JUMP_IF_EQUAL,
+    OP_JUMP_IF_NOT_GREATER,
+    OP_JUMP_IF_NOT_LESS,
+    OP_JUMP_IF_NOT_GREATER_EQUAL,
+    OP_JUMP_IF_NOT_LESS_EQUAL,
+    OP_ADD_LOCAL_CONSTANT,
+    OP_SUBTRACT_LOCAL_CONSTANT,
+    // Counted loops, emitted by whileStatement() in place of the counter's
+    // increment at the end of the body
+    OP_INCREMENT_LOOP_IF_LESS,
+    OP_INCREMENT_LOOP_IF_LESS_EQUAL,
+    OP_INCREMENT_LOOP_IF_GREATER,
+    OP_INCREMENT_LOOP_IF_GREATER_EQUAL,
+    // Arithmetic without the operand type checks, emitted by the optimizer
+    // where type inference proved the operands are numbers
+    OP_ADD_UNCHECKED,
+    OP_SUBTRACT_UNCHECKED,
+    OP_MULTIPLY_UNCHECKED,
+    OP_DIVIDE_UNCHECKED,
+    OP_NEGATE_UNCHECKED,
+    // Table dispatch for switchStatement(). The value to switch on stays
+    // on the stack, and count + 1 OP_JUMPs follow: one per case, then one
+    // for the default. run() continues at the jump switchCase() picks.
+    OP_SWITCH_INTEGER,  // lowest case constant, count
+    OP_SWITCH_STRING,   // switch table, count
+    // Quickened forms, rewritten in place by run()
+    OP_ADD_GENERIC,
+    OP_ADD_NUMBER,
+    OP_ADD_STRING,
+    OP_ADD_LOCAL_CONSTANT_GENERIC,
+    OP_ADD_LOCAL_NUMBER,
+    OP_SUBTRACT_LOCAL_NUMBER,
 } OpCode;
 
 typedef struct {
@@ -49,14 +87,69 @@ typedef struct {
     uint8_t* code;
     LineArray lines;
     ValueArray constants;
+    // Open-addressed hash from a constant to its index + 1, 0 for a free
+    // entry, so addConstant() gives each distinct value a single slot.
+    int* constantIndex;
+    int constantIndexCapacity;
+    // For OP_SWITCH_STRING: each case string to the index of its jump.
+    Table* switchTables;
+    int switchTableCount;
+    int switchTableCapacity;
 } Chunk;
 
 
+// Where the counter and the bound of a counted loop live. The first
+// operand packs the counter's kind in the low two bits and the bound's
+// in the two above them.
+typedef enum {
+    LOOP_CONSTANT,
+    LOOP_LOCAL,
+    LOOP_GLOBAL,
+} LoopOperand;
+
+#define LOOP_KINDS(counter, bound) ((counter) | ((bound) << 2))
+#define LOOP_COUNTER_KIND(kinds) ((kinds) & 3)
+#define LOOP_BOUND_KIND(kinds) (((kinds) >> 2) & 3)
+// Set when the source subtracts the (negated) step, for error messages.
+#define LOOP_SUBTRACT 0x10
+
+// One decoded instruction. Operands are the slot, constant or count
+// arguments in encoding order; jumps are stored as an absolute target
+// offset instead.
+typedef struct {
+    uint8_t opcode;
+    int length;
+    int operandCount;
+    int operands[4];
+    int target;
+} Instruction;
+
+// OP_INTEGER and OP_DECIMAL take a plain byte instead of a varint, so
+// they are never longer than the OP_CONSTANT they replace.
+#define MAX_IMMEDIATE UINT8_MAX
+
 void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
+void truncateChunk(Chunk* chunk, int count);
+void writeOperand(Chunk* chunk, int operand, int line);
 bool writeConstant(Chunk* chunk, Value value, int line);
 int addConstant(Chunk* chunk, Value value);
+bool immediateNumber(double value, uint8_t* opcode, int* operand);
+Value immediateValue(uint8_t opcode, int operand);
+void decodeInstruction(Chunk* chunk, int offset, Instruction* instruction);
+int encodedLength(Instruction* instruction);
+void writeInstruction(Chunk* chunk, Instruction* instruction, int line);
+bool isJump(uint8_t opcode);
+int addSwitchTable(Chunk* chunk);
+// Which of the jumps after an OP_SWITCH_INTEGER or OP_SWITCH_STRING
+// value selects, count for the default.
+int switchCase(Chunk* chunk, uint8_t opcode, int operand, int count,
+               Value value);
+// The same for a switch on integers from lowest, and on the strings of
+// table.
+int integerCase(Value lowest, int count, Value value);
+int stringCase(Table* table, int count, Value value);
 
 
 #endif
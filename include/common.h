@@ -8,6 +8,80 @@
 
 // #define DEBUG_PRINT_CODE
 // #define DEBUG_TRACE_EXECUTION
+// Count executed instructions in vm.instructionCount and report the total
+// on stderr, see bench/instructions.sh.
+// #define COUNT_INSTRUCTIONS
+
+// Threaded dispatch through a per-opcode jump table in run(). Needs the
+// GCC/Clang labels-as-values extension, build with -DNO_COMPUTED_GOTO to
+// fall back to the portable switch.
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// Pack every Value into a single NaN-boxed 64-bit word. Build with
+// -DNO_NAN_BOXING to get the tagged struct representation instead.
+#if !defined(NO_NAN_BOXING) && !defined(NAN_BOXING)
+#define NAN_BOXING
+#endif
+
+// Keep the stack pointer and the top of the stack in locals of run() so
+// they live in registers. Build with -DNO_REGISTER_STATE to go through
+// vm.stackTop on every instruction instead.
+#ifndef NO_REGISTER_STATE
+#define REGISTER_STATE
+#endif
+
+// Pipelined compile-and-execute (--pipeline) runs the compiler on a
+// second thread. Needs POSIX threads, build with -DNO_THREADS to leave it
+// out.
+#if !defined(NO_THREADS) && (defined(__unix__) || defined(__APPLE__))
+#define PIPELINE
+#endif
+
+// Scan runs of whitespace, identifier and digit characters, strings and
+// comments a 16-byte SSE2 block at a time, or 32 bytes with AVX2 (build
+// with -mavx2). Unoptimized builds, where it is slower, and builds with
+// -DNO_SIMD scan one character at a time.
+#if defined(__GNUC__) && defined(__SSE2__) && defined(__OPTIMIZE__) && \
+    !defined(NO_SIMD)
+#define SCANNER_SIMD
+#endif
+
+// Marks the common outcome of a test on a hot path, such as the integer
+// fast paths in run(), so the compiler lays it out as the fall-through.
+#ifdef __GNUC__
+#define LIKELY(condition) __builtin_expect(!!(condition), 1)
+#else
+#define LIKELY(condition) (condition)
+#endif
+
+// *result = a op b on int64_t, true if that overflowed. GCC and Clang read
+// the overflow flag of the processor.
+#ifdef __GNUC__
+#define ADD_OVERFLOWS(a, b, result) __builtin_add_overflow(a, b, result)
+#define SUBTRACT_OVERFLOWS(a, b, result) __builtin_sub_overflow(a, b, result)
+#define MULTIPLY_OVERFLOWS(a, b, result) __builtin_mul_overflow(a, b, result)
+#else
+static inline bool addOverflows(int64_t a, int64_t b, int64_t* result) {
+	*result = (int64_t)((uint64_t)a + (uint64_t)b);
+	return ((a ^ *result) & (b ^ *result)) < 0;
+}
+
+static inline bool subtractOverflows(int64_t a, int64_t b, int64_t* result) {
+	*result = (int64_t)((uint64_t)a - (uint64_t)b);
+	return ((a ^ b) & (a ^ *result)) < 0;
+}
+
+static inline bool multiplyOverflows(int64_t a, int64_t b, int64_t* result) {
+	*result = (int64_t)((uint64_t)a * (uint64_t)b);
+	return a != 0 && ((a == -1 && b == INT64_MIN) || *result / a != b);
+}
+
+#define ADD_OVERFLOWS(a, b, result) addOverflows(a, b, result)
+#define SUBTRACT_OVERFLOWS(a, b, result) subtractOverflows(a, b, result)
+#define MULTIPLY_OVERFLOWS(a, b, result) multiplyOverflows(a, b, result)
+#endif
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
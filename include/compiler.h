@@ -3,9 +3,19 @@
 
 #include "object.h"
 #include "vm.h"
+#include "regvm.h"
 
 
 bool compile(const char* source, Chunk* chunk);
+// Compiles source a batch of top-level declarations at a time, for
+// pipelined execution. Each batch becomes a chunk of its own that is
+// handed to emit, which frees it. After a compile error the rest of the
+// source is still parsed for errors, but nothing more is emitted.
+typedef void (*SegmentFunction)(Chunk* segment, void* context);
+bool compileSegments(const char* source, SegmentFunction emit, void* context);
+// Register backend: lowers a compiled chunk to the three-address form in
+// regvm.h. Returns false for code it cannot lower.
+bool compileRegisters(Chunk* chunk, RegisterChunk* registers);
 
 
 #endif
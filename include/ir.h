@@ -0,0 +1,98 @@
+#ifndef clox_ir_h
+#define clox_ir_h
+
+#include "chunk.h"
+
+// Intermediate form of a chunk for the optimizer: basic blocks of
+// statements whose operands are expression trees. buildIR() lifts the
+// stack code the compiler emitted, before peepholeOptimize(), and
+// emitIR() writes it back. A tree is evaluated in postorder, which is
+// the order the stack code ran in, so passes may rewrite a node but not
+// move one past another.
+//
+// Locals live in stack slots, and so do the values the stack code keeps
+// across a jump, such as the condition of OP_JUMP_IF_FALSE or the left
+// operand of `and`. A NODE_LOCAL reads such a slot; a NODE_STACK takes
+// the value off the stack where it already is and emits no code.
+
+typedef enum {
+    NODE_CONSTANT,      // value
+    NODE_STACK,         // slot, popped by the node's parent
+    NODE_LOCAL,         // slot
+    NODE_GLOBAL,        // slot
+    NODE_UNARY,         // opcode operands[0]
+    NODE_BINARY,        // operands[0] opcode operands[1]
+    NODE_SET_LOCAL,     // slot = operands[0]
+    NODE_SET_GLOBAL,
+} NodeKind;
+
+typedef struct {
+    NodeKind kind;
+    uint8_t opcode;
+    int slot;
+    int operands[2];    // node indices
+    Value value;
+    int line;
+} IRNode;
+
+typedef enum {
+    STATEMENT_PUSH,     // leaves node on the stack, in slot
+    STATEMENT_EVAL,     // evaluates node for its effects and pops it
+    STATEMENT_PRINT,
+    STATEMENT_DEFINE_GLOBAL,    // global slot = node
+} StatementKind;
+
+typedef struct {
+    StatementKind kind;
+    int node;
+    int slot;
+    int line;
+    bool removed;
+} IRStatement;
+
+typedef struct {
+    IRStatement* statements;
+    int count;
+    int capacity;
+    int depth;          // stack depth on entry
+    // The jump, branch, counted loop or return ending the block, with
+    // target as a block index. Without one the block falls through.
+    bool hasExit;
+    Instruction exit;
+    int exitLine;
+} IRBlock;
+
+typedef struct {
+    Chunk* chunk;
+    IRNode* nodes;
+    int nodeCount;
+    int nodeCapacity;
+    IRBlock* blocks;
+    int blockCount;
+    int blockCapacity;
+    // One more than the deepest stack slot the code touches.
+    int slotCount;
+} IR;
+
+// Returns false, with nothing to free, for code it cannot lift.
+bool buildIR(Chunk* chunk, IR* ir);
+void freeIR(IR* ir);
+// Replaces the code of ir->chunk. Returns false and leaves the chunk as
+// it was if a jump no longer fits its 16-bit offset.
+bool emitIR(IR* ir);
+
+// For passes that restructure the code. Adding a node may move the
+// nodes array.
+int addNode(IR* ir, NodeKind kind, int line);
+void insertStatement(IR* ir, int block, int index, StatementKind kind,
+                     int node, int slot, int line);
+// Inserts an empty block at index, which falls through to the block that
+// was there. Jump targets are renumbered to match.
+void insertBlock(IR* ir, int index, int depth);
+
+// Blocks control can go to after block, at most two.
+int blockSuccessors(IR* ir, int block, int successors[2]);
+// Stack depth after the statements of block, before its exit.
+int exitDepth(IR* ir, int block);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "assembler.h"
+#include "chunk.h"
+#include "vm.h"
+
+typedef InterpretResult (*JitEntry)();
+
+typedef struct {
+    JitEntry entry;
+#ifdef JIT_SUPPORTED
+    Executable executable;
+#endif
+} JitFunction;
+
+// Translates a finished chunk into native code. Returns false when the
+// platform or the chunk is not supported, in which case the caller runs
+// the chunk with the interpreter instead.
+bool jitCompile(Chunk* chunk, JitFunction* function);
+void jitFree(JitFunction* function);
+
+#endif
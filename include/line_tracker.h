@@ -14,6 +14,8 @@ typedef struct {
 void initLineArray(LineArray* array);
 void writeLineArray(LineArray* array, int value);
 void freeLineArray(LineArray* array);
+// Keeps the lines of the first count bytes.
+void truncateLineArray(LineArray* array, int count);
 int getLine(LineArray* array, int index);
 
 #endif
\ No newline at end of file
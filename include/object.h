@@ -30,6 +30,7 @@ struct ObjString {
 
 ObjString* takeString(char* chars, int length);
 ObjString* copyString(const char * chars, int length);
+ObjString* concatenateStrings(ObjString* a, ObjString* b);
 
 void printObject(Value value);
 
@@ -0,0 +1,11 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "chunk.h"
+
+// Optimizing pipeline behind --optimize: lifts the chunk to the IR in
+// ir.h, runs the passes over it and emits it again. Code it cannot lift
+// is left alone.
+void optimizeChunk(Chunk* chunk);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef clox_pipeline_h
+#define clox_pipeline_h
+
+#include "common.h"
+#include "vm.h"
+
+#ifdef PIPELINE
+// Pipelined compile-and-execute (--pipeline). A second thread compiles
+// the script in segments of whole top-level declarations while this one
+// runs each segment as it arrives, so output starts before the rest of a
+// long script has been compiled.
+//
+// The two threads share the interned strings, which object.c locks while
+// vm.pipelining is set, and the global slots, whose arrays are reserved up
+// front so they never move under run(). The optimizer cannot know what
+// earlier segments have stored in globals yet and treats them as unknown.
+//
+// A runtime error stops execution; the compiler still finishes, so
+// syntax errors further on are reported as they would be otherwise.
+InterpretResult interpretPipelined(const char* source);
+#endif
+
+#endif
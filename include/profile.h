@@ -0,0 +1,49 @@
+#ifndef clox_profile_h
+#define clox_profile_h
+
+#include "chunk.h"
+
+// Type feedback for profile-guided compilation. With --profile, run()
+// records which operand types each add instruction saw, by byte offset,
+// and main() writes them to a file keyed by a hash of the source. A later
+// --use-profile compile of the same source, which produces the same
+// chunk, rewrites every site that saw one kind of operand to the guarded
+// quickened form for it, and the others to the generic form.
+//
+// run() only records in the generic handlers: a quickened form falls
+// back to its generic handler whenever its guard fails, so every new
+// kind of operand passes through one, and the hot paths stay untouched.
+
+typedef enum {
+    SEEN_NUMBERS = 1,
+    SEEN_STRINGS = 2,
+    SEEN_OTHER = 4,     // mixed, or neither; an error
+} TypeSeen;
+
+typedef struct {
+    uint64_t sourceHash;
+    // Compiled through the optimizer, which changes the chunk.
+    bool optimized;
+    int count;
+    // TypeSeen bits at every byte offset of the chunk.
+    uint8_t* seen;
+} TypeProfile;
+
+void initProfile(TypeProfile* profile, const char* source);
+void freeProfile(TypeProfile* profile);
+// Sizes the profile for the chunk about to run, dropping what it held.
+void resetProfile(TypeProfile* profile, Chunk* chunk);
+uint8_t typesSeen(Value a, Value b);
+
+static inline void recordTypes(TypeProfile* profile, int offset,
+                               Value a, Value b) {
+    profile->seen[offset] |= typesSeen(a, b);
+}
+
+bool writeProfile(TypeProfile* profile, const char* path);
+// False if the file cannot be read or was not recorded for source, with
+// the current compile flags.
+bool readProfile(TypeProfile* profile, const char* path, const char* source);
+void specializeChunk(Chunk* chunk, TypeProfile* profile);
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef clox_regvm_h
+#define clox_regvm_h
+
+#include "chunk.h"
+#include "vm.h"
+
+// Register-based, three-address form of a chunk, produced by
+// compileRegisters() and run by runRegisters(). Register r is vm.stack[r],
+// so a local's stack slot is its register, and every other register
+// holds the temporary that the stack code keeps at that depth.
+
+typedef enum {
+    REG_MOVE,           // dst = a; dst may be a global being defined
+    REG_SET_GLOBAL,     // dst = a; dst is a global that must be defined
+    REG_EQUAL,          // dst = a op b
+    REG_NOT_EQUAL,
+    REG_GREATER,
+    REG_GREATER_EQUAL,
+    REG_LESS,
+    REG_LESS_EQUAL,
+    REG_ADD,
+    REG_SUBTRACT,
+    REG_MULTIPLY,
+    REG_DIVIDE,
+    REG_NOT,            // dst = op a
+    REG_NEGATE,
+    REG_PRINT,          // print a
+    REG_JUMP,
+    REG_JUMP_IF_FALSE,  // if a is falsey
+    REG_JUMP_IF_EQUAL,  // if a op b
+    REG_JUMP_IF_NOT_EQUAL,
+    REG_JUMP_IF_NOT_GREATER,
+    REG_JUMP_IF_NOT_GREATER_EQUAL,
+    REG_JUMP_IF_NOT_LESS,
+    REG_JUMP_IF_NOT_LESS_EQUAL,
+    REG_LOOP_IF_LESS,   // if a op b; falls through if either is not a number
+    REG_LOOP_IF_LESS_EQUAL,
+    REG_LOOP_IF_GREATER,
+    REG_LOOP_IF_GREATER_EQUAL,
+    REG_RETURN,
+} RegisterOp;
+
+typedef enum {
+    ARG_NONE,
+    ARG_REGISTER,
+    ARG_CONSTANT,
+    ARG_GLOBAL,
+} ArgKind;
+
+typedef struct {
+    ArgKind kind;
+    int index;
+} RegisterArg;
+
+typedef struct RegisterInstruction {
+    uint8_t opcode;
+    // Resolved by runRegisters() from args and target.
+    Value* dst;
+    Value* a;
+    Value* b;
+    struct RegisterInstruction* jump;
+
+    RegisterArg args[3];    // dst, a, b
+    int target;             // instruction index of a jump
+    int offset;             // stack instruction it came from, for lines
+} RegisterInstruction;
+
+typedef struct {
+    int count;
+    int capacity;
+    RegisterInstruction* code;
+    int registerCount;
+} RegisterChunk;
+
+void initRegisterChunk(RegisterChunk* chunk);
+void freeRegisterChunk(RegisterChunk* chunk);
+int writeRegisterInstruction(RegisterChunk* chunk,
+                             RegisterInstruction* instruction);
+
+// Runs chunk against vm.chunk, the stack chunk it was compiled from.
+InterpretResult runRegisters(RegisterChunk* chunk);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef clox_threaded_h
+#define clox_threaded_h
+
+#include "chunk.h"
+
+// A chunk translated for run(): one entry per instruction, with operands
+// decoded to full integers and jump targets resolved to entries. With
+// computed gotos every entry also carries the address of its handler, so
+// dispatch is a single indirect jump (direct threading).
+typedef struct ThreadedInstruction {
+    void* handler;
+    struct ThreadedInstruction* target;
+    int operands[4];
+    uint8_t opcode;
+} ThreadedInstruction;
+
+typedef struct {
+    ThreadedInstruction* code;
+    int count;
+    // Byte offset in the chunk of every entry, plus one for the end.
+    int* offsets;
+    // Entry starting at every byte offset of the chunk, -1 elsewhere.
+    int* entries;
+    int chunkCount;
+} ThreadedCode;
+
+// handlers maps opcodes to handler addresses; NULL leaves them unset.
+void threadChunk(ThreadedCode* code, Chunk* chunk, void** handlers);
+void freeThreadedCode(ThreadedCode* code);
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef clox_trace_h
+#define clox_trace_h
+
+#include "chunk.h"
+
+// Tracing tier for hot loops. run() counts how often each OP_LOOP
+// back-edge is taken; once a loop is hot, one iteration is recorded as a
+// linear, type-specialized trace and compiled to native code. Traces run
+// until a guard fails and then hand the interpreter the exact ip and
+// stack it would have had at that point.
+
+void initTraces(Chunk* chunk);
+void freeTraces();
+
+// Called by run() after the back-edge at loopOffset was taken, with vm.ip
+// at the loop header. May run a trace, which moves vm.ip and vm.stackTop
+// to wherever the trace exits.
+void traceLoop(int loopOffset);
+
+#endif
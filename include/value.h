@@ -1,16 +1,90 @@
 #ifndef clox_value_h
 #define clox_value_h
 
+#include <math.h>
+#include <string.h>
+
 #include "common.h"
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
 
+#ifdef NAN_BOXING
+
+// Numbers are stored as plain doubles. Every other value lives inside the
+// payload of a quiet NaN: the singletons nil/false/true use small tags in
+// the low bits, objects set the sign bit and keep the pointer in the low
+// 48 bits. Integers set all of the top 16 bits and keep a 48-bit two's
+// complement payload, so two values are both integers exactly when their
+// bitwise and is one.
+#define SIGN_BIT	((uint64_t)0x8000000000000000)
+#define QNAN		((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL		1 // 01.
+#define TAG_FALSE	2 // 10.
+#define TAG_TRUE	3 // 11.
+#define TAG_UNDEFINED	4 // 100.
+#define TAG_INT		((uint64_t)0xffff000000000000)
+
+typedef uint64_t Value;
+
+#define IS_BOOL(value)	  (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value)     ((value) == NIL_VAL)
+#define IS_UNDEFINED(value)	((value) == UNDEFINED_VAL)
+#define IS_DOUBLE(value)  (((value) & QNAN) != QNAN)
+#define IS_INT(value)	  (((value) >> 48) == (TAG_INT >> 48))
+#define ARE_INTS(a, b)	  IS_INT((a) & (b))
+#define IS_NUMBER(value)  (IS_DOUBLE(value) | IS_INT(value))
+#define IS_OBJ(value)	  (((value) >> 48) == ((SIGN_BIT | QNAN) >> 48))
+
+#define AS_OBJ(value) \
+		((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+#define AS_BOOL(value)	  ((value) == TRUE_VAL)
+#define AS_INT(value)	  (AS_INT_BITS(value) >> 16)
+// The integer shifted up into the top 48 bits, where overflowing 64-bit
+// arithmetic is overflowing integer arithmetic.
+#define AS_INT_BITS(value) ((int64_t)((value) << 16))
+#define AS_DOUBLE(value)  valueToNum(value)
+#define AS_NUMBER(value)  valueToNumber(value)
+
+#define BOOL_VAL(b)       ((b) ? TRUE_VAL : FALSE_VAL)
+#define FALSE_VAL		  ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL		  ((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define NIL_VAL			  ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL	  ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define NUMBER_VAL(num)   numToValue(num)
+#define INT_VAL(i)		  ((Value)(TAG_INT | ((uint64_t)(int64_t)(i) & ~TAG_INT)))
+#define INT_BITS_VAL(bits) ((Value)(TAG_INT | ((uint64_t)(bits) >> 16)))
+#define OBJ_VAL(obj) \
+		(Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
+
+static inline double valueToNum(Value value) {
+	double num;
+	memcpy(&num, &value, sizeof(Value));
+	return num;
+}
+
+static inline Value numToValue(double num) {
+	Value value;
+	memcpy(&value, &num, sizeof(double));
+	return value;
+}
+
+// Either kind of number as a double.
+static inline double valueToNumber(Value value) {
+	Value widened = numToValue((double)AS_INT(value));
+	return valueToNum(IS_INT(value) ? widened : value);
+}
+
+#else
+
 typedef enum {
 	VAL_BOOL,
 	VAL_NIL,
 	VAL_NUMBER,
+	VAL_INT,
 	VAL_OBJ,
+	VAL_UNDEFINED,
 } ValueType;
 
 typedef struct {
@@ -18,23 +92,182 @@ typedef struct {
 	union {
 		bool boolean;
 		double number;
+		int64_t integer;
 		Obj* obj;
 	} as;
 } Value;
 
 #define IS_BOOL(value)	  ((value).type == VAL_BOOL)
 #define IS_NIL(value)     ((value).type == VAL_NIL)
-#define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
+#define IS_UNDEFINED(value)	((value).type == VAL_UNDEFINED)
+#define IS_DOUBLE(value)  ((value).type == VAL_NUMBER)
+#define IS_INT(value)	  ((value).type == VAL_INT)
+#define ARE_INTS(a, b)	  (IS_INT(a) && IS_INT(b))
+#define IS_NUMBER(value)  (IS_DOUBLE(value) || IS_INT(value))
 #define IS_OBJ(value)  ((value).type == VAL_OBJ)
 
 #define AS_OBJ(value)     ((value).as.obj)
 #define AS_BOOL(value)	  ((value).as.boolean)
-#define AS_NUMBER(value)  ((value).as.number)
+#define AS_INT(value)	  ((value).as.integer)
+#define AS_INT_BITS(value) ((int64_t)((uint64_t)(value).as.integer << 16))
+#define AS_DOUBLE(value)  ((value).as.number)
+#define AS_NUMBER(value)  valueToNumber(value)
 
 #define BOOL_VAL(value)   ((Value) {VAL_BOOL, {.boolean = value}})
 #define NIL_VAL			  ((Value) {VAL_NIL, {.number = 0}})
+#define UNDEFINED_VAL	  ((Value) {VAL_UNDEFINED, {.number = 0}})
 #define NUMBER_VAL(value) ((Value) {VAL_NUMBER, {.number = value}})
-#define OBJ_VAL(value)    ((Value) {VAL_OBJ, {.obj = value}})
+#define INT_VAL(value)	  ((Value) {VAL_INT, {.integer = value}})
+#define INT_BITS_VAL(bits) INT_VAL((bits) >> 16)
+#define OBJ_VAL(value)    ((Value) {VAL_OBJ, {.obj = (Obj*)value}})
+
+static inline double valueToNumber(Value value) {
+	return IS_INT(value) ? (double)AS_INT(value) : value.as.number;
+}
+
+#endif
+
+// UNDEFINED_VAL marks global slots that have been reserved by the compiler
+// but not defined yet. It never reaches Lox code.
+
+// Numbers are either doubles or 48-bit integers, and Lox cannot tell the
+// two apart: an integer behaves exactly like the double of the same value.
+// Integer arithmetic stays integer while the exact result fits, anything
+// else produces a double. -0 is always a double.
+#define INTEGER_MAX	(((int64_t)1 << 47) - 1)
+#define INTEGER_MIN	(-((int64_t)1 << 47))
+
+// a op b for two integers into *result, false if it does not fit.
+static inline bool addIntegers(Value a, Value b, Value* result) {
+	int64_t bits;
+	if (ADD_OVERFLOWS(AS_INT_BITS(a), AS_INT_BITS(b), &bits)) return false;
+	*result = INT_BITS_VAL(bits);
+	return true;
+}
+
+static inline bool subtractIntegers(Value a, Value b, Value* result) {
+	int64_t bits;
+	if (SUBTRACT_OVERFLOWS(AS_INT_BITS(a), AS_INT_BITS(b), &bits)) return false;
+	*result = INT_BITS_VAL(bits);
+	return true;
+}
+
+static inline bool multiplyIntegers(Value a, Value b, Value* result) {
+	int64_t bits;
+	if (MULTIPLY_OVERFLOWS(AS_INT_BITS(a), AS_INT(b), &bits)) return false;
+	// A zero product with a negative factor is -0.
+	if (bits == 0 && (AS_INT(a) | AS_INT(b)) < 0) return false;
+	*result = INT_BITS_VAL(bits);
+	return true;
+}
+
+// The doubles for two numbers, widening integers. False if either one is
+// not a number.
+static inline bool toDoubles(Value a, Value b, double* x, double* y) {
+	if (LIKELY(IS_DOUBLE(a) & IS_DOUBLE(b))) {
+		*x = AS_DOUBLE(a);
+		*y = AS_DOUBLE(b);
+		return true;
+	}
+	if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+	*x = AS_NUMBER(a);
+	*y = AS_NUMBER(b);
+	return true;
+}
+
+// Arithmetic on two numbers into *result, false if either one is not a
+// number. Two integers give an integer while the exact result fits. Both
+// run() and the compiler's constant folding go through these.
+static inline bool addNumbers(Value a, Value b, Value* result) {
+	if (LIKELY(ARE_INTS(a, b)) && LIKELY(addIntegers(a, b, result))) {
+		return true;
+	}
+	double x, y;
+	if (!toDoubles(a, b, &x, &y)) return false;
+	*result = NUMBER_VAL(x + y);
+	return true;
+}
+
+static inline bool subtractNumbers(Value a, Value b, Value* result) {
+	if (LIKELY(ARE_INTS(a, b)) && LIKELY(subtractIntegers(a, b, result))) {
+		return true;
+	}
+	double x, y;
+	if (!toDoubles(a, b, &x, &y)) return false;
+	*result = NUMBER_VAL(x - y);
+	return true;
+}
+
+static inline bool multiplyNumbers(Value a, Value b, Value* result) {
+	if (LIKELY(ARE_INTS(a, b)) && LIKELY(multiplyIntegers(a, b, result))) {
+		return true;
+	}
+	double x, y;
+	if (!toDoubles(a, b, &x, &y)) return false;
+	*result = NUMBER_VAL(x * y);
+	return true;
+}
+
+// Quotients of integers are rarely integers, so division stays double.
+static inline bool divideNumbers(Value a, Value b, Value* result) {
+	double x, y;
+	if (!toDoubles(a, b, &x, &y)) return false;
+	*result = NUMBER_VAL(x / y);
+	return true;
+}
+
+// The same for two values already known to be numbers, without the checks.
+static inline Value addKnownNumbers(Value a, Value b) {
+	Value result;
+	if (LIKELY(ARE_INTS(a, b)) && LIKELY(addIntegers(a, b, &result))) {
+		return result;
+	}
+	return NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+}
+
+static inline Value subtractKnownNumbers(Value a, Value b) {
+	Value result;
+	if (LIKELY(ARE_INTS(a, b)) && LIKELY(subtractIntegers(a, b, &result))) {
+		return result;
+	}
+	return NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b));
+}
+
+static inline Value multiplyKnownNumbers(Value a, Value b) {
+	Value result;
+	if (LIKELY(ARE_INTS(a, b)) && LIKELY(multiplyIntegers(a, b, &result))) {
+		return result;
+	}
+	return NUMBER_VAL(AS_NUMBER(a) * AS_NUMBER(b));
+}
+
+static inline Value divideKnownNumbers(Value a, Value b) {
+	return NUMBER_VAL(AS_NUMBER(a) / AS_NUMBER(b));
+}
+
+// The integer for a double that holds one, or the double itself.
+static inline Value numberValue(double number) {
+	if (number >= INTEGER_MIN && number <= INTEGER_MAX &&
+			number == (double)(int64_t) number &&
+			!(number == 0 && signbit(number))) {
+		return INT_VAL((int64_t) number);
+	}
+	return NUMBER_VAL(number);
+}
+
+// A double for an integer, anything else unchanged. The native code tiers
+// only ever see doubles.
+static inline Value widenInteger(Value value) {
+	return IS_INT(value) ? NUMBER_VAL((double) AS_INT(value)) : value;
+}
+
+// -value for a number.
+static inline Value negateNumber(Value value) {
+	if (IS_INT(value) && AS_INT(value) != 0 && AS_INT(value) != INTEGER_MIN) {
+		return INT_VAL(-AS_INT(value));
+	}
+	return NUMBER_VAL(-AS_NUMBER(value));
+}
 
 typedef struct {
     int capacity;
@@ -44,8 +277,15 @@ typedef struct {
 
 
 bool valuesEqual(Value a, Value b);
+// Whether a and b are the same value down to the representation. Unlike
+// valuesEqual(), 0 and -0 or an integer and the equal double differ, and
+// NaN is identical to itself.
+bool valuesIdentical(Value a, Value b);
+uint32_t hashValue(Value value);
 void initValueArray(ValueArray* array);
 void writeValueArray(ValueArray* array, Value value);
+// Grows the array so it holds capacity values before it moves.
+void reserveValueArray(ValueArray* array, int capacity);
 void freeValueArray(ValueArray* array);
 void printValue(Value value);
 
@@ -2,6 +2,7 @@
 #define clox_vm_h
 
 #include "chunk.h"
+#include "profile.h"
 #include "table.h"
 #include "value.h"
 
@@ -12,9 +13,34 @@ typedef struct {
     uint8_t * ip;
     Value stack[STACK_MAX];
     Value* stackTop;
-    Table globals;
+    // Globals are resolved to slots at compile time. globalNames maps a
+    // name to NUMBER_VAL(slot) and outlives a single interpret() call, so
+    // REPL lines see the slots of earlier lines.
+    Table globalNames;
+    // Top-level vals by name, kept by the compiler: the constant their
+    // reads compile to, or UNDEFINED_VAL if the initializer is not one.
+    Table finalGlobals;
+    ValueArray globalIdentifiers;
+    ValueArray globalValues;
     Table strings;
 	Obj* objects;
+    bool useJit;
+    bool useTracing;
+    bool useRegisters;
+    // Compile through the IR passes in optimizer.c.
+    bool useOptimizer;
+    // Where run() records operand types, with --profile, and the profile
+    // compile() specializes the chunk for, with --use-profile.
+    TypeProfile* profile;
+    TypeProfile* feedback;
+    // Compile on a second thread while earlier statements run, see
+    // pipeline.h. pipelining is set while that thread is running, when
+    // the compiler can assume nothing about the values of globals.
+    bool usePipeline;
+    bool pipelining;
+#ifdef COUNT_INSTRUCTIONS
+    unsigned long long instructionCount;
+#endif
 } VM;
 
 typedef enum {
@@ -28,7 +54,15 @@ extern VM vm;
 void initVM();
 void freeVM();
 InterpretResult interpret(const char* chunk);
+// Runs a compiled chunk with the tier the flags select, from an empty
+// stack. The globals stay as the chunk leaves them.
+InterpretResult runChunk(Chunk* chunk);
 void push(Value value);
 Value pop();
+int globalSlot(ObjString* name);
+// Shared with code that runs instructions outside run(), such as the JIT.
+void runtimeError(const char* format, ...);
+bool isFalsey(Value value);
+void concatenate();
 
 #endif
@@ -0,0 +1,434 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../include/aot.h"
+#include "../include/compiler.h"
+#include "../include/memory.h"
+#include "../include/object.h"
+#include "../include/vm.h"
+
+// Each instruction becomes one statement of the generated run(), in the
+// order of the chunk, and a jump becomes a goto to the label of its
+// target, so the C compiler sees the whole control flow of the script.
+// The statements are the macros of aot_runtime.h and take the line the
+// instruction would report an error on, which is the line of its last
+// byte: vm.ip has moved past it by the time run() calls runtimeError().
+
+typedef struct {
+    FILE* out;
+    Chunk* chunk;
+    bool* isTarget;
+    bool usesStack;
+    bool usesGlobals;
+} Emitter;
+
+// A C literal for the length bytes of chars. Octal escapes are always
+// three digits, so a digit after one can't join it.
+static void emitString(Emitter* emitter, const char* chars, int length) {
+    fputc('"', emitter->out);
+    for (int i = 0; i < length; i++) {
+        unsigned char c = (unsigned char) chars[i];
+        if (c == '"' || c == '\\') {
+            fprintf(emitter->out, "\\%c", c);
+        } else if (c < ' ' || c > '~') {
+            fprintf(emitter->out, "\\%03o", c);
+        } else {
+            fputc(c, emitter->out);
+        }
+    }
+    fputc('"', emitter->out);
+}
+
+// Doubles are written as their bits, which keeps the sign and payload
+// of a NaN as well.
+static void emitValue(Emitter* emitter, Value value) {
+    FILE* out = emitter->out;
+    if (IS_NIL(value)) {
+        fprintf(out, "NIL_VAL");
+    } else if (IS_BOOL(value)) {
+        fprintf(out, "BOOL_VAL(%s)", AS_BOOL(value) ? "true" : "false");
+    } else if (IS_INT(value)) {
+        fprintf(out, "INT_VAL(INT64_C(%" PRId64 "))", (int64_t) AS_INT(value));
+    } else if (IS_DOUBLE(value)) {
+        double number = AS_DOUBLE(value);
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+        fprintf(out, "aotDouble(UINT64_C(0x%016" PRIx64 "))", bits);
+    } else {
+        ObjString* string = AS_STRING(value);
+        fprintf(out, "aotString(");
+        emitString(emitter, string->chars, string->length);
+        fprintf(out, ", %d)", string->length);
+    }
+}
+
+static const char* loopOperand(int kind) {
+    switch (kind) {
+        case LOOP_LOCAL: return "stack";
+        case LOOP_GLOBAL: return "globals";
+        default: return "constants";
+    }
+}
+
+// Marks jump targets, which get labels, and notes which of the locals of
+// run() the code reads.
+static void scanChunk(Emitter* emitter) {
+    Chunk* chunk = emitter->chunk;
+    for (int offset = 0; offset < chunk->count;) {
+        Instruction instruction;
+        decodeInstruction(chunk, offset, &instruction);
+        if (instruction.target >= 0) emitter->isTarget[instruction.target] = true;
+        switch (instruction.opcode) {
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+            case OP_ADD_LOCAL_CONSTANT:
+            case OP_SUBTRACT_LOCAL_CONSTANT:
+            case OP_ADD_LOCAL_CONSTANT_GENERIC:
+            case OP_ADD_LOCAL_NUMBER:
+            case OP_SUBTRACT_LOCAL_NUMBER:
+                emitter->usesStack = true;
+                break;
+            case OP_GET_GLOBAL:
+            case OP_SET_GLOBAL:
+            case OP_DEFINE_GLOBAL:
+                emitter->usesGlobals = true;
+                break;
+            case OP_INCREMENT_LOOP_IF_LESS:
+            case OP_INCREMENT_LOOP_IF_LESS_EQUAL:
+            case OP_INCREMENT_LOOP_IF_GREATER:
+            case OP_INCREMENT_LOOP_IF_GREATER_EQUAL: {
+                int kinds = instruction.operands[0];
+                for (int i = 0; i < 2; i++) {
+                    int kind = i == 0 ? LOOP_COUNTER_KIND(kinds)
+                                      : LOOP_BOUND_KIND(kinds);
+                    if (kind == LOOP_LOCAL) emitter->usesStack = true;
+                    if (kind == LOOP_GLOBAL) emitter->usesGlobals = true;
+                }
+                break;
+            }
+            default:
+                break;
+        }
+        offset += instruction.length;
+    }
+}
+
+static void countedLoop(Emitter* emitter, Instruction* instruction, int line,
+                        bool swap, bool negate) {
+    int kinds = instruction->operands[0];
+    fprintf(emitter->out,
+            "    COUNTED_LOOP(%d, %d, %d, %s[%d], constants[%d], %s[%d], "
+            "%s, %s, L%d);\n",
+            line, kinds, instruction->operands[1],
+            loopOperand(LOOP_COUNTER_KIND(kinds)), instruction->operands[1],
+            instruction->operands[2],
+            loopOperand(LOOP_BOUND_KIND(kinds)), instruction->operands[3],
+            swap ? "true" : "false", negate ? "true" : "false",
+            instruction->target);
+}
+
+// A C switch on the entry the runtime picks, going straight to the
+// target of its jump.
+static void switchDispatch(Emitter* emitter, Instruction* instruction,
+                           int next) {
+    FILE* out = emitter->out;
+    int operand = instruction->operands[0];
+    int count = instruction->operands[1];
+    if (instruction->opcode == OP_SWITCH_INTEGER) {
+        fprintf(out, "    switch (integerCase(constants[%d], %d, PEEK(0))) {\n",
+                operand, count);
+    } else {
+        fprintf(out, "    switch (stringCase(&switchTables[%d], %d, PEEK(0))) {\n",
+                operand, count);
+    }
+    int entry = next;
+    for (int i = 0; i <= count; i++) {
+        Instruction jump;
+        decodeInstruction(emitter->chunk, entry, &jump);
+        if (i < count) {
+            fprintf(out, "        case %d: goto L%d;\n", i, jump.target);
+        } else {
+            fprintf(out, "        default: goto L%d;\n", jump.target);
+        }
+        entry += jump.length;
+    }
+    fprintf(out, "    }\n");
+}
+
+static void emitInstruction(Emitter* emitter, int offset,
+                            Instruction* instruction) {
+    FILE* out = emitter->out;
+    int line = getLine(&emitter->chunk->lines,
+                       offset + instruction->length - 1);
+    int operand = instruction->operands[0];
+    int target = instruction->target;
+    switch (instruction->opcode) {
+        case OP_CONSTANT:
+            fprintf(out, "    PUSH(constants[%d]);\n", operand);
+            break;
+        case OP_INTEGER:
+        case OP_DECIMAL:
+            fprintf(out, "    PUSH(");
+            emitValue(emitter, immediateValue(instruction->opcode, operand));
+            fprintf(out, ");\n");
+            break;
+        case OP_NIL: fprintf(out, "    PUSH(NIL_VAL);\n"); break;
+        case OP_TRUE: fprintf(out, "    PUSH(BOOL_VAL(true));\n"); break;
+        case OP_FALSE: fprintf(out, "    PUSH(BOOL_VAL(false));\n"); break;
+        case OP_POP: fprintf(out, "    DROP(1);\n"); break;
+        case OP_POPN: fprintf(out, "    DROP(%d);\n", operand); break;
+        case OP_GET_LOCAL:
+            fprintf(out, "    PUSH(stack[%d]);\n", operand);
+            break;
+        case OP_SET_LOCAL:
+            fprintf(out, "    stack[%d] = PEEK(0);\n", operand);
+            break;
+        case OP_GET_GLOBAL:
+            fprintf(out, "    GET_GLOBAL(%d, %d);\n", line, operand);
+            break;
+        case OP_SET_GLOBAL:
+            fprintf(out, "    SET_GLOBAL(%d, %d);\n", line, operand);
+            break;
+        case OP_DEFINE_GLOBAL:
+            fprintf(out, "    globals[%d] = PEEK(0);\n    DROP(1);\n", operand);
+            break;
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+            fprintf(out, "    PEEK(1) = BOOL_VAL(%svaluesEqual(PEEK(1), PEEK(0)));\n"
+                         "    DROP(1);\n",
+                    instruction->opcode == OP_NOT_EQUAL ? "!" : "");
+            break;
+        case OP_GREATER:
+            fprintf(out, "    COMPARE_OP(%d, PEEK(0), PEEK(1), false);\n", line);
+            break;
+        case OP_LESS:
+            fprintf(out, "    COMPARE_OP(%d, PEEK(1), PEEK(0), false);\n", line);
+            break;
+        case OP_GREATER_EQUAL:
+            fprintf(out, "    COMPARE_OP(%d, PEEK(1), PEEK(0), true);\n", line);
+            break;
+        case OP_LESS_EQUAL:
+            fprintf(out, "    COMPARE_OP(%d, PEEK(0), PEEK(1), true);\n", line);
+            break;
+        case OP_NOT:
+            fprintf(out, "    PEEK(0) = BOOL_VAL(isFalsey(PEEK(0)));\n");
+            break;
+        case OP_NEGATE:
+            fprintf(out, "    if (!IS_NUMBER(PEEK(0))) "
+                         "RUNTIME_ERROR(%d, \"Operand must be a number.\");\n",
+                    line);
+            // Fall through.
+        case OP_NEGATE_UNCHECKED:
+            fprintf(out, "    PEEK(0) = negateNumber(PEEK(0));\n");
+            break;
+        case OP_ADD:
+        case OP_ADD_GENERIC:
+        case OP_ADD_NUMBER:
+        case OP_ADD_STRING:
+            fprintf(out, "    BINARY_OP(%d, aotAdd, ADD_MESSAGE);\n", line);
+            break;
+        case OP_SUBTRACT:
+            fprintf(out, "    BINARY_OP(%d, subtractNumbers, NUMBERS_MESSAGE);\n",
+                    line);
+            break;
+        case OP_MULTIPLY:
+            fprintf(out, "    BINARY_OP(%d, multiplyNumbers, NUMBERS_MESSAGE);\n",
+                    line);
+            break;
+        case OP_DIVIDE:
+            fprintf(out, "    BINARY_OP(%d, divideNumbers, NUMBERS_MESSAGE);\n",
+                    line);
+            break;
+        case OP_ADD_UNCHECKED:
+            fprintf(out, "    UNCHECKED_OP(addKnownNumbers);\n");
+            break;
+        case OP_SUBTRACT_UNCHECKED:
+            fprintf(out, "    UNCHECKED_OP(subtractKnownNumbers);\n");
+            break;
+        case OP_MULTIPLY_UNCHECKED:
+            fprintf(out, "    UNCHECKED_OP(multiplyKnownNumbers);\n");
+            break;
+        case OP_DIVIDE_UNCHECKED:
+            fprintf(out, "    UNCHECKED_OP(divideKnownNumbers);\n");
+            break;
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_ADD_LOCAL_CONSTANT_GENERIC:
+        case OP_ADD_LOCAL_NUMBER:
+            fprintf(out, "    LOCAL_CONSTANT_OP(%d, aotAdd, ADD_MESSAGE, %d, %d);\n",
+                    line, operand, instruction->operands[1]);
+            break;
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+        case OP_SUBTRACT_LOCAL_NUMBER:
+            fprintf(out, "    LOCAL_CONSTANT_OP(%d, subtractNumbers, "
+                         "NUMBERS_MESSAGE, %d, %d);\n",
+                    line, operand, instruction->operands[1]);
+            break;
+        case OP_PRINT:
+            fprintf(out, "    aotPrint(PEEK(0));\n    DROP(1);\n");
+            break;
+        case OP_JUMP:
+        case OP_LOOP:
+            fprintf(out, "    goto L%d;\n", target);
+            break;
+        case OP_JUMP_IF_FALSE:
+            fprintf(out, "    if (isFalsey(PEEK(0))) goto L%d;\n", target);
+            break;
+        case OP_POP_JUMP_IF_FALSE:
+            fprintf(out, "    DROP(1);\n    if (isFalsey(sp[0])) goto L%d;\n",
+                    target);
+            break;
+        case OP_JUMP_IF_EQUAL:
+            fprintf(out, "    EQUAL_JUMP(true, L%d);\n", target);
+            break;
+        case OP_JUMP_IF_NOT_EQUAL:
+            fprintf(out, "    EQUAL_JUMP(false, L%d);\n", target);
+            break;
+        case OP_JUMP_IF_NOT_GREATER:
+            fprintf(out, "    COMPARE_JUMP(%d, PEEK(0), PEEK(1), false, L%d);\n",
+                    line, target);
+            break;
+        case OP_JUMP_IF_NOT_LESS:
+            fprintf(out, "    COMPARE_JUMP(%d, PEEK(1), PEEK(0), false, L%d);\n",
+                    line, target);
+            break;
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+            fprintf(out, "    COMPARE_JUMP(%d, PEEK(1), PEEK(0), true, L%d);\n",
+                    line, target);
+            break;
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+            fprintf(out, "    COMPARE_JUMP(%d, PEEK(0), PEEK(1), true, L%d);\n",
+                    line, target);
+            break;
+        case OP_INCREMENT_LOOP_IF_LESS:
+            countedLoop(emitter, instruction, line, false, false);
+            break;
+        case OP_INCREMENT_LOOP_IF_LESS_EQUAL:
+            countedLoop(emitter, instruction, line, true, true);
+            break;
+        case OP_INCREMENT_LOOP_IF_GREATER:
+            countedLoop(emitter, instruction, line, true, false);
+            break;
+        case OP_INCREMENT_LOOP_IF_GREATER_EQUAL:
+            countedLoop(emitter, instruction, line, false, true);
+            break;
+        case OP_SWITCH_INTEGER:
+        case OP_SWITCH_STRING:
+            switchDispatch(emitter, instruction, offset + instruction->length);
+            break;
+        case OP_RETURN:
+            fprintf(out, "    return INTERPRET_OK;\n");
+            break;
+        default:
+            fprintf(out, "    RUNTIME_ERROR(%d, \"Unknown opcode %%d.\", %d);\n",
+                    line, instruction->opcode);
+            break;
+    }
+}
+
+static void emitRun(Emitter* emitter) {
+    FILE* out = emitter->out;
+    Chunk* chunk = emitter->chunk;
+    fprintf(out, "static InterpretResult run(void) {\n");
+    if (emitter->usesStack) fprintf(out, "    Value* stack = vm.stack;\n");
+    if (emitter->usesGlobals) {
+        fprintf(out, "    Value* globals = vm.globalValues.values;\n");
+    }
+    // Slot zero, reserved by the compiler.
+    fprintf(out, "    Value* sp = vm.stack;\n    PUSH(NIL_VAL);\n");
+    // Jumps after a switch are only emitted if something else jumps to
+    // them.
+    int entries = 0;
+    for (int offset = 0; offset < chunk->count;) {
+        Instruction instruction;
+        decodeInstruction(chunk, offset, &instruction);
+        if (emitter->isTarget[offset]) fprintf(out, "L%d:\n", offset);
+        if (entries == 0 || emitter->isTarget[offset]) {
+            emitInstruction(emitter, offset, &instruction);
+        }
+        if (entries > 0) entries--;
+        if (instruction.opcode == OP_SWITCH_INTEGER ||
+            instruction.opcode == OP_SWITCH_STRING) {
+            entries = instruction.operands[1] + 1;
+        }
+        offset += instruction.length;
+    }
+    if (emitter->isTarget[chunk->count]) {
+        fprintf(out, "L%d:\n    return INTERPRET_OK;\n", chunk->count);
+    }
+    fprintf(out, "}\n\n");
+}
+
+// main() sets up the VM the compiler left behind: the global slots in
+// the order it reserved them, the constants and the switch tables.
+static void emitMain(Emitter* emitter) {
+    FILE* out = emitter->out;
+    Chunk* chunk = emitter->chunk;
+    fprintf(out, "int main(void) {\n    initVM();\n");
+    for (int i = 0; i < vm.globalIdentifiers.count; i++) {
+        ObjString* name = AS_STRING(vm.globalIdentifiers.values[i]);
+        fprintf(out, "    aotGlobal(");
+        emitString(emitter, name->chars, name->length);
+        fprintf(out, ", %d);\n", name->length);
+    }
+    for (int i = 0; i < chunk->constants.count; i++) {
+        fprintf(out, "    constants[%d] = ", i);
+        emitValue(emitter, chunk->constants.values[i]);
+        fprintf(out, ";\n");
+    }
+    for (int i = 0; i < chunk->switchTableCount; i++) {
+        Table* table = &chunk->switchTables[i];
+        fprintf(out, "    initTable(&switchTables[%d]);\n", i);
+        for (int j = 0; j < table->capacity; j++) {
+            Entry* entry = &table->entries[j];
+            if (entry->key == NULL) continue;
+            fprintf(out, "    tableSet(&switchTables[%d], copyString(", i);
+            emitString(emitter, entry->key->chars, entry->key->length);
+            fprintf(out, ", %d), NUMBER_VAL(%d));\n", entry->key->length,
+                    (int) AS_NUMBER(entry->value));
+        }
+    }
+    fprintf(out, "    InterpretResult result = run();\n");
+    for (int i = 0; i < chunk->switchTableCount; i++) {
+        fprintf(out, "    freeTable(&switchTables[%d]);\n", i);
+    }
+    fprintf(out, "    freeVM();\n"
+                 "    return result == INTERPRET_OK ? 0 : 70;\n"
+                 "}\n");
+}
+
+bool emitC(const char* source, FILE* out) {
+    Chunk chunk;
+    initChunk(&chunk);
+    if (!compile(source, &chunk)) {
+        freeChunk(&chunk);
+        return false;
+    }
+
+    Emitter emitter;
+    emitter.out = out;
+    emitter.chunk = &chunk;
+    emitter.isTarget = ALLOCATE(bool, chunk.count + 1);
+    for (int i = 0; i <= chunk.count; i++) emitter.isTarget[i] = false;
+    emitter.usesStack = false;
+    emitter.usesGlobals = false;
+    scanChunk(&emitter);
+
+    fprintf(out, "// Generated by clox --emit-c. Build against libclox.a with "
+                 "the same DEFINES:\n"
+                 "//   cc -O2 -pthread -Iinclude script.c libclox.a -lm\n"
+                 "#include \"aot_runtime.h\"\n\n");
+    if (chunk.constants.count > 0) {
+        fprintf(out, "static Value constants[%d];\n", chunk.constants.count);
+    }
+    if (chunk.switchTableCount > 0) {
+        fprintf(out, "static Table switchTables[%d];\n", chunk.switchTableCount);
+    }
+    fprintf(out, "\n");
+    emitRun(&emitter);
+    emitMain(&emitter);
+
+    FREE_ARRAY(bool, emitter.isTarget, chunk.count + 1);
+    freeChunk(&chunk);
+    return true;
+}
@@ -0,0 +1,32 @@
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "../include/aot_runtime.h"
+
+void aotError(int line, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fputs("\n", stderr);
+    fprintf(stderr, "[line %d] in script\n", line);
+}
+
+void aotCountedLoopError(int line, int kinds, int slot) {
+    if (LOOP_COUNTER_KIND(kinds) == LOOP_GLOBAL &&
+        IS_UNDEFINED(vm.globalValues.values[slot])) {
+        aotError(line, "Undefined variable '%s'.", aotGlobalName(slot));
+        return;
+    }
+    aotError(line, kinds & LOOP_SUBTRACT
+        ? "Operands must be numbers."
+        : "Operands must be two numbers or two strings");
+}
+
+const char* aotGlobalName(int slot) {
+    return AS_CSTRING(vm.globalIdentifiers.values[slot]);
+}
+
+void aotGlobal(const char* name, int length) {
+    globalSlot(copyString(name, length));
+}
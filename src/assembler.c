@@ -0,0 +1,239 @@
+#include "../include/assembler.h"
+
+#ifdef JIT_SUPPORTED
+
+#include <string.h>
+#include <sys/mman.h>
+
+#include "../include/memory.h"
+
+void initAssembler(Assembler* as) {
+    as->count = 0;
+    as->capacity = 0;
+    as->code = NULL;
+}
+
+void freeAssembler(Assembler* as) {
+    FREE_ARRAY(uint8_t, as->code, as->capacity);
+    initAssembler(as);
+}
+
+bool makeExecutable(Assembler* as, Executable* executable) {
+    size_t size = (size_t) as->count;
+    void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) return false;
+    memcpy(memory, as->code, size);
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, size);
+        return false;
+    }
+    executable->code = memory;
+    executable->size = size;
+    return true;
+}
+
+void freeExecutable(Executable* executable) {
+    if (executable->code != NULL) munmap(executable->code, executable->size);
+    executable->code = NULL;
+    executable->size = 0;
+}
+
+void asmByte(Assembler* as, uint8_t byte) {
+    if (as->capacity < as->count + 1) {
+        int oldCapacity = as->capacity;
+        as->capacity = GROW_CAPACITY(oldCapacity);
+        as->code = GROW_ARRAY(uint8_t, as->code, oldCapacity, as->capacity);
+    }
+    as->code[as->count++] = byte;
+}
+
+void asmInt32(Assembler* as, int32_t value) {
+    uint32_t bits = (uint32_t) value;
+    for (int i = 0; i < 4; i++) asmByte(as, (bits >> (i * 8)) & 0xff);
+}
+
+void asmInt64(Assembler* as, uint64_t value) {
+    for (int i = 0; i < 8; i++) asmByte(as, (value >> (i * 8)) & 0xff);
+}
+
+// REX prefix. w selects 64-bit operands, reg and rm are the registers
+// encoded in ModRM and contribute their high bit as REX.R/REX.B.
+static void rex(Assembler* as, bool w, int reg, int rm, bool force) {
+    uint8_t prefix = 0x40 | (w ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0);
+    if (prefix != 0x40 || force) asmByte(as, prefix);
+}
+
+static void modrmReg(Assembler* as, int reg, int rm) {
+    asmByte(as, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// ModRM for [base + disp32]. RSP and R12 need a SIB byte as base.
+static void modrmMem(Assembler* as, int reg, Register base, int32_t disp) {
+    asmByte(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP) asmByte(as, 0x24);
+    asmInt32(as, disp);
+}
+
+void asmPush(Assembler* as, Register reg) {
+    rex(as, false, 0, reg, false);
+    asmByte(as, 0x50 | (reg & 7));
+}
+
+void asmPop(Assembler* as, Register reg) {
+    rex(as, false, 0, reg, false);
+    asmByte(as, 0x58 | (reg & 7));
+}
+
+void asmRet(Assembler* as) {
+    asmByte(as, 0xc3);
+}
+
+void asmMovImm32(Assembler* as, Register dst, uint32_t value) {
+    rex(as, false, 0, dst, false);
+    asmByte(as, 0xb8 | (dst & 7));
+    asmInt32(as, (int32_t) value);
+}
+
+void asmMovImm64(Assembler* as, Register dst, uint64_t value) {
+    rex(as, true, 0, dst, false);
+    asmByte(as, 0xb8 | (dst & 7));
+    asmInt64(as, value);
+}
+
+void asmMovReg(Assembler* as, Register dst, Register src) {
+    rex(as, true, src, dst, false);
+    asmByte(as, 0x89);
+    modrmReg(as, src, dst);
+}
+
+void asmLoad(Assembler* as, Register dst, Register base, int32_t disp) {
+    rex(as, true, dst, base, false);
+    asmByte(as, 0x8b);
+    modrmMem(as, dst, base, disp);
+}
+
+void asmStore(Assembler* as, Register base, int32_t disp, Register src) {
+    rex(as, true, src, base, false);
+    asmByte(as, 0x89);
+    modrmMem(as, src, base, disp);
+}
+
+void asmAddMem(Assembler* as, Register base, int32_t disp, int32_t value) {
+    rex(as, true, 0, base, false);
+    asmByte(as, 0x81);
+    modrmMem(as, 0, base, disp);
+    asmInt32(as, value);
+}
+
+void asmSubMem(Assembler* as, Register base, int32_t disp, int32_t value) {
+    rex(as, true, 0, base, false);
+    asmByte(as, 0x81);
+    modrmMem(as, 5, base, disp);
+    asmInt32(as, value);
+}
+
+void asmAddImm(Assembler* as, Register dst, int32_t value) {
+    rex(as, true, 0, dst, false);
+    asmByte(as, 0x81);
+    modrmReg(as, 0, dst);
+    asmInt32(as, value);
+}
+
+void asmSubImm(Assembler* as, Register dst, int32_t value) {
+    rex(as, true, 0, dst, false);
+    asmByte(as, 0x81);
+    modrmReg(as, 5, dst);
+    asmInt32(as, value);
+}
+
+void asmCmp(Assembler* as, Register a, Register b) {
+    rex(as, true, b, a, false);
+    asmByte(as, 0x39);
+    modrmReg(as, b, a);
+}
+
+void asmAnd(Assembler* as, Register dst, Register src) {
+    rex(as, true, src, dst, false);
+    asmByte(as, 0x21);
+    modrmReg(as, src, dst);
+}
+
+void asmTest32(Assembler* as, Register a, Register b) {
+    rex(as, false, b, a, false);
+    asmByte(as, 0x85);
+    modrmReg(as, b, a);
+}
+
+// Calls through RAX, so the callee can be anywhere in the address space.
+void asmCall(Assembler* as, void* function) {
+    asmMovImm64(as, RAX, (uint64_t) (uintptr_t) function);
+    asmByte(as, 0xff);
+    asmByte(as, 0xd0);
+}
+
+int asmJump(Assembler* as) {
+    asmByte(as, 0xe9);
+    asmInt32(as, 0);
+    return as->count - 4;
+}
+
+int asmJumpIf(Assembler* as, Condition condition) {
+    asmByte(as, 0x0f);
+    asmByte(as, 0x80 | condition);
+    asmInt32(as, 0);
+    return as->count - 4;
+}
+
+void asmPatch(Assembler* as, int position, int target) {
+    int32_t relative = target - (position + 4);
+    memcpy(&as->code[position], &relative, sizeof(int32_t));
+}
+
+// Scalar double instructions: prefix, optional REX, 0F, opcode, ModRM.
+static void sseReg(Assembler* as, uint8_t prefix, bool w, uint8_t opcode,
+                   int reg, int rm) {
+    asmByte(as, prefix);
+    rex(as, w, reg, rm, false);
+    asmByte(as, 0x0f);
+    asmByte(as, opcode);
+    modrmReg(as, reg, rm);
+}
+
+void asmMovsdReg(Assembler* as, XmmRegister dst, XmmRegister src) {
+    sseReg(as, 0xf2, false, 0x10, dst, src);
+}
+
+void asmMovqToXmm(Assembler* as, XmmRegister dst, Register src) {
+    sseReg(as, 0x66, true, 0x6e, dst, src);
+}
+
+void asmMovqFromXmm(Assembler* as, Register dst, XmmRegister src) {
+    sseReg(as, 0x66, true, 0x7e, src, dst);
+}
+
+void asmAddsd(Assembler* as, XmmRegister dst, XmmRegister src) {
+    sseReg(as, 0xf2, false, 0x58, dst, src);
+}
+
+void asmSubsd(Assembler* as, XmmRegister dst, XmmRegister src) {
+    sseReg(as, 0xf2, false, 0x5c, dst, src);
+}
+
+void asmMulsd(Assembler* as, XmmRegister dst, XmmRegister src) {
+    sseReg(as, 0xf2, false, 0x59, dst, src);
+}
+
+void asmDivsd(Assembler* as, XmmRegister dst, XmmRegister src) {
+    sseReg(as, 0xf2, false, 0x5e, dst, src);
+}
+
+void asmUcomisd(Assembler* as, XmmRegister a, XmmRegister b) {
+    sseReg(as, 0x66, false, 0x2e, a, b);
+}
+
+void asmXorpd(Assembler* as, XmmRegister dst, XmmRegister src) {
+    sseReg(as, 0x66, false, 0x57, dst, src);
+}
+
+#endif
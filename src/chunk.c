@@ -1,6 +1,10 @@
+#include <math.h>
 #include <stdlib.h>
 #include "../include/chunk.h"
 #include "../include/memory.h"
+#include "../include/object.h"
+
+#define CONSTANT_INDEX_MAX_LOAD 0.75
 
 void initChunk(Chunk* chunk) {
     chunk->count = 0;
@@ -8,6 +12,11 @@ void initChunk(Chunk* chunk) {
     chunk->code = NULL;
     initLineArray(&chunk->lines);
     initValueArray(&chunk->constants);
+    chunk->constantIndex = NULL;
+    chunk->constantIndexCapacity = 0;
+    chunk->switchTables = NULL;
+    chunk->switchTableCount = 0;
+    chunk->switchTableCapacity = 0;
 }
 
 void writeChunk(Chunk* chunk, uint8_t byte, int line) {
@@ -24,37 +33,288 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
     chunk->count++;
 }
 
+// Drops everything after the first count bytes.
+void truncateChunk(Chunk* chunk, int count) {
+    chunk->count = count;
+    truncateLineArray(&chunk->lines, count);
+}
+
 void freeChunk(Chunk* chunk) {
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     freeLineArray(&chunk->lines);
     freeValueArray(&chunk->constants);
+    FREE_ARRAY(int, chunk->constantIndex, chunk->constantIndexCapacity);
+    for (int i = 0; i < chunk->switchTableCount; i++) {
+        freeTable(&chunk->switchTables[i]);
+    }
+    FREE_ARRAY(Table, chunk->switchTables, chunk->switchTableCapacity);
     initChunk(chunk);
 }
 
+// The index entry for value: the one holding it, or the free one where
+// it belongs. Capacities are powers of two.
+static int* findConstant(int* index, int capacity, ValueArray* constants,
+                         Value value) {
+    uint32_t slot = hashValue(value) & (capacity - 1);
+    for (;;) {
+        int* entry = &index[slot];
+        if (*entry == 0 ||
+                valuesIdentical(constants->values[*entry - 1], value)) {
+            return entry;
+        }
+        slot = (slot + 1) & (capacity - 1);
+    }
+}
+
+static void growConstantIndex(Chunk* chunk) {
+    int capacity = GROW_CAPACITY(chunk->constantIndexCapacity);
+    int* index = ALLOCATE(int, capacity);
+    for (int i = 0; i < capacity; i++) index[i] = 0;
+    for (int i = 0; i < chunk->constants.count; i++) {
+        *findConstant(index, capacity, &chunk->constants,
+                      chunk->constants.values[i]) = i + 1;
+    }
+    FREE_ARRAY(int, chunk->constantIndex, chunk->constantIndexCapacity);
+    chunk->constantIndex = index;
+    chunk->constantIndexCapacity = capacity;
+}
+
+// The index of value in the constant pool, adding it if no identical
+// constant is there yet.
 int addConstant(Chunk* chunk, Value value) {
-    writeValueArray(&chunk->constants, value);
-    return chunk->constants.count - 1;
+    if (chunk->constants.count + 1 >
+            chunk->constantIndexCapacity * CONSTANT_INDEX_MAX_LOAD) {
+        growConstantIndex(chunk);
+    }
+    int* entry = findConstant(chunk->constantIndex,
+                              chunk->constantIndexCapacity,
+                              &chunk->constants, value);
+    if (*entry == 0) {
+        writeValueArray(&chunk->constants, value);
+        *entry = chunk->constants.count;
+    }
+    return *entry - 1;
 }
 
 
+// Appends operand as a varint.
+void writeOperand(Chunk* chunk, int operand, int line) {
+    uint32_t rest = (uint32_t) operand;
+    while (rest >= 0x80) {
+        writeChunk(chunk, (uint8_t) (rest | 0x80), line);
+        rest >>= 7;
+    }
+    writeChunk(chunk, (uint8_t) rest, line);
+}
+
+static int operandLength(int operand) {
+    int length = 1;
+    for (uint32_t rest = (uint32_t) operand >> 7; rest != 0; rest >>= 7) {
+        length++;
+    }
+    return length;
+}
+
+// Reads the varint at code[*length] and moves *length past it.
+static int readOperand(uint8_t* code, int* length) {
+    uint32_t operand = 0;
+    int shift = 0;
+    uint8_t byte;
+    do {
+        byte = code[(*length)++];
+        operand |= (uint32_t) (byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return (int) operand;
+}
+
 bool writeConstant(Chunk* chunk, Value value, int line) {
-    uint32_t index = (uint32_t) addConstant(chunk, value);
-    if (index > UINT32_MAX) {
+    int index = addConstant(chunk, value);
+    if (index < 0) {
         return false;
     }
-    if (index > UINT8_MAX) {
-        uint8_t largeConstant[CONSTANT_LONG_BYTE_SIZE];
-        CONVERT_TO_BYTE_ARRAY(largeConstant, CONSTANT_LONG_BYTE_SIZE, index);
-        writeChunk(chunk, OP_CONSTANT_LONG, line);
+    writeChunk(chunk, OP_CONSTANT, line);
+    writeOperand(chunk, index, line);
+    return true;
+}
 
-        for (int i = 0; i < CONSTANT_LONG_BYTE_SIZE; i++) {
-            writeChunk(chunk, largeConstant[i], line);
-        }
-    } else {
-        writeChunk(chunk, OP_CONSTANT, line);
-        writeChunk(chunk, index, line);
+// Whether value fits OP_INTEGER or OP_DECIMAL. A decimal operand n reads
+// back as n / 10.0, which rounds to the same double strtod() gives for
+// the literal, as n and 10 are both exact.
+bool immediateNumber(double value, uint8_t* opcode, int* operand) {
+    if (signbit(value) || !(value <= MAX_IMMEDIATE)) return false;
+    if (value == (int) value) {
+        *opcode = OP_INTEGER;
+        *operand = (int) value;
+        return true;
     }
+    double tenths = value * 10;
+    if (tenths > MAX_IMMEDIATE) return false;
+    int decimal = (int) (tenths + 0.5);
+    if (decimal / 10.0 != value) return false;
+    *opcode = OP_DECIMAL;
+    *operand = decimal;
     return true;
 }
 
+Value immediateValue(uint8_t opcode, int operand) {
+    return opcode == OP_DECIMAL ? NUMBER_VAL(operand / 10.0) : INT_VAL(operand);
+}
+
+typedef enum {
+    OPERANDS_NONE,
+    OPERANDS_IMMEDIATE,
+    OPERANDS_ONE,
+    OPERANDS_TWO,
+    OPERANDS_JUMP,
+    OPERANDS_LOOP,
+    // Kinds, counter, step constant and bound, then a loop offset.
+    OPERANDS_COUNTED_LOOP,
+} OperandFormat;
+
+static OperandFormat operandFormat(uint8_t opcode) {
+    switch (opcode) {
+        case OP_INTEGER:
+        case OP_DECIMAL:
+            return OPERANDS_IMMEDIATE;
+        case OP_CONSTANT:
+        case OP_GET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_LOCAL:
+        case OP_POPN:
+            return OPERANDS_ONE;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+            return OPERANDS_JUMP;
+        case OP_LOOP:
+            return OPERANDS_LOOP;
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+        case OP_SWITCH_INTEGER:
+        case OP_SWITCH_STRING:
+        case OP_ADD_LOCAL_CONSTANT_GENERIC:
+        case OP_ADD_LOCAL_NUMBER:
+        case OP_SUBTRACT_LOCAL_NUMBER:
+            return OPERANDS_TWO;
+        case OP_INCREMENT_LOOP_IF_LESS:
+        case OP_INCREMENT_LOOP_IF_LESS_EQUAL:
+        case OP_INCREMENT_LOOP_IF_GREATER:
+        case OP_INCREMENT_LOOP_IF_GREATER_EQUAL:
+            return OPERANDS_COUNTED_LOOP;
+        default:
+            return OPERANDS_NONE;
+    }
+}
 
+static int varintCount(OperandFormat format) {
+    switch (format) {
+        case OPERANDS_ONE: return 1;
+        case OPERANDS_TWO: return 2;
+        case OPERANDS_COUNTED_LOOP: return 4;
+        default: return 0;
+    }
+}
+
+bool isJump(uint8_t opcode) {
+    OperandFormat format = operandFormat(opcode);
+    return format == OPERANDS_JUMP || format == OPERANDS_LOOP ||
+        format == OPERANDS_COUNTED_LOOP;
+}
+
+void decodeInstruction(Chunk* chunk, int offset, Instruction* instruction) {
+    uint8_t* code = &chunk->code[offset];
+    OperandFormat format = operandFormat(code[0]);
+    int length = 1;
+    instruction->opcode = code[0];
+    instruction->operandCount = varintCount(format);
+    for (int i = 0; i < instruction->operandCount; i++) {
+        instruction->operands[i] = readOperand(code, &length);
+    }
+    if (format == OPERANDS_IMMEDIATE) {
+        instruction->operands[instruction->operandCount++] = code[length++];
+    }
+    instruction->target = -1;
+    if (isJump(code[0])) {
+        int jump = (uint16_t) ((code[length] << 8) | code[length + 1]);
+        length += 2;
+        instruction->target = format == OPERANDS_JUMP
+            ? offset + length + jump : offset + length - jump;
+    }
+    instruction->length = length;
+}
+
+// Bytes the instruction takes once written, from its opcode and operands.
+int encodedLength(Instruction* instruction) {
+    OperandFormat format = operandFormat(instruction->opcode);
+    int length = 1;
+    for (int i = 0; i < varintCount(format); i++) {
+        length += operandLength(instruction->operands[i]);
+    }
+    if (format == OPERANDS_IMMEDIATE) length++;
+    return isJump(instruction->opcode) ? length + 2 : length;
+}
+
+// Appends the instruction. Jumps are encoded relative to the offset the
+// instruction ends up at, so the target must already be final.
+void writeInstruction(Chunk* chunk, Instruction* instruction, int line) {
+    OperandFormat format = operandFormat(instruction->opcode);
+    int end = chunk->count + encodedLength(instruction);
+    writeChunk(chunk, instruction->opcode, line);
+    for (int i = 0; i < varintCount(format); i++) {
+        writeOperand(chunk, instruction->operands[i], line);
+    }
+    if (format == OPERANDS_IMMEDIATE) {
+        writeChunk(chunk, (uint8_t) instruction->operands[0], line);
+    }
+    if (isJump(instruction->opcode)) {
+        int jump = format == OPERANDS_JUMP
+            ? instruction->target - end : end - instruction->target;
+        writeChunk(chunk, (jump >> 8) & 0xff, line);
+        writeChunk(chunk, jump & 0xff, line);
+    }
+}
+
+int addSwitchTable(Chunk* chunk) {
+    if (chunk->switchTableCapacity < chunk->switchTableCount + 1) {
+        int oldCapacity = chunk->switchTableCapacity;
+        chunk->switchTableCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->switchTables = GROW_ARRAY(Table, chunk->switchTables,
+                                         oldCapacity,
+                                         chunk->switchTableCapacity);
+    }
+    initTable(&chunk->switchTables[chunk->switchTableCount]);
+    return chunk->switchTableCount++;
+}
+
+int integerCase(Value lowest, int count, Value value) {
+    if (!IS_NUMBER(value)) return count;
+    // Compared as OP_EQUAL would, so 2.0 selects case 2.
+    double index = AS_NUMBER(value) - AS_NUMBER(lowest);
+    if (!(index >= 0 && index < count) || index != (int) index) return count;
+    return (int) index;
+}
+
+int stringCase(Table* table, int count, Value value) {
+    Value index;
+    if (IS_STRING(value) && tableGet(table, AS_STRING(value), &index)) {
+        return (int) AS_NUMBER(index);
+    }
+    return count;
+}
+
+int switchCase(Chunk* chunk, uint8_t opcode, int operand, int count,
+               Value value) {
+    if (opcode == OP_SWITCH_STRING) {
+        return stringCase(&chunk->switchTables[operand], count, value);
+    }
+    return integerCase(chunk->constants.values[operand], count, value);
+}
@@ -4,8 +4,11 @@
 
 #include "../include/common.h"
 #include "../include/compiler.h"
+#include "../include/memory.h"
+#include "../include/optimizer.h"
+#include "../include/peephole.h"
+#include "../include/profile.h"
 #include "../include/scanner.h"
-#include "../include/utils.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
@@ -65,6 +68,15 @@ Compiler* current = NULL;
 
 Chunk* compilingChunk;
 
+// Byte range of the most recent expression statement, which
+// whileStatement() checks for the increment of a counted loop.
+static int lastExpressionStart = -1;
+static int lastExpressionEnd = -1;
+
+// Where the code of the left operand of the infix rule being called
+// begins; the operand runs up to the end of the chunk.
+static int operandStart = -1;
+
 static Chunk* currentChunk() {
     return compilingChunk;
 }
@@ -153,6 +165,11 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
 	emitByte(byte2);
 }
 
+static void emitOperand(uint8_t instruction, int operand) {
+    emitByte(instruction);
+    writeOperand(currentChunk(), operand, parser.previous.line);
+}
+
 static void emitLoop(int loopStart) {
     emitByte(OP_LOOP);
 
@@ -182,6 +199,64 @@ static int emitConstant(Value value) {
     return index;
 }
 
+// Drops the code emitted since start, such as the operands of a folded
+// expression or a branch that can never run.
+static void discardCode(int start) {
+    truncateChunk(currentChunk(), start);
+    if (lastExpressionEnd > start) {
+        lastExpressionStart = -1;
+        lastExpressionEnd = -1;
+    }
+}
+
+// The value pushed by the code from start to the end of the chunk, if it
+// is a single load of a constant.
+static bool constantAt(int start, Value* value) {
+    Chunk* chunk = currentChunk();
+    if (start < 0 || start >= chunk->count) return false;
+    Instruction instruction;
+    decodeInstruction(chunk, start, &instruction);
+    if (start + instruction.length != chunk->count) return false;
+    switch (instruction.opcode) {
+        case OP_CONSTANT:
+            *value = chunk->constants.values[instruction.operands[0]];
+            return true;
+        case OP_INTEGER:
+        case OP_DECIMAL:
+            *value = immediateValue(instruction.opcode,
+                                    instruction.operands[0]);
+            return true;
+        case OP_NIL: *value = NIL_VAL; return true;
+        case OP_TRUE: *value = BOOL_VAL(true); return true;
+        case OP_FALSE: *value = BOOL_VAL(false); return true;
+        default:
+            return false;
+    }
+}
+
+static void emitNumber(double value) {
+    uint8_t opcode;
+    int operand;
+    if (immediateNumber(value, &opcode, &operand)) {
+        emitBytes(opcode, (uint8_t) operand);
+    } else {
+        emitConstant(numberValue(value));
+    }
+}
+
+// Emits the shortest load of value.
+static void emitValue(Value value) {
+    if (IS_NIL(value)) {
+        emitByte(OP_NIL);
+    } else if (IS_BOOL(value)) {
+        emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    } else if (IS_NUMBER(value)) {
+        emitNumber(AS_NUMBER(value));
+    } else {
+        emitConstant(value);
+    }
+}
+
 static void patchJump(int offset) {
     int jump = currentChunk()->count - offset - 2;
     if (jump > UINT16_MAX) {
@@ -195,10 +270,23 @@ static void initCompiler(Compiler* compiler) {
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
     current = compiler;
+
+    // Slot zero belongs to the VM, so the stack is never empty and run()
+    // always has a value to cache in a register.
+    Local* local = &current->locals[current->localCount++];
+    local->depth = 0;
+    local->final = true;
+    local->name.start = "";
+    local->name.length = 0;
 }
 
 static void endCompiler() {
     emitReturn();
+    if (!parser.hadError) {
+        if (vm.useOptimizer) optimizeChunk(currentChunk());
+        peepholeOptimize(currentChunk());
+        if (vm.feedback != NULL) specializeChunk(currentChunk(), vm.feedback);
+    }
 #ifdef DEBUG_PRINT_CODE
     if(!parser.hadError) {
         disassembleChunk(currentChunk(), "code");
@@ -227,9 +315,8 @@ static void declaration();
 static ParseRule* getRule(TokenType type);
 static void parsePrecedence(Precedence precedence);
 
-static uint32_t identifierConstant(Token* name) {
-    int constant = addConstant(currentChunk(), OBJ_VAL(copyString(name->start, name->length)));
-    return (u_int32_t) constant;
+static uint32_t identifierSlot(Token* name) {
+    return (uint32_t) globalSlot(copyString(name->start, name->length));
 }
 
 static bool identifierEqual(Token* a, Token* b) {
@@ -282,7 +369,7 @@ static uint32_t parseVariable(const char* errorMessage) {
     consume(TOKEN_IDENTIFIER, errorMessage);
     declareVariable(isFinal);
     if (current->scopeDepth > 0) return 0;
-    return identifierConstant(&parser.previous);
+    return identifierSlot(&parser.previous);
 }
 
 static void markInitialized() {
@@ -294,21 +381,23 @@ static void defineVariable(uint32_t global) {
         markInitialized();
         return;
     }
-    if (global <= UINT8_MAX) {
-        emitBytes(OP_DEFINE_GLOBAL, (uint8_t) global);
-    } else if (global <= UINT32_MAX) {
-        uint8_t largeConstant[CONSTANT_LONG_BYTE_SIZE];
-        CONVERT_TO_BYTE_ARRAY(largeConstant, CONSTANT_LONG_BYTE_SIZE, global);
-        emitByte(OP_DEFINE_GLOBAL_LONG);
-        for (int i = 0; i < CONSTANT_LONG_BYTE_SIZE; i++) {
-            emitByte(largeConstant[i]);
-        }
-    } else {
-        error("Too many constants in one chunk");
-    }
+    emitOperand(OP_DEFINE_GLOBAL, (int) global);
 }
 
 static void and_(bool canAssign) {
+    int leftStart = operandStart;
+    Value left;
+    if (constantAt(leftStart, &left)) {
+        // A falsey left operand is the result and the right one never
+        // runs; otherwise the right one is the result.
+        discardCode(leftStart);
+        parsePrecedence(PREC_AND);
+        if (isFalsey(left)) {
+            discardCode(leftStart);
+            emitValue(left);
+        }
+        return;
+    }
     int endJump = emitJump(OP_JUMP_IF_FALSE);
     emitByte(OP_POP);
     parsePrecedence(PREC_AND);
@@ -316,11 +405,23 @@ static void and_(bool canAssign) {
 }
 
 static void number(bool canAssign) {
-    double value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+    emitNumber(strtod(parser.previous.start, NULL));
 }
 
 static void or_(bool canAssign) {
+    int leftStart = operandStart;
+    Value left;
+    if (constantAt(leftStart, &left)) {
+        // A truthy left operand is the result and the right one never
+        // runs; otherwise the right one is the result.
+        discardCode(leftStart);
+        parsePrecedence(PREC_OR);
+        if (!isFalsey(left)) {
+            discardCode(leftStart);
+            emitValue(left);
+        }
+        return;
+    }
     int elseJump = emitJump(OP_JUMP_IF_FALSE);
     int endJump = emitJump(OP_JUMP);
     patchJump(elseJump);
@@ -338,43 +439,33 @@ static void string(bool canAssign) {
 static void namedVariable(Token name, bool canAssign) {
     uint8_t getOp, setOp;
     int arg = resolveLocal(current, &name);
+    bool isFinal = false;
+    Value constant = UNDEFINED_VAL;
     if (arg != -1) {
-        getOp = arg <= UINT8_MAX ? OP_GET_LOCAL : OP_GET_LOCAL_LONG;
-        setOp = arg <= UINT8_MAX ? OP_SET_LOCAL : OP_SET_LOCAL_LONG;
+        getOp = OP_GET_LOCAL;
+        setOp = OP_SET_LOCAL;
+        isFinal = current->locals[arg].final;
     } else {
-        arg = identifierConstant(&name);
-        getOp = arg <= UINT8_MAX ? OP_GET_GLOBAL : OP_GET_GLOBAL_LONG;
-        setOp = arg <= UINT8_MAX ? OP_SET_GLOBAL : OP_SET_GLOBAL_LONG;
-    }
-
-    if (getOp == OP_GET_LOCAL_LONG || getOp == OP_GET_GLOBAL_LONG) {
-        uint8_t largeConstant[CONSTANT_LONG_BYTE_SIZE];
-        CONVERT_TO_BYTE_ARRAY(largeConstant, CONSTANT_LONG_BYTE_SIZE, arg);
-        if (match(TOKEN_EQUAL) && canAssign) {
-            Local* local = &current->locals[arg];
-            if (local->final) {
-                error("Can't reassign final variable");
-            }
-            expression();
-            emitByte(setOp);
-        } else {
-            emitByte(getOp);
-        }
-        // Adds 4 bytes of memory to the chunk
-        for (int i = 0; i < CONSTANT_LONG_BYTE_SIZE; i++) {
-                emitByte(largeConstant[i]);
+        arg = identifierSlot(&name);
+        getOp = OP_GET_GLOBAL;
+        setOp = OP_SET_GLOBAL;
+        isFinal = tableGet(&vm.finalGlobals,
+                           AS_STRING(vm.globalIdentifiers.values[arg]),
+                           &constant);
+    }
+
+    if (match(TOKEN_EQUAL) && canAssign) {
+        if (isFinal) {
+            error("Can't reassign final variable");
         }
+        expression();
+        emitOperand(setOp, arg);
+    } else if (!IS_UNDEFINED(constant)) {
+        // Top-level code runs in order, so a read that compiles after the
+        // declaration runs after it too.
+        emitValue(constant);
     } else {
-        if (match(TOKEN_EQUAL) && canAssign) {
-            Local* local = &current->locals[arg];
-            if (local->final) {
-                error("Can't reassign final variable");
-            }
-            expression();
-            emitBytes(setOp, arg);
-        } else {
-             emitBytes(getOp, (uint8_t) arg);
-        }
+        emitOperand(getOp, arg);
     }
 }
 
@@ -382,10 +473,72 @@ static void variable(bool canAssign) {
     namedVariable(parser.previous, canAssign);
 }
 
+// Constant folding: an operator whose operands compiled to constant
+// loads is evaluated here and replaced by a load of the result. Anything
+// run() would report an error for is left to run().
+static bool foldUnary(TokenType operatorType, Value operand, Value* result) {
+    switch (operatorType) {
+        case TOKEN_BANG:
+            *result = BOOL_VAL(isFalsey(operand));
+            return true;
+        case TOKEN_MINUS:
+            if (!IS_NUMBER(operand)) return false;
+            *result = negateNumber(operand);
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool foldBinary(TokenType operatorType, Value a, Value b,
+                       Value* result) {
+    double x, y;
+    switch (operatorType) {
+        case TOKEN_BANG_EQUAL:
+            *result = BOOL_VAL(!valuesEqual(a, b));
+            return true;
+        case TOKEN_EQUAL_EQUAL:
+            *result = BOOL_VAL(valuesEqual(a, b));
+            return true;
+        case TOKEN_PLUS:
+            if (IS_STRING(a) && IS_STRING(b)) {
+                *result = OBJ_VAL(concatenateStrings(AS_STRING(a),
+                                                     AS_STRING(b)));
+                return true;
+            }
+            return addNumbers(a, b, result);
+        case TOKEN_MINUS: return subtractNumbers(a, b, result);
+        case TOKEN_STAR: return multiplyNumbers(a, b, result);
+        case TOKEN_SLASH: return divideNumbers(a, b, result);
+        default:
+            break;
+    }
+    // Spelled like the instructions binary() emits, so NaN compares the
+    // same.
+    if (!toDoubles(a, b, &x, &y)) return false;
+    switch (operatorType) {
+        case TOKEN_GREATER: *result = BOOL_VAL(x > y); return true;
+        case TOKEN_GREATER_EQUAL: *result = BOOL_VAL(!(x < y)); return true;
+        case TOKEN_LESS: *result = BOOL_VAL(x < y); return true;
+        case TOKEN_LESS_EQUAL: *result = BOOL_VAL(!(x > y)); return true;
+        default:
+            return false;
+    }
+}
+
 static void unary(bool canAssign) {
     TokenType operatorType = parser.previous.type;
+    int start = currentChunk()->count;
     // compile the operand
     parsePrecedence(PREC_UNARY);
+    Value operand;
+    Value result;
+    if (constantAt(start, &operand) &&
+            foldUnary(operatorType, operand, &result)) {
+        discardCode(start);
+        emitValue(result);
+        return;
+    }
     // Emit the operator instruction
     switch (operatorType)
     {
@@ -403,11 +556,24 @@ static void binary(bool canAssign) {
     // Remember the operator
     TokenType operatorType = parser.previous.type;
     // previous: +, current: 1
+    int leftStart = operandStart;
+    int rightStart = currentChunk()->count;
+    Value left;
+    bool constantLeft = constantAt(leftStart, &left);
 
     // Compile the rig`
     ParseRule* rule = getRule(operatorType);
     parsePrecedence((Precedence)(rule->precedence + 1));
 
+    Value right;
+    Value result;
+    if (constantLeft && constantAt(rightStart, &right) &&
+            foldBinary(operatorType, left, right, &result)) {
+        discardCode(leftStart);
+        emitValue(result);
+        return;
+    }
+
     // Emit the operator instruction
     switch (operatorType)
     {
@@ -454,6 +620,7 @@ ParseRule rules[] = {
     [TOKEN_SEMICOLON]= {NULL,NULL, PREC_NONE},
     [TOKEN_SLASH]= {NULL,binary, PREC_FACTOR},
     [TOKEN_STAR]= {NULL,binary, PREC_FACTOR},
+    [TOKEN_COLON]= {NULL,NULL, PREC_NONE},
     [TOKEN_BANG]= {unary,NULL,PREC_NONE},
     [TOKEN_BANG_EQUAL]= {NULL,binary,PREC_EQUALITY},
     [TOKEN_EQUAL]= {NULL,NULL,PREC_NONE},
@@ -466,7 +633,9 @@ ParseRule rules[] = {
     [TOKEN_STRING]= {string,NULL,PREC_NONE},
     [TOKEN_NUMBER]= {number,NULL,PREC_NONE},
     [TOKEN_AND]= {NULL,and_,PREC_AND},
+    [TOKEN_CASE]= {NULL,NULL,PREC_NONE},
     [TOKEN_CLASS]= {NULL,NULL,PREC_NONE},
+    [TOKEN_DEFAULT]= {NULL,NULL,PREC_NONE},
     [TOKEN_ELSE]= {NULL,NULL,PREC_NONE},
     [TOKEN_FALSE]= {literal,NULL,PREC_NONE},
     [TOKEN_FOR]= {NULL,NULL,PREC_NONE},
@@ -477,6 +646,7 @@ ParseRule rules[] = {
     [TOKEN_PRINT]= {NULL,NULL,PREC_NONE},
     [TOKEN_RETURN]= {NULL,NULL,PREC_NONE},
     [TOKEN_SUPER]= {NULL,NULL,PREC_NONE},
+    [TOKEN_SWITCH]= {NULL,NULL,PREC_NONE},
     [TOKEN_THIS]= {NULL,NULL,PREC_NONE},
     [TOKEN_TRUE]= {literal,NULL,PREC_NONE},
     [TOKEN_VAR]= {NULL,NULL,PREC_NONE},
@@ -497,10 +667,12 @@ static void parsePrecedence(Precedence precedence) {
     }
 
     bool canAssign = precedence <= PREC_ASSIGNMENT;
+    int start = currentChunk()->count;
     prefixRule(canAssign);
     while(precedence <= getRule(parser.current.type)->precedence) {
         advance(); 
         ParseFn infixRule = getRule(parser.previous.type)->infix;
+        operandStart = start;
         infixRule(canAssign);
     }
     if (canAssign && match(TOKEN_EQUAL)) {
@@ -525,22 +697,63 @@ static void block() {
     consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
+// Records a top-level declaration in vm.finalGlobals: a val with the
+// constant its initializer compiled to, if any, while a var drops an
+// earlier val of the same name.
+static void declareGlobal(uint32_t global, bool isFinal,
+                          int initializerStart) {
+    ObjString* name = AS_STRING(vm.globalIdentifiers.values[global]);
+    if (!isFinal) {
+        tableDelete(&vm.finalGlobals, name);
+        return;
+    }
+    Value constant;
+    if (!constantAt(initializerStart, &constant)) constant = UNDEFINED_VAL;
+    tableSet(&vm.finalGlobals, name, constant);
+}
+
+// Drops the vals of earlier REPL lines that an error stopped before the
+// declaration ran, so their names read as undefined again.
+static void forgetUnrunGlobals() {
+    Table* finals = &vm.finalGlobals;
+    for (int i = 0; i < finals->capacity; i++) {
+        Entry* entry = &finals->entries[i];
+        if (entry->key == NULL) continue;
+        Value value = vm.globalValues.values[globalSlot(entry->key)];
+        // --jit stores an integer constant widened to a double, so a number
+        // that equals the constant counts too; identical covers NaN.
+        bool ran = IS_UNDEFINED(entry->value)
+            ? !IS_UNDEFINED(value)
+            : valuesIdentical(value, entry->value) ||
+              valuesEqual(value, entry->value);
+        if (!ran) tableDelete(finals, entry->key);
+    }
+}
+
 static void varDeclaration() {
+    bool isFinal = parser.previous.type == TOKEN_VAL;
     uint32_t global = parseVariable("Expect variable name.");
 
+    int initializerStart = currentChunk()->count;
     if (match(TOKEN_EQUAL)) {
         expression();
     } else {
         emitByte(OP_NIL);
     }
     consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+    if (current->scopeDepth == 0) {
+        declareGlobal(global, isFinal, initializerStart);
+    }
     defineVariable(global);
 }
 
 static void expressionStatement() {
+    int start = currentChunk()->count;
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
     emitByte(OP_POP);
+    lastExpressionStart = start;
+    lastExpressionEnd = currentChunk()->count;
 }
 
 static void printStatement() {
@@ -549,18 +762,199 @@ static void printStatement() {
     emitByte(OP_PRINT);
 }
 
+// A loop of the shape `while (i < n) { ...; i = i + step; }`, where i
+// is a local or global, n a constant, local or global and step a number.
+typedef struct {
+    uint8_t opcode;
+    int counterKind;
+    int counter;
+    int boundKind;
+    Instruction bound;
+} CountedLoop;
+
+// The constant a load pushes, adding number literals that are immediate
+// operands to the pool. Returns -1 for any other instruction.
+static int loadedConstant(Instruction* instruction) {
+    switch (instruction->opcode) {
+        case OP_CONSTANT:
+            return instruction->operands[0];
+        case OP_INTEGER:
+        case OP_DECIMAL:
+            return addConstant(currentChunk(), immediateValue(
+                instruction->opcode, instruction->operands[0]));
+        default:
+            return -1;
+    }
+}
+
+static bool isLoad(uint8_t opcode) {
+    return opcode == OP_CONSTANT || opcode == OP_INTEGER ||
+           opcode == OP_DECIMAL || opcode == OP_GET_LOCAL ||
+           opcode == OP_GET_GLOBAL;
+}
+
+// Decodes count instructions from offset, which must end exactly at the
+// end of the chunk.
+static bool decodeSequence(int offset, Instruction* instructions,
+                           int count) {
+    Chunk* chunk = currentChunk();
+    for (int i = 0; i < count; i++) {
+        if (offset >= chunk->count) return false;
+        decodeInstruction(chunk, offset, &instructions[i]);
+        offset += instructions[i].length;
+    }
+    return offset == chunk->count;
+}
+
+// Matches the condition compiled since loopStart.
+static bool countedCondition(int loopStart, CountedLoop* loop) {
+    Instruction code[4];
+    bool negated = decodeSequence(loopStart, code, 4);
+    if (!negated && !decodeSequence(loopStart, code, 3)) return false;
+    if (negated && code[3].opcode != OP_NOT) return false;
+    if (code[0].opcode != OP_GET_LOCAL && code[0].opcode != OP_GET_GLOBAL) {
+        return false;
+    }
+    if (!isLoad(code[1].opcode)) return false;
+
+    loop->counterKind = code[0].opcode == OP_GET_LOCAL ? LOOP_LOCAL
+                                                       : LOOP_GLOBAL;
+    loop->counter = code[0].operands[0];
+    switch (code[2].opcode) {
+        case OP_LESS:
+            loop->opcode = negated ? OP_INCREMENT_LOOP_IF_GREATER_EQUAL
+                                   : OP_INCREMENT_LOOP_IF_LESS;
+            break;
+        case OP_GREATER:
+            loop->opcode = negated ? OP_INCREMENT_LOOP_IF_LESS_EQUAL
+                                   : OP_INCREMENT_LOOP_IF_GREATER;
+            break;
+        default:
+            return false;
+    }
+    switch (code[1].opcode) {
+        case OP_GET_LOCAL: loop->boundKind = LOOP_LOCAL; break;
+        case OP_GET_GLOBAL: loop->boundKind = LOOP_GLOBAL; break;
+        default: loop->boundKind = LOOP_CONSTANT; break;
+    }
+    loop->bound = code[1];
+    return true;
+}
+
+// Whether a jump in the code from start up to end lands after offset.
+static bool jumpsPast(int start, int end, int offset) {
+    Chunk* chunk = currentChunk();
+    while (start < end) {
+        Instruction instruction;
+        decodeInstruction(chunk, start, &instruction);
+        if (instruction.target > offset) return true;
+        start += instruction.length;
+    }
+    return false;
+}
+
+// Replaces `counter = counter + step;`, if it ends the body, and the
+// back-edge with the fused instruction. Only the pops of the body's
+// locals may follow the increment; they do not touch the counter, so
+// they move in front of it.
+static bool emitCountedLoop(CountedLoop* loop, int bodyStart,
+                            int loopStart) {
+    Chunk* chunk = currentChunk();
+    int start = lastExpressionStart;
+    int end = lastExpressionEnd;
+    if (start < bodyStart) return false;
+    // Code that branches around the increment, as when it is an else
+    // branch, would land inside the fused instruction.
+    if (jumpsPast(bodyStart, start, start)) return false;
+    for (int offset = end; offset < chunk->count; offset++) {
+        if (chunk->code[offset] != OP_POP) return false;
+    }
+
+    Instruction code[5];
+    int offset = start;
+    for (int i = 0; i < 5; i++) {
+        if (offset >= end) return false;
+        decodeInstruction(chunk, offset, &code[i]);
+        offset += code[i].length;
+    }
+    uint8_t getOp = loop->counterKind == LOOP_LOCAL ? OP_GET_LOCAL
+                                                    : OP_GET_GLOBAL;
+    uint8_t setOp = loop->counterKind == LOOP_LOCAL ? OP_SET_LOCAL
+                                                    : OP_SET_GLOBAL;
+    if (offset != end ||
+        code[0].opcode != getOp || code[0].operands[0] != loop->counter ||
+        (code[2].opcode != OP_ADD && code[2].opcode != OP_SUBTRACT) ||
+        code[3].opcode != setOp || code[3].operands[0] != loop->counter ||
+        code[4].opcode != OP_POP) {
+        return false;
+    }
+    int stepConstant = loadedConstant(&code[1]);
+    if (stepConstant == -1) return false;
+    Value step = chunk->constants.values[stepConstant];
+    if (!IS_NUMBER(step)) return false;
+    // x - y is x + -y, so the instruction only ever adds.
+    bool subtract = code[2].opcode == OP_SUBTRACT;
+    if (subtract) {
+        stepConstant = addConstant(chunk, negateNumber(step));
+    }
+
+    // Errors are reported by the arithmetic, so keep its line.
+    int line = getLine(&chunk->lines, start + code[0].length +
+                                      code[1].length);
+    int pops = chunk->count - end;
+    int popLine = pops > 0 ? getLine(&chunk->lines, end) : line;
+    truncateChunk(chunk, start);
+    for (int i = 0; i < pops; i++) writeChunk(chunk, OP_POP, popLine);
+
+    Instruction fused;
+    fused.opcode = loop->opcode;
+    fused.operandCount = 4;
+    fused.operands[0] = LOOP_KINDS(loop->counterKind, loop->boundKind) |
+                        (subtract ? LOOP_SUBTRACT : 0);
+    fused.operands[1] = loop->counter;
+    fused.operands[2] = stepConstant;
+    fused.operands[3] = loop->boundKind == LOOP_CONSTANT
+        ? loadedConstant(&loop->bound) : loop->bound.operands[0];
+    fused.target = bodyStart;
+    if (chunk->count + encodedLength(&fused) - bodyStart > UINT16_MAX) {
+        error("Loop body too large.");
+    }
+    writeInstruction(chunk, &fused, line);
+    // Leaving through the header re-runs the condition, which exits.
+    emitLoop(loopStart);
+    return true;
+}
+
 static void whileStatement() {
     int loopStart = currentChunk()->count;
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+    Value condition;
+    if (constantAt(loopStart, &condition)) {
+        // The body runs forever or never. It is still compiled, for its
+        // errors, but only kept if it runs.
+        discardCode(loopStart);
+        statement();
+        if (isFalsey(condition)) {
+            discardCode(loopStart);
+        } else {
+            emitLoop(loopStart);
+        }
+        return;
+    }
+    CountedLoop loop = {0};
+    bool counted = countedCondition(loopStart, &loop);
 
     int exitJump = emitJump(OP_JUMP_IF_FALSE);
 
     emitByte(OP_POP);
+    int bodyStart = currentChunk()->count;
     statement();
 
-    emitLoop(loopStart);
+    if (!counted || !emitCountedLoop(&loop, bodyStart, loopStart)) {
+        emitLoop(loopStart);
+    }
 
     patchJump(exitJump);
     emitByte(OP_POP);
@@ -568,8 +962,24 @@ static void whileStatement() {
 
 static void ifStatement() {
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    int conditionStart = currentChunk()->count;
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+    Value condition;
+    if (constantAt(conditionStart, &condition)) {
+        // Only one branch can run. The other one is still compiled, for
+        // its errors, and then dropped.
+        discardCode(conditionStart);
+        bool taken = !isFalsey(condition);
+        statement();
+        if (!taken) discardCode(conditionStart);
+        if (match(TOKEN_ELSE)) {
+            int elseStart = currentChunk()->count;
+            statement();
+            if (taken) discardCode(elseStart);
+        }
+        return;
+    }
     int thenJump = emitJump(OP_JUMP_IF_FALSE);
     emitByte(OP_POP);
     statement();
@@ -580,6 +990,276 @@ static void ifStatement() {
     patchJump(elseJump);
 }
 
+// A switch compiles its case labels and bodies as it parses them, then
+// moves them aside and emits the dispatch in front of them, since which
+// one fits is only known once every label has been seen. Jumps are
+// relative, so code keeps working when it moves.
+#define MAX_CASES UINT8_COUNT
+// Fewer cases than this are as quick to compare one by one.
+#define MIN_TABLE_CASES 4
+
+typedef struct {
+    bool isDefault;
+    bool isConstant;
+    Value label;
+    int labelStart;
+    int labelEnd;
+    int bodyStart;
+    int bodyEnd;
+} SwitchCase;
+
+// The dispatch jumps, each with the case it goes to, -1 for the end: up
+// to two table entries per case and the default, then one jump after
+// each body.
+#define MAX_CASE_JUMPS (MAX_CASES * 3 + 1)
+
+typedef struct {
+    int offsets[MAX_CASE_JUMPS];
+    int cases[MAX_CASE_JUMPS];
+    int count;
+} CaseJumps;
+
+// Moves the code emitted since start to the end of buffer.
+static void moveCode(int start, Chunk* buffer) {
+    Chunk* chunk = currentChunk();
+    for (int offset = start; offset < chunk->count; offset++) {
+        writeChunk(buffer, chunk->code[offset], getLine(&chunk->lines, offset));
+    }
+    discardCode(start);
+}
+
+static void appendCode(Chunk* buffer, int start, int end) {
+    for (int offset = start; offset < end; offset++) {
+        writeChunk(currentChunk(), buffer->code[offset],
+                   getLine(&buffer->lines, offset));
+    }
+}
+
+static void emitCaseJump(CaseJumps* jumps, uint8_t instruction, int target) {
+    jumps->offsets[jumps->count] = emitJump(instruction);
+    jumps->cases[jumps->count++] = target;
+}
+
+static void patchCaseJumps(CaseJumps* jumps, int target) {
+    for (int i = 0; i < jumps->count; i++) {
+        if (jumps->cases[i] == target) patchJump(jumps->offsets[i]);
+    }
+}
+
+static bool isWholeNumber(Value value) {
+    if (!IS_NUMBER(value)) return false;
+    double number = AS_NUMBER(value);
+    return number >= INT32_MIN && number <= INT32_MAX &&
+           number == (int32_t) number;
+}
+
+// Whether every label is a constant matching test, with enough of them
+// to pay for a table.
+static bool tableLabels(SwitchCase* cases, int caseCount,
+                        bool (*test)(Value)) {
+    int labels = 0;
+    for (int i = 0; i < caseCount; i++) {
+        if (cases[i].isDefault) continue;
+        if (!cases[i].isConstant || !test(cases[i].label)) return false;
+        labels++;
+    }
+    return labels >= MIN_TABLE_CASES;
+}
+
+static bool isStringValue(Value value) {
+    return IS_STRING(value);
+}
+
+static int defaultCase(SwitchCase* cases, int caseCount) {
+    for (int i = 0; i < caseCount; i++) {
+        if (cases[i].isDefault) return i;
+    }
+    return -1;
+}
+
+// OP_SWITCH_INTEGER over the labels from the lowest to the highest, if
+// at least half of those numbers are labels.
+static bool integerDispatch(SwitchCase* cases, int caseCount,
+                            CaseJumps* jumps) {
+    if (!tableLabels(cases, caseCount, isWholeNumber)) return false;
+    double lowest = INT32_MAX;
+    double highest = INT32_MIN;
+    int labels = 0;
+    for (int i = 0; i < caseCount; i++) {
+        if (cases[i].isDefault) continue;
+        double label = AS_NUMBER(cases[i].label);
+        if (label < lowest) lowest = label;
+        if (label > highest) highest = label;
+        labels++;
+    }
+    if (highest - lowest + 1 > labels * 2) return false;
+    int count = (int) (highest - lowest) + 1;
+
+    Instruction dispatch;
+    dispatch.opcode = OP_SWITCH_INTEGER;
+    dispatch.operandCount = 2;
+    dispatch.operands[0] = addConstant(currentChunk(), numberValue(lowest));
+    dispatch.operands[1] = count;
+    dispatch.target = -1;
+    writeInstruction(currentChunk(), &dispatch, parser.previous.line);
+    int* entries = ALLOCATE(int, count);
+    for (int i = 0; i < count; i++) entries[i] = -1;
+    // The first of equal labels wins, as it does when comparing.
+    for (int i = caseCount - 1; i >= 0; i--) {
+        if (cases[i].isDefault) continue;
+        entries[(int) (AS_NUMBER(cases[i].label) - lowest)] = i;
+    }
+    int fallback = defaultCase(cases, caseCount);
+    for (int i = 0; i < count; i++) {
+        emitCaseJump(jumps, OP_JUMP, entries[i] == -1 ? fallback : entries[i]);
+    }
+    emitCaseJump(jumps, OP_JUMP, fallback);
+    FREE_ARRAY(int, entries, count);
+    return true;
+}
+
+// OP_SWITCH_STRING over a table from each label to its jump. Strings are
+// interned, so the lookup compares them as OP_EQUAL does.
+static bool stringDispatch(SwitchCase* cases, int caseCount,
+                           CaseJumps* jumps) {
+    if (!tableLabels(cases, caseCount, isStringValue)) return false;
+    Chunk* chunk = currentChunk();
+    int table = addSwitchTable(chunk);
+    int count = 0;
+    for (int i = 0; i < caseCount; i++) {
+        if (cases[i].isDefault) continue;
+        Value index;
+        ObjString* label = AS_STRING(cases[i].label);
+        if (!tableGet(&chunk->switchTables[table], label, &index)) {
+            tableSet(&chunk->switchTables[table], label,
+                     NUMBER_VAL(count));
+        }
+        count++;
+    }
+
+    Instruction dispatch;
+    dispatch.opcode = OP_SWITCH_STRING;
+    dispatch.operandCount = 2;
+    dispatch.operands[0] = table;
+    dispatch.operands[1] = count;
+    dispatch.target = -1;
+    writeInstruction(chunk, &dispatch, parser.previous.line);
+    for (int i = 0; i < caseCount; i++) {
+        if (!cases[i].isDefault) emitCaseJump(jumps, OP_JUMP, i);
+    }
+    emitCaseJump(jumps, OP_JUMP, defaultCase(cases, caseCount));
+    return true;
+}
+
+// Compares the value in slot with each label in turn, as an if/else
+// chain would.
+static void compareDispatch(SwitchCase* cases, int caseCount, int slot,
+                            Chunk* labels, CaseJumps* jumps) {
+    for (int i = 0; i < caseCount; i++) {
+        if (cases[i].isDefault) continue;
+        emitOperand(OP_GET_LOCAL, slot);
+        appendCode(labels, cases[i].labelStart, cases[i].labelEnd);
+        emitByte(OP_EQUAL);
+        int nextCase = emitJump(OP_JUMP_IF_FALSE);
+        emitByte(OP_POP);
+        emitCaseJump(jumps, OP_JUMP, i);
+        patchJump(nextCase);
+        emitByte(OP_POP);
+    }
+    emitCaseJump(jumps, OP_JUMP, defaultCase(cases, caseCount));
+}
+
+static void switchStatement() {
+    Token keyword = parser.previous;
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'switch'.");
+    expression();
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after value.");
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before switch cases.");
+
+    // The value stays in a hidden local while the dispatch and the case
+    // bodies run, so both agree on the slots of the body's locals.
+    beginScope();
+    int slot = current->localCount;
+    Token hidden = keyword;
+    hidden.length = 0;
+    addLocal(hidden, true);
+
+    SwitchCase cases[MAX_CASES];
+    int caseCount = 0;
+    Chunk labels;
+    Chunk bodies;
+    initChunk(&labels);
+    initChunk(&bodies);
+    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+        if (caseCount == MAX_CASES) {
+            errorAtCurrent("Too many cases in switch.");
+            break;
+        }
+        SwitchCase* switchCase = &cases[caseCount];
+        if (match(TOKEN_CASE)) {
+            if (caseCount > 0 && cases[caseCount - 1].isDefault) {
+                error("Can't have a case after the default case.");
+            }
+            int start = currentChunk()->count;
+            expression();
+            switchCase->isDefault = false;
+            switchCase->isConstant = constantAt(start, &switchCase->label);
+            switchCase->labelStart = labels.count;
+            moveCode(start, &labels);
+            switchCase->labelEnd = labels.count;
+        } else if (match(TOKEN_DEFAULT)) {
+            if (defaultCase(cases, caseCount) != -1) {
+                error("Can't have more than one default case.");
+            }
+            switchCase->isDefault = true;
+            switchCase->isConstant = false;
+        } else {
+            // Statements before the first case are still checked.
+            errorAtCurrent("Expect 'case' or 'default'.");
+            while (!check(TOKEN_CASE) && !check(TOKEN_DEFAULT) &&
+                   !check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+                declaration();
+            }
+            continue;
+        }
+        consume(TOKEN_COLON, "Expect ':' after case.");
+
+        int start = currentChunk()->count;
+        beginScope();
+        while (!check(TOKEN_CASE) && !check(TOKEN_DEFAULT) &&
+               !check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+            declaration();
+        }
+        endScope();
+        switchCase->bodyStart = bodies.count;
+        moveCode(start, &bodies);
+        switchCase->bodyEnd = bodies.count;
+        caseCount++;
+    }
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after switch cases.");
+
+    // Emitted after the fact, but the dispatch belongs to the keyword.
+    Token end = parser.previous;
+    parser.previous = keyword;
+    CaseJumps jumps;
+    jumps.count = 0;
+    if (!integerDispatch(cases, caseCount, &jumps) &&
+        !stringDispatch(cases, caseCount, &jumps)) {
+        compareDispatch(cases, caseCount, slot, &labels, &jumps);
+    }
+    for (int i = 0; i < caseCount; i++) {
+        patchCaseJumps(&jumps, i);
+        appendCode(&bodies, cases[i].bodyStart, cases[i].bodyEnd);
+        if (i < caseCount - 1) emitCaseJump(&jumps, OP_JUMP, -1);
+    }
+    patchCaseJumps(&jumps, -1);
+    parser.previous = end;
+    endScope();
+
+    freeChunk(&labels);
+    freeChunk(&bodies);
+}
+
 static void synchronize() {
     parser.panicMode = false;
     while(parser.current.type != TOKEN_EOF) {
@@ -595,6 +1275,9 @@ static void synchronize() {
             case TOKEN_WHILE:
             case TOKEN_PRINT:
             case TOKEN_RETURN:
+            case TOKEN_SWITCH:
+            case TOKEN_CASE:
+            case TOKEN_DEFAULT:
                 return;
             default:
                 // do nothing
@@ -621,6 +1304,8 @@ static void statement() {
         ifStatement();
     } else if (match(TOKEN_WHILE)) {
         whileStatement();
+    } else if (match(TOKEN_SWITCH)) {
+        switchStatement();
     } else if (match(TOKEN_LEFT_BRACE)) {
         beginScope();
         block();
@@ -635,6 +1320,7 @@ bool compile(const char* source, Chunk* chunk) {
     Compiler compiler;
     initCompiler(&compiler);
     compilingChunk = chunk;
+    forgetUnrunGlobals();
 
     parser.hadError = false;
     parser.panicMode = false;
@@ -645,3 +1331,547 @@ bool compile(const char* source, Chunk* chunk) {
     endCompiler();
     return !parser.hadError;
 }
+
+// Bytes of code after which compileSegments() ends a segment at the next
+// declaration. Small segments start the output early and keep the
+// optimizer's per-chunk passes cheap; handing one over costs little.
+#define SEGMENT_BYTES 256
+
+bool compileSegments(const char* source, SegmentFunction emit, void* context) {
+    initScanner(source);
+    Compiler compiler;
+    initCompiler(&compiler);
+    forgetUnrunGlobals();
+
+    parser.hadError = false;
+    parser.panicMode = false;
+    advance();
+    while (!check(TOKEN_EOF)) {
+        Chunk* segment = ALLOCATE(Chunk, 1);
+        initChunk(segment);
+        compilingChunk = segment;
+        while (!check(TOKEN_EOF) && segment->count < SEGMENT_BYTES) {
+            declaration();
+        }
+        endCompiler();
+        if (parser.hadError) {
+            freeChunk(segment);
+            FREE(Chunk, segment);
+        } else {
+            emit(segment, context);
+        }
+    }
+    return !parser.hadError;
+}
+
+// Register backend. Walks the finished stack code once with a model of
+// the stack in which an entry either sits in its own register or is
+// still pending: a copy of another register, a constant, or a global that
+// has not been read yet. Pending entries become operands of whatever
+// consumes them, so `i = i + 1` on a local lowers to a single ADD that
+// writes the local's register. Every entry is written to its register
+// at jumps and jump targets, so all paths into a label agree.
+
+typedef enum {
+    ENTRY_IN_REGISTER,
+    ENTRY_COPY,        // of register index, whose entry is in its register
+    ENTRY_CONSTANT,
+    ENTRY_GLOBAL,
+} EntryKind;
+
+typedef struct {
+    EntryKind kind;
+    int index;
+    // For globals: the OP_GET_GLOBAL that pushed it, and whether the
+    // value has been checked for UNDEFINED_VAL since.
+    int offset;
+    bool read;
+} StackEntry;
+
+typedef struct {
+    Chunk* chunk;
+    RegisterChunk* out;
+    StackEntry* stack;
+    int stackCapacity;
+    int depth;
+    int offset;
+    int line;
+    // Instruction whose destination is the top register, or -1.
+    int producer;
+    // Per stack offset: the register instruction of a jump target and
+    // the stack depth there, -1 until known.
+    int* labels;
+    int* targetDepths;
+    int literals[3];
+} Lowering;
+
+static RegisterArg registerArg(int index) {
+    return (RegisterArg){ARG_REGISTER, index};
+}
+
+static RegisterArg noArg() {
+    return (RegisterArg){ARG_NONE, 0};
+}
+
+static RegisterArg entryArg(Lowering* lowering, int depth) {
+    StackEntry* entry = &lowering->stack[depth];
+    switch (entry->kind) {
+        case ENTRY_COPY: return registerArg(entry->index);
+        case ENTRY_CONSTANT: return (RegisterArg){ARG_CONSTANT, entry->index};
+        case ENTRY_GLOBAL: return (RegisterArg){ARG_GLOBAL, entry->index};
+        default: return registerArg(depth);
+    }
+}
+
+static int emitRegisters(Lowering* lowering, RegisterOp op, RegisterArg dst,
+                         RegisterArg a, RegisterArg b, int offset) {
+    RegisterInstruction instruction;
+    instruction.opcode = op;
+    instruction.args[0] = dst;
+    instruction.args[1] = a;
+    instruction.args[2] = b;
+    instruction.target = -1;
+    instruction.offset = offset;
+    lowering->producer = -1;
+    return writeRegisterInstruction(lowering->out, &instruction);
+}
+
+static void pushEntry(Lowering* lowering, StackEntry entry) {
+    if (lowering->stackCapacity < lowering->depth + 1) {
+        int oldCapacity = lowering->stackCapacity;
+        lowering->stackCapacity = GROW_CAPACITY(oldCapacity);
+        lowering->stack = GROW_ARRAY(StackEntry, lowering->stack,
+                                     oldCapacity, lowering->stackCapacity);
+    }
+    lowering->stack[lowering->depth++] = entry;
+    if (lowering->depth > lowering->out->registerCount) {
+        lowering->out->registerCount = lowering->depth;
+    }
+}
+
+static void pushPending(Lowering* lowering, EntryKind kind, int index) {
+    StackEntry entry = {kind, index, lowering->offset, false};
+    pushEntry(lowering, entry);
+}
+
+static void materialize(Lowering* lowering, int depth) {
+    StackEntry* entry = &lowering->stack[depth];
+    if (entry->kind == ENTRY_IN_REGISTER) return;
+    int offset = entry->kind == ENTRY_GLOBAL ? entry->offset : lowering->offset;
+    emitRegisters(lowering, REG_MOVE, registerArg(depth),
+                  entryArg(lowering, depth), noArg(), offset);
+    entry->kind = ENTRY_IN_REGISTER;
+}
+
+static void flushEntries(Lowering* lowering, int count) {
+    for (int depth = 0; depth < count; depth++) {
+        materialize(lowering, depth);
+    }
+}
+
+// Copies of a register must be made real before it is overwritten,
+// becomes pending or is popped.
+static void clobberRegister(Lowering* lowering, int index) {
+    for (int depth = 0; depth < lowering->depth; depth++) {
+        StackEntry* entry = &lowering->stack[depth];
+        if (entry->kind == ENTRY_COPY && entry->index == index) {
+            materialize(lowering, depth);
+        }
+    }
+}
+
+static void clobberGlobal(Lowering* lowering, int slot) {
+    for (int depth = 0; depth < lowering->depth; depth++) {
+        StackEntry* entry = &lowering->stack[depth];
+        if (entry->kind == ENTRY_GLOBAL && entry->index == slot) {
+            materialize(lowering, depth);
+        }
+    }
+}
+
+// The stack code reads a global when it is pushed, so an unread one may
+// only be left to the instruction consuming the top count entries, and
+// only on its own line, or errors would come out in the wrong order.
+static void settleGlobals(Lowering* lowering, int count) {
+    int first = lowering->depth - count;
+    for (int depth = 0; depth < lowering->depth; depth++) {
+        StackEntry* entry = &lowering->stack[depth];
+        if (entry->kind != ENTRY_GLOBAL || entry->read) continue;
+        if (depth < first ||
+            getLine(&lowering->chunk->lines, entry->offset) != lowering->line) {
+            materialize(lowering, depth);
+        }
+    }
+}
+
+static void popEntries(Lowering* lowering, int count) {
+    for (int i = 0; i < count; i++) {
+        int depth = lowering->depth - 1;
+        StackEntry* entry = &lowering->stack[depth];
+        if (entry->kind == ENTRY_IN_REGISTER) {
+            clobberRegister(lowering, depth);
+        } else if (entry->kind == ENTRY_GLOBAL && !entry->read) {
+            materialize(lowering, depth);
+        }
+        lowering->depth--;
+    }
+}
+
+static void lowerUnary(Lowering* lowering, RegisterOp op) {
+    settleGlobals(lowering, 1);
+    int top = lowering->depth - 1;
+    clobberRegister(lowering, top);
+    int index = emitRegisters(lowering, op, registerArg(top),
+                              entryArg(lowering, top), noArg(),
+                              lowering->offset);
+    lowering->stack[top].kind = ENTRY_IN_REGISTER;
+    lowering->producer = index;
+}
+
+static void lowerBinary(Lowering* lowering, RegisterOp op) {
+    settleGlobals(lowering, 2);
+    int left = lowering->depth - 2;
+    clobberRegister(lowering, left);
+    int index = emitRegisters(lowering, op, registerArg(left),
+                              entryArg(lowering, left),
+                              entryArg(lowering, left + 1), lowering->offset);
+    lowering->stack[left].kind = ENTRY_IN_REGISTER;
+    lowering->depth--;
+    lowering->producer = index;
+}
+
+static bool recordTarget(Lowering* lowering, int target) {
+    if (lowering->targetDepths[target] == -1) {
+        lowering->targetDepths[target] = lowering->depth;
+    }
+    return lowering->targetDepths[target] == lowering->depth;
+}
+
+// Branches on the top operandCount entries, which it pops, after writing
+// every entry below them to its register.
+static bool lowerBranch(Lowering* lowering, RegisterOp op, int operandCount,
+                        int target) {
+    settleGlobals(lowering, operandCount);
+    int first = lowering->depth - operandCount;
+    flushEntries(lowering, first);
+    RegisterArg a = operandCount > 0 ? entryArg(lowering, first) : noArg();
+    RegisterArg b = operandCount > 1 ? entryArg(lowering, first + 1) : noArg();
+    int index = emitRegisters(lowering, op, noArg(), a, b, lowering->offset);
+    lowering->out->code[index].target = target;
+    lowering->depth = first;
+    return recordTarget(lowering, target);
+}
+
+static void lowerSetLocal(Lowering* lowering, int slot) {
+    settleGlobals(lowering, 1);
+    int top = lowering->depth - 1;
+    StackEntry value = lowering->stack[top];
+    if (value.kind == ENTRY_COPY && value.index == slot) return;
+    clobberRegister(lowering, slot);
+
+    RegisterChunk* out = lowering->out;
+    switch (value.kind) {
+        case ENTRY_IN_REGISTER:
+            // Retarget the instruction that computed the value.
+            if (lowering->producer == out->count - 1 &&
+                out->code[lowering->producer].args[0].index == top) {
+                out->code[lowering->producer].args[0].index = slot;
+                lowering->stack[top] = (StackEntry){ENTRY_COPY, slot, 0, false};
+            } else {
+                emitRegisters(lowering, REG_MOVE, registerArg(slot),
+                              registerArg(top), noArg(), lowering->offset);
+            }
+            lowering->stack[slot].kind = ENTRY_IN_REGISTER;
+            break;
+        case ENTRY_GLOBAL:
+            emitRegisters(lowering, REG_MOVE, registerArg(slot),
+                          entryArg(lowering, top), noArg(), value.offset);
+            lowering->stack[slot].kind = ENTRY_IN_REGISTER;
+            lowering->stack[top] = (StackEntry){ENTRY_COPY, slot, 0, false};
+            break;
+        default:
+            lowering->stack[slot] = value;
+            break;
+    }
+}
+
+static void lowerSetGlobal(Lowering* lowering, RegisterOp op, int slot) {
+    settleGlobals(lowering, 1);
+    clobberGlobal(lowering, slot);
+    int top = lowering->depth - 1;
+    emitRegisters(lowering, op, (RegisterArg){ARG_GLOBAL, slot},
+                  entryArg(lowering, top), noArg(), lowering->offset);
+    if (lowering->stack[top].kind == ENTRY_GLOBAL) {
+        lowering->stack[top].read = true;
+    }
+}
+
+static void pushLocal(Lowering* lowering, int slot) {
+    StackEntry entry = lowering->stack[slot];
+    if (entry.kind == ENTRY_IN_REGISTER) {
+        entry = (StackEntry){ENTRY_COPY, slot, 0, false};
+    }
+    pushEntry(lowering, entry);
+}
+
+static void pushLoopCounter(Lowering* lowering, int kinds, int counter) {
+    if (LOOP_COUNTER_KIND(kinds) == LOOP_LOCAL) {
+        pushLocal(lowering, counter);
+    } else {
+        pushPending(lowering, ENTRY_GLOBAL, counter);
+    }
+}
+
+// Lowers the increment and a test that jumps back into the body. The
+// OP_LOOP that follows goes to the header when the test fails or the
+// bound is not a number, so the header reports it.
+static bool lowerCountedLoop(Lowering* lowering, Instruction* instruction,
+                             RegisterOp jumpOp) {
+    Value* constants = lowering->chunk->constants.values;
+    int kinds = instruction->operands[0];
+    int counter = instruction->operands[1];
+    int step = instruction->operands[2];
+    int bound = instruction->operands[3];
+    RegisterOp op = REG_ADD;
+    if (kinds & LOOP_SUBTRACT) {
+        // Subtraction has its own error message.
+        step = addConstant(lowering->chunk, negateNumber(constants[step]));
+        op = REG_SUBTRACT;
+    }
+
+    pushLoopCounter(lowering, kinds, counter);
+    pushPending(lowering, ENTRY_CONSTANT, step);
+    lowerBinary(lowering, op);
+    if (LOOP_COUNTER_KIND(kinds) == LOOP_LOCAL) {
+        lowerSetLocal(lowering, counter);
+    } else {
+        lowerSetGlobal(lowering, REG_SET_GLOBAL, counter);
+    }
+    popEntries(lowering, 1);
+
+    pushLoopCounter(lowering, kinds, counter);
+    switch (LOOP_BOUND_KIND(kinds)) {
+        case LOOP_CONSTANT: pushPending(lowering, ENTRY_CONSTANT, bound); break;
+        case LOOP_LOCAL: pushLocal(lowering, bound); break;
+        default: {
+            // Never read here in a way that could fail.
+            StackEntry entry = {ENTRY_GLOBAL, bound, lowering->offset, true};
+            pushEntry(lowering, entry);
+            break;
+        }
+    }
+    return lowerBranch(lowering, jumpOp, 2, instruction->target);
+}
+
+static bool lowerInstruction(Lowering* lowering, Instruction* instruction) {
+    int operand = instruction->operands[0];
+    switch (instruction->opcode) {
+        case OP_CONSTANT:
+            pushPending(lowering, ENTRY_CONSTANT, operand);
+            return true;
+        case OP_INTEGER:
+        case OP_DECIMAL:
+            pushPending(lowering, ENTRY_CONSTANT,
+                        addConstant(lowering->chunk, immediateValue(
+                            instruction->opcode, operand)));
+            return true;
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+            pushPending(lowering, ENTRY_CONSTANT,
+                        lowering->literals[instruction->opcode - OP_NIL]);
+            return true;
+        case OP_POP: popEntries(lowering, 1); return true;
+        case OP_POPN: popEntries(lowering, operand); return true;
+        case OP_GET_LOCAL: pushLocal(lowering, operand); return true;
+        case OP_SET_LOCAL: lowerSetLocal(lowering, operand); return true;
+        case OP_GET_GLOBAL:
+            pushPending(lowering, ENTRY_GLOBAL, operand);
+            return true;
+        case OP_DEFINE_GLOBAL:
+            lowerSetGlobal(lowering, REG_MOVE, operand);
+            popEntries(lowering, 1);
+            return true;
+        case OP_SET_GLOBAL:
+            lowerSetGlobal(lowering, REG_SET_GLOBAL, operand);
+            return true;
+        case OP_EQUAL: lowerBinary(lowering, REG_EQUAL); return true;
+        case OP_NOT_EQUAL: lowerBinary(lowering, REG_NOT_EQUAL); return true;
+        case OP_GREATER: lowerBinary(lowering, REG_GREATER); return true;
+        case OP_GREATER_EQUAL:
+            lowerBinary(lowering, REG_GREATER_EQUAL);
+            return true;
+        case OP_LESS: lowerBinary(lowering, REG_LESS); return true;
+        case OP_LESS_EQUAL: lowerBinary(lowering, REG_LESS_EQUAL); return true;
+        case OP_ADD:
+        case OP_ADD_UNCHECKED:
+        case OP_ADD_GENERIC:
+        case OP_ADD_NUMBER:
+        case OP_ADD_STRING:
+            lowerBinary(lowering, REG_ADD);
+            return true;
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_UNCHECKED:
+            lowerBinary(lowering, REG_SUBTRACT);
+            return true;
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_UNCHECKED:
+            lowerBinary(lowering, REG_MULTIPLY);
+            return true;
+        case OP_DIVIDE:
+        case OP_DIVIDE_UNCHECKED:
+            lowerBinary(lowering, REG_DIVIDE);
+            return true;
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_ADD_LOCAL_CONSTANT_GENERIC:
+        case OP_ADD_LOCAL_NUMBER:
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+        case OP_SUBTRACT_LOCAL_NUMBER: {
+            bool subtract = instruction->opcode == OP_SUBTRACT_LOCAL_CONSTANT ||
+                            instruction->opcode == OP_SUBTRACT_LOCAL_NUMBER;
+            pushLocal(lowering, operand);
+            pushPending(lowering, ENTRY_CONSTANT, instruction->operands[1]);
+            lowerBinary(lowering, subtract ? REG_SUBTRACT : REG_ADD);
+            return true;
+        }
+        case OP_NOT: lowerUnary(lowering, REG_NOT); return true;
+        case OP_NEGATE:
+        case OP_NEGATE_UNCHECKED:
+            lowerUnary(lowering, REG_NEGATE);
+            return true;
+        case OP_PRINT:
+            settleGlobals(lowering, 1);
+            emitRegisters(lowering, REG_PRINT, noArg(),
+                          entryArg(lowering, lowering->depth - 1), noArg(),
+                          lowering->offset);
+            lowering->depth--;
+            return true;
+        case OP_JUMP:
+        case OP_LOOP:
+            return lowerBranch(lowering, REG_JUMP, 0, instruction->target);
+        case OP_JUMP_IF_FALSE: {
+            // The condition stays on the stack, so it is flushed too.
+            flushEntries(lowering, lowering->depth);
+            int index = emitRegisters(lowering, REG_JUMP_IF_FALSE, noArg(),
+                                      registerArg(lowering->depth - 1),
+                                      noArg(), lowering->offset);
+            lowering->out->code[index].target = instruction->target;
+            return recordTarget(lowering, instruction->target);
+        }
+        case OP_POP_JUMP_IF_FALSE:
+            return lowerBranch(lowering, REG_JUMP_IF_FALSE, 1,
+                               instruction->target);
+        case OP_JUMP_IF_EQUAL:
+            return lowerBranch(lowering, REG_JUMP_IF_EQUAL, 2,
+                               instruction->target);
+        case OP_JUMP_IF_NOT_EQUAL:
+            return lowerBranch(lowering, REG_JUMP_IF_NOT_EQUAL, 2,
+                               instruction->target);
+        case OP_JUMP_IF_NOT_GREATER:
+            return lowerBranch(lowering, REG_JUMP_IF_NOT_GREATER, 2,
+                               instruction->target);
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+            return lowerBranch(lowering, REG_JUMP_IF_NOT_GREATER_EQUAL, 2,
+                               instruction->target);
+        case OP_JUMP_IF_NOT_LESS:
+            return lowerBranch(lowering, REG_JUMP_IF_NOT_LESS, 2,
+                               instruction->target);
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+            return lowerBranch(lowering, REG_JUMP_IF_NOT_LESS_EQUAL, 2,
+                               instruction->target);
+        case OP_INCREMENT_LOOP_IF_LESS:
+            return lowerCountedLoop(lowering, instruction, REG_LOOP_IF_LESS);
+        case OP_INCREMENT_LOOP_IF_LESS_EQUAL:
+            return lowerCountedLoop(lowering, instruction,
+                                    REG_LOOP_IF_LESS_EQUAL);
+        case OP_INCREMENT_LOOP_IF_GREATER:
+            return lowerCountedLoop(lowering, instruction,
+                                    REG_LOOP_IF_GREATER);
+        case OP_INCREMENT_LOOP_IF_GREATER_EQUAL:
+            return lowerCountedLoop(lowering, instruction,
+                                    REG_LOOP_IF_GREATER_EQUAL);
+        case OP_RETURN:
+            emitRegisters(lowering, REG_RETURN, noArg(), noArg(), noArg(),
+                          lowering->offset);
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool endsBlock(uint8_t opcode) {
+    return opcode == OP_JUMP || opcode == OP_LOOP || opcode == OP_RETURN;
+}
+
+bool compileRegisters(Chunk* chunk, RegisterChunk* registers) {
+    Lowering lowering;
+    lowering.chunk = chunk;
+    lowering.out = registers;
+    lowering.stack = NULL;
+    lowering.stackCapacity = 0;
+    lowering.depth = 0;
+    lowering.producer = -1;
+    lowering.offset = 0;
+    lowering.labels = ALLOCATE(int, chunk->count + 1);
+    lowering.targetDepths = ALLOCATE(int, chunk->count + 1);
+    bool* isTarget = ALLOCATE(bool, chunk->count + 1);
+    for (int i = 0; i <= chunk->count; i++) {
+        lowering.labels[i] = -1;
+        lowering.targetDepths[i] = -1;
+        isTarget[i] = false;
+    }
+    for (int offset = 0; offset < chunk->count;) {
+        Instruction instruction;
+        decodeInstruction(chunk, offset, &instruction);
+        if (instruction.target >= 0) isTarget[instruction.target] = true;
+        offset += instruction.length;
+    }
+    lowering.literals[0] = addConstant(chunk, NIL_VAL);
+    lowering.literals[1] = addConstant(chunk, BOOL_VAL(true));
+    lowering.literals[2] = addConstant(chunk, BOOL_VAL(false));
+
+    // Slot zero, reserved by the compiler.
+    pushPending(&lowering, ENTRY_IN_REGISTER, 0);
+
+    bool reachable = true;
+    bool ok = true;
+    for (int offset = 0; ok && offset < chunk->count;) {
+        Instruction instruction;
+        decodeInstruction(chunk, offset, &instruction);
+        lowering.offset = offset;
+        lowering.line = getLine(&chunk->lines, offset);
+        if (isTarget[offset]) {
+            if (reachable) {
+                flushEntries(&lowering, lowering.depth);
+                ok = recordTarget(&lowering, offset);
+            } else if (lowering.targetDepths[offset] == -1) {
+                ok = false;
+            } else {
+                lowering.depth = lowering.targetDepths[offset];
+                for (int depth = 0; depth < lowering.depth; depth++) {
+                    lowering.stack[depth].kind = ENTRY_IN_REGISTER;
+                }
+            }
+            lowering.labels[offset] = registers->count;
+            lowering.producer = -1;
+            reachable = true;
+        }
+        if (ok && reachable) {
+            ok = lowerInstruction(&lowering, &instruction);
+            reachable = !endsBlock(instruction.opcode);
+        }
+        offset += instruction.length;
+    }
+    for (int i = 0; ok && i < registers->count; i++) {
+        RegisterInstruction* instruction = &registers->code[i];
+        if (instruction->target >= 0) {
+            instruction->target = lowering.labels[instruction->target];
+        }
+    }
+
+    FREE_ARRAY(StackEntry, lowering.stack, lowering.stackCapacity);
+    FREE_ARRAY(int, lowering.labels, chunk->count + 1);
+    FREE_ARRAY(int, lowering.targetDepths, chunk->count + 1);
+    FREE_ARRAY(bool, isTarget, chunk->count + 1);
+    return ok;
+}
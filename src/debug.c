@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include "../include/value.h"
 #include "../include/debug.h"
+#include "../include/object.h"
+#include "../include/vm.h"
 
 void disassembleChunk(Chunk* chunk, const char* name) {
     printf("== start %s ==\n", name);
@@ -17,35 +19,96 @@ static int simpleInstruction(const char * name, int offset) {
     return offset + 1;
 }
 
-static int byteInstruction(const char* name, Chunk* chunk, int offset) {
-    uint8_t slot = chunk->code[offset + 1];
-    printf("%-16s %4d\n", name , slot);
-    return offset + 2;
+static int byteInstruction(const char* name, Instruction* instruction,
+                           int offset) {
+    printf("%-16s %4d\n", name, instruction->operands[0]);
+    return offset + instruction->length;
 }
 
-static int jumpInstruction(const char * name, int sign, Chunk* chunk, int offset) {
-    uint16_t jump = (uint16_t) (chunk->code[offset + 1] << 8);
-    jump |= chunk->code[offset + 2];
-    printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
-    return offset + 3;
+static int jumpInstruction(const char * name, Instruction* instruction,
+                           int offset) {
+    printf("%-16s %4d -> %d\n", name, offset, instruction->target);
+    return offset + instruction->length;
 }
 
-static int constantInstruction(const char* name, int type, Chunk* chunk, int offset) {
-    int constant = 0;
-    if (type == OP_CONSTANT_LONG || 
-        type == OP_DEFINE_GLOBAL_LONG || 
-        type == OP_GET_GLOBAL_LONG || 
-        type == OP_SET_GLOBAL_LONG) {
-        for(int i = 1; i <= 4; i++) {
-            constant |= chunk->code[offset+i] << ((4 - i) * 8);
-        }
-    } else {
-        constant = chunk->code[offset+1];
-    }
+static int localConstantInstruction(const char* name, Chunk* chunk,
+                                    Instruction* instruction, int offset) {
+    int constant = instruction->operands[1];
+    printf("%-16s %4d %4d '", name, instruction->operands[0], constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + instruction->length;
+}
+
+static int constantInstruction(const char* name, Chunk* chunk,
+                               Instruction* instruction, int offset) {
+    int constant = instruction->operands[0];
     printf("%s %4d '", name, constant);
     printValue(chunk->constants.values[constant]);
     printf("'\n");
-    return type == OP_CONSTANT_LONG ? offset + 5 : offset + 2;
+    return offset + instruction->length;
+}
+
+static int immediateInstruction(const char* name, Instruction* instruction,
+                                int offset) {
+    printf("%-16s %4d '", name, instruction->operands[0]);
+    printValue(immediateValue(instruction->opcode, instruction->operands[0]));
+    printf("'\n");
+    return offset + instruction->length;
+}
+
+static int globalInstruction(const char* name, Instruction* instruction,
+                             int offset) {
+    int slot = instruction->operands[0];
+    printf("%-16s %4d '", name, slot);
+    printValue(vm.globalIdentifiers.values[slot]);
+    printf("'\n");
+    return offset + instruction->length;
+}
+
+static void loopOperand(Chunk* chunk, int kind, int index) {
+    switch (kind) {
+        case LOOP_CONSTANT:
+            printf(" '");
+            printValue(chunk->constants.values[index]);
+            printf("'");
+            break;
+        case LOOP_LOCAL:
+            printf(" local %d", index);
+            break;
+        case LOOP_GLOBAL:
+            printf(" '");
+            printValue(vm.globalIdentifiers.values[index]);
+            printf("'");
+            break;
+    }
+}
+
+static int switchInstruction(const char* name, Chunk* chunk,
+                             Instruction* instruction, int offset) {
+    int operand = instruction->operands[0];
+    printf("%-16s %4d cases", name, instruction->operands[1]);
+    if (instruction->opcode == OP_SWITCH_INTEGER) {
+        printf(" from '");
+        printValue(chunk->constants.values[operand]);
+        printf("'\n");
+    } else {
+        printf(" in table %d\n", operand);
+    }
+    return offset + instruction->length;
+}
+
+static int countedLoopInstruction(const char* name, Chunk* chunk,
+                                  Instruction* instruction, int offset) {
+    int kinds = instruction->operands[0];
+    printf("%-16s", name);
+    loopOperand(chunk, LOOP_COUNTER_KIND(kinds), instruction->operands[1]);
+    printf(" +");
+    loopOperand(chunk, LOOP_CONSTANT, instruction->operands[2]);
+    printf(" vs");
+    loopOperand(chunk, LOOP_BOUND_KIND(kinds), instruction->operands[3]);
+    printf(" %4d -> %d\n", offset, instruction->target);
+    return offset + instruction->length;
 }
 
 int disassembleInstruction(Chunk* chunk, int offset) {
@@ -55,25 +118,23 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     } else {
         printf("%4d ", getLine(&chunk->lines, offset));
     }
-    uint8_t instruction = chunk->code[offset];
-    switch (instruction)
+    Instruction instruction;
+    decodeInstruction(chunk, offset, &instruction);
+    switch (instruction.opcode)
     {
-        case OP_CONSTANT_LONG:
-            return constantInstruction("OP_CONSTANT_LONG", OP_CONSTANT_LONG, chunk, offset);
         case OP_CONSTANT:
-            return constantInstruction("OP_CONSTANT", OP_CONSTANT, chunk, offset);
+            return constantInstruction("OP_CONSTANT", chunk, &instruction,
+                                       offset);
+        case OP_INTEGER:
+            return immediateInstruction("OP_INTEGER", &instruction, offset);
+        case OP_DECIMAL:
+            return immediateInstruction("OP_DECIMAL", &instruction, offset);
         case OP_DEFINE_GLOBAL:
-            return constantInstruction("OP_DEFINE_GLOBAL", OP_DEFINE_GLOBAL, chunk, offset);
-        case OP_DEFINE_GLOBAL_LONG:
-            return constantInstruction("OP_DEFINE_GLOBAL_LONG", OP_DEFINE_GLOBAL_LONG, chunk, offset);
+            return globalInstruction("OP_DEFINE_GLOBAL", &instruction, offset);
         case OP_GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL", OP_GET_GLOBAL, chunk, offset);
-        case OP_GET_GLOBAL_LONG:
-            return constantInstruction("OP_GET_GLOBAL_LONG", OP_GET_GLOBAL_LONG, chunk, offset);
+            return globalInstruction("OP_GET_GLOBAL", &instruction, offset);
         case OP_SET_GLOBAL:
-            return constantInstruction("OP_SET_GLOBAL", OP_SET_GLOBAL, chunk, offset);
-        case OP_SET_GLOBAL_LONG:
-            return constantInstruction("OP_SET_GLOBAL_LONG", OP_SET_GLOBAL_LONG, chunk, offset);
+            return globalInstruction("OP_SET_GLOBAL", &instruction, offset);
 		case OP_NIL:
 			return simpleInstruction("OP_NIL", offset);
 		case OP_TRUE:
@@ -83,9 +144,9 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_POP:
             return simpleInstruction("OP_POP", offset);
         case OP_GET_LOCAL:
-            return byteInstruction("OP_GET_LOCAL", chunk, offset);
+            return byteInstruction("OP_GET_LOCAL", &instruction, offset);
         case OP_SET_LOCAL:
-            return byteInstruction("OP_SET_LOCAL", chunk, offset);
+            return byteInstruction("OP_SET_LOCAL", &instruction, offset);
 		case OP_EQUAL:
 			return simpleInstruction("OP_EQUAL", offset);
 		case OP_GREATER:
@@ -107,15 +168,91 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_PRINT:
             return simpleInstruction("OP_PRINT", offset);
         case OP_JUMP:
-            return jumpInstruction("OP_JUMP", 1, chunk, offset);
+            return jumpInstruction("OP_JUMP", &instruction, offset);
         case OP_JUMP_IF_FALSE:
-            return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+            return jumpInstruction("OP_JUMP_IF_FALSE", &instruction, offset);
         case OP_LOOP:
-            return jumpInstruction("OP_LOOP", -1, chunk, offset);
+            return jumpInstruction("OP_LOOP", &instruction, offset);
         case OP_RETURN:
             return simpleInstruction("OP_RETURN", offset);
+        case OP_NOT_EQUAL:
+            return simpleInstruction("OP_NOT_EQUAL", offset);
+        case OP_GREATER_EQUAL:
+            return simpleInstruction("OP_GREATER_EQUAL", offset);
+        case OP_LESS_EQUAL:
+            return simpleInstruction("OP_LESS_EQUAL", offset);
+        case OP_POPN:
+            return byteInstruction("OP_POPN", &instruction, offset);
+        case OP_POP_JUMP_IF_FALSE:
+            return jumpInstruction("OP_POP_JUMP_IF_FALSE",
+                                   &instruction, offset);
+        case OP_JUMP_IF_NOT_EQUAL:
+            return jumpInstruction("OP_JUMP_IF_NOT_EQUAL",
+                                   &instruction, offset);
+        case OP_JUMP_IF_EQUAL:
+            return jumpInstruction("OP_JUMP_IF_EQUAL", &instruction, offset);
+        case OP_JUMP_IF_NOT_GREATER:
+            return jumpInstruction("OP_JUMP_IF_NOT_GREATER",
+                                   &instruction, offset);
+        case OP_JUMP_IF_NOT_LESS:
+            return jumpInstruction("OP_JUMP_IF_NOT_LESS", &instruction, offset);
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+            return jumpInstruction("OP_JUMP_IF_NOT_GREATER_EQUAL",
+                                   &instruction, offset);
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+            return jumpInstruction("OP_JUMP_IF_NOT_LESS_EQUAL",
+                                   &instruction, offset);
+        case OP_ADD_LOCAL_CONSTANT:
+            return localConstantInstruction("OP_ADD_LOCAL_CONSTANT", chunk,
+                                            &instruction, offset);
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+            return localConstantInstruction("OP_SUBTRACT_LOCAL_CONSTANT", chunk,
+                                            &instruction, offset);
+        case OP_INCREMENT_LOOP_IF_LESS:
+            return countedLoopInstruction("OP_INCREMENT_LOOP_IF_LESS",
+                                          chunk, &instruction, offset);
+        case OP_INCREMENT_LOOP_IF_LESS_EQUAL:
+            return countedLoopInstruction("OP_INCREMENT_LOOP_IF_LESS_EQUAL",
+                                          chunk, &instruction, offset);
+        case OP_INCREMENT_LOOP_IF_GREATER:
+            return countedLoopInstruction("OP_INCREMENT_LOOP_IF_GREATER",
+                                          chunk, &instruction, offset);
+        case OP_INCREMENT_LOOP_IF_GREATER_EQUAL:
+            return countedLoopInstruction("OP_INCREMENT_LOOP_IF_GREATER_EQUAL",
+                                          chunk, &instruction, offset);
+        case OP_ADD_UNCHECKED:
+            return simpleInstruction("OP_ADD_UNCHECKED", offset);
+        case OP_SUBTRACT_UNCHECKED:
+            return simpleInstruction("OP_SUBTRACT_UNCHECKED", offset);
+        case OP_MULTIPLY_UNCHECKED:
+            return simpleInstruction("OP_MULTIPLY_UNCHECKED", offset);
+        case OP_DIVIDE_UNCHECKED:
+            return simpleInstruction("OP_DIVIDE_UNCHECKED", offset);
+        case OP_NEGATE_UNCHECKED:
+            return simpleInstruction("OP_NEGATE_UNCHECKED", offset);
+        case OP_SWITCH_INTEGER:
+            return switchInstruction("OP_SWITCH_INTEGER", chunk, &instruction,
+                                     offset);
+        case OP_SWITCH_STRING:
+            return switchInstruction("OP_SWITCH_STRING", chunk, &instruction,
+                                     offset);
+        case OP_ADD_GENERIC:
+            return simpleInstruction("OP_ADD_GENERIC", offset);
+        case OP_ADD_NUMBER:
+            return simpleInstruction("OP_ADD_NUMBER", offset);
+        case OP_ADD_STRING:
+            return simpleInstruction("OP_ADD_STRING", offset);
+        case OP_ADD_LOCAL_CONSTANT_GENERIC:
+            return localConstantInstruction("OP_ADD_LOCAL_CONSTANT_GENERIC", chunk,
+                                            &instruction, offset);
+        case OP_ADD_LOCAL_NUMBER:
+            return localConstantInstruction("OP_ADD_LOCAL_NUMBER", chunk,
+                                            &instruction, offset);
+        case OP_SUBTRACT_LOCAL_NUMBER:
+            return localConstantInstruction("OP_SUBTRACT_LOCAL_NUMBER", chunk,
+                                            &instruction, offset);
         default:
-            printf("Unknown opcode %d\n", instruction);
+            printf("Unknown opcode %d\n", instruction.opcode);
             return offset + 1;
     }
 }
@@ -0,0 +1,558 @@
+#include <stdlib.h>
+
+#include "../include/ir.h"
+#include "../include/memory.h"
+
+// Lifting walks the stack code once, keeping a model of the stack in
+// which each entry is either still pending, a tree nothing has consumed
+// yet, or already on the real stack. Operators combine the pending trees
+// on top into bigger ones. Anything with an effect of its own becomes a
+// statement, and every pending entry below what it consumes is pushed
+// first, so the statements and trees keep the order of the stack code.
+
+typedef struct {
+    IR* ir;
+    int* stack;         // node of each entry, -1 once it is on the stack
+    int stackCapacity;
+    int depth;
+    int line;
+} Lifting;
+
+int addNode(IR* ir, NodeKind kind, int line) {
+    if (ir->nodeCapacity < ir->nodeCount + 1) {
+        int oldCapacity = ir->nodeCapacity;
+        ir->nodeCapacity = GROW_CAPACITY(oldCapacity);
+        ir->nodes = GROW_ARRAY(IRNode, ir->nodes, oldCapacity,
+                               ir->nodeCapacity);
+    }
+    IRNode* node = &ir->nodes[ir->nodeCount];
+    node->kind = kind;
+    node->opcode = 0;
+    node->slot = -1;
+    node->operands[0] = -1;
+    node->operands[1] = -1;
+    node->value = NIL_VAL;
+    node->line = line;
+    return ir->nodeCount++;
+}
+
+void insertStatement(IR* ir, int block, int index, StatementKind kind,
+                     int node, int slot, int line) {
+    IRBlock* current = &ir->blocks[block];
+    if (current->capacity < current->count + 1) {
+        int oldCapacity = current->capacity;
+        current->capacity = GROW_CAPACITY(oldCapacity);
+        current->statements = GROW_ARRAY(IRStatement, current->statements,
+                                         oldCapacity, current->capacity);
+    }
+    for (int i = current->count; i > index; i--) {
+        current->statements[i] = current->statements[i - 1];
+    }
+    current->count++;
+    IRStatement* statement = &current->statements[index];
+    statement->kind = kind;
+    statement->node = node;
+    statement->slot = slot;
+    statement->line = line;
+    statement->removed = false;
+}
+
+static void addStatement(IR* ir, StatementKind kind, int node, int slot,
+                         int line) {
+    int block = ir->blockCount - 1;
+    insertStatement(ir, block, ir->blocks[block].count, kind, node, slot,
+                    line);
+}
+
+// Opens up an empty block at index, leaving jump targets alone.
+static void openBlock(IR* ir, int index, int depth) {
+    if (ir->blockCapacity < ir->blockCount + 1) {
+        int oldCapacity = ir->blockCapacity;
+        ir->blockCapacity = GROW_CAPACITY(oldCapacity);
+        ir->blocks = GROW_ARRAY(IRBlock, ir->blocks, oldCapacity,
+                                ir->blockCapacity);
+    }
+    for (int i = ir->blockCount; i > index; i--) {
+        ir->blocks[i] = ir->blocks[i - 1];
+    }
+    ir->blockCount++;
+    IRBlock* block = &ir->blocks[index];
+    block->statements = NULL;
+    block->count = 0;
+    block->capacity = 0;
+    block->depth = depth;
+    block->hasExit = false;
+    block->exitLine = 0;
+}
+
+// While lifting, jump targets are still offsets.
+static void addBlock(IR* ir, int depth) {
+    openBlock(ir, ir->blockCount, depth);
+}
+
+void insertBlock(IR* ir, int index, int depth) {
+    openBlock(ir, index, depth);
+    for (int i = 0; i < ir->blockCount; i++) {
+        IRBlock* block = &ir->blocks[i];
+        if (block->hasExit && block->exit.target >= index) {
+            block->exit.target++;
+        }
+    }
+}
+
+static void pushEntry(Lifting* lifting, int node) {
+    if (lifting->stackCapacity < lifting->depth + 1) {
+        int oldCapacity = lifting->stackCapacity;
+        lifting->stackCapacity = GROW_CAPACITY(oldCapacity);
+        lifting->stack = GROW_ARRAY(int, lifting->stack, oldCapacity,
+                                    lifting->stackCapacity);
+    }
+    lifting->stack[lifting->depth++] = node;
+    if (lifting->depth > lifting->ir->slotCount) {
+        lifting->ir->slotCount = lifting->depth;
+    }
+}
+
+// Pushes the pending entries among the bottom count.
+static void flushEntries(Lifting* lifting, int count) {
+    for (int depth = 0; depth < count; depth++) {
+        int node = lifting->stack[depth];
+        if (node == -1) continue;
+        addStatement(lifting->ir, STATEMENT_PUSH, node, depth,
+                     lifting->ir->nodes[node].line);
+        lifting->stack[depth] = -1;
+    }
+}
+
+// The tree for the entry at depth, which its caller consumes.
+static int takeEntry(Lifting* lifting, int depth) {
+    int node = lifting->stack[depth];
+    if (node != -1) return node;
+    node = addNode(lifting->ir, NODE_STACK, lifting->line);
+    lifting->ir->nodes[node].slot = depth;
+    return node;
+}
+
+static void pushConstant(Lifting* lifting, Value value) {
+    int node = addNode(lifting->ir, NODE_CONSTANT, lifting->line);
+    lifting->ir->nodes[node].value = value;
+    pushEntry(lifting, node);
+}
+
+static void pushSlot(Lifting* lifting, NodeKind kind, int slot) {
+    int node = addNode(lifting->ir, kind, lifting->line);
+    lifting->ir->nodes[node].slot = slot;
+    pushEntry(lifting, node);
+}
+
+// Replaces the top count entries by node with them as operands.
+static void combine(Lifting* lifting, NodeKind kind, uint8_t opcode,
+                    int slot, int count) {
+    int node = addNode(lifting->ir, kind, lifting->line);
+    int first = lifting->depth - count;
+    for (int i = 0; i < count; i++) {
+        int operand = takeEntry(lifting, first + i);
+        lifting->ir->nodes[node].operands[i] = operand;
+    }
+    lifting->ir->nodes[node].opcode = opcode;
+    lifting->ir->nodes[node].slot = slot;
+    lifting->depth = first;
+    pushEntry(lifting, node);
+}
+
+// A statement consuming the top entry.
+static void consumeTop(Lifting* lifting, StatementKind kind, int slot) {
+    int top = lifting->depth - 1;
+    flushEntries(lifting, top);
+    int node = takeEntry(lifting, top);
+    addStatement(lifting->ir, kind, node, slot, lifting->line);
+    lifting->depth--;
+}
+
+static void endBlock(Lifting* lifting, Instruction* exit) {
+    flushEntries(lifting, lifting->depth);
+    IRBlock* block = &lifting->ir->blocks[lifting->ir->blockCount - 1];
+    block->hasExit = true;
+    block->exit = *exit;
+    block->exitLine = lifting->line;
+}
+
+static bool liftInstruction(Lifting* lifting, Instruction* instruction) {
+    Chunk* chunk = lifting->ir->chunk;
+    int operand = instruction->operands[0];
+    switch (instruction->opcode) {
+        case OP_CONSTANT:
+            pushConstant(lifting, chunk->constants.values[operand]);
+            return true;
+        case OP_INTEGER:
+        case OP_DECIMAL:
+            pushConstant(lifting, immediateValue(instruction->opcode,
+                                                 operand));
+            return true;
+        case OP_NIL: pushConstant(lifting, NIL_VAL); return true;
+        case OP_TRUE: pushConstant(lifting, BOOL_VAL(true)); return true;
+        case OP_FALSE: pushConstant(lifting, BOOL_VAL(false)); return true;
+        case OP_GET_LOCAL:
+            flushEntries(lifting, operand + 1);
+            pushSlot(lifting, NODE_LOCAL, operand);
+            return true;
+        case OP_SET_LOCAL:
+            flushEntries(lifting, operand + 1);
+            combine(lifting, NODE_SET_LOCAL, 0, operand, 1);
+            return true;
+        case OP_GET_GLOBAL:
+            pushSlot(lifting, NODE_GLOBAL, operand);
+            return true;
+        case OP_SET_GLOBAL:
+            combine(lifting, NODE_SET_GLOBAL, 0, operand, 1);
+            return true;
+        case OP_DEFINE_GLOBAL:
+            consumeTop(lifting, STATEMENT_DEFINE_GLOBAL, operand);
+            return true;
+        case OP_POP: consumeTop(lifting, STATEMENT_EVAL, -1); return true;
+        case OP_PRINT: consumeTop(lifting, STATEMENT_PRINT, -1); return true;
+        case OP_NOT:
+        case OP_NEGATE:
+            combine(lifting, NODE_UNARY, instruction->opcode, -1, 1);
+            return true;
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            combine(lifting, NODE_BINARY, instruction->opcode, -1, 2);
+            return true;
+        case OP_JUMP:
+        case OP_LOOP:
+        case OP_JUMP_IF_FALSE:
+        case OP_INCREMENT_LOOP_IF_LESS:
+        case OP_INCREMENT_LOOP_IF_LESS_EQUAL:
+        case OP_INCREMENT_LOOP_IF_GREATER:
+        case OP_INCREMENT_LOOP_IF_GREATER_EQUAL:
+        case OP_RETURN:
+            endBlock(lifting, instruction);
+            return true;
+        default:
+            // Superinstructions only come from later passes.
+            return false;
+    }
+}
+
+static bool fallsThrough(uint8_t opcode) {
+    return opcode != OP_JUMP && opcode != OP_LOOP && opcode != OP_RETURN;
+}
+
+static void initIR(IR* ir, Chunk* chunk) {
+    ir->chunk = chunk;
+    ir->nodes = NULL;
+    ir->nodeCount = 0;
+    ir->nodeCapacity = 0;
+    ir->blocks = NULL;
+    ir->blockCount = 0;
+    ir->blockCapacity = 0;
+    ir->slotCount = 0;
+}
+
+void freeIR(IR* ir) {
+    FREE_ARRAY(IRNode, ir->nodes, ir->nodeCapacity);
+    for (int i = 0; i < ir->blockCount; i++) {
+        IRBlock* block = &ir->blocks[i];
+        FREE_ARRAY(IRStatement, block->statements, block->capacity);
+    }
+    FREE_ARRAY(IRBlock, ir->blocks, ir->blockCapacity);
+    initIR(ir, ir->chunk);
+}
+
+bool buildIR(Chunk* chunk, IR* ir) {
+    initIR(ir, chunk);
+    Lifting lifting;
+    lifting.ir = ir;
+    lifting.stack = NULL;
+    lifting.stackCapacity = 0;
+    lifting.depth = 0;
+
+    // A block starts at every jump target and after every jump.
+    bool* leader = ALLOCATE(bool, chunk->count + 1);
+    int* blockAt = ALLOCATE(int, chunk->count + 1);
+    int* targetDepths = ALLOCATE(int, chunk->count + 1);
+    for (int i = 0; i <= chunk->count; i++) {
+        leader[i] = i == 0;
+        blockAt[i] = -1;
+        targetDepths[i] = -1;
+    }
+    for (int offset = 0; offset < chunk->count;) {
+        Instruction instruction;
+        decodeInstruction(chunk, offset, &instruction);
+        offset += instruction.length;
+        if (instruction.target >= 0) leader[instruction.target] = true;
+        if (isJump(instruction.opcode) || instruction.opcode == OP_RETURN) {
+            leader[offset] = true;
+        }
+    }
+
+    // Slot zero, reserved by the compiler.
+    pushEntry(&lifting, -1);
+
+    bool ok = true;
+    bool reachable = true;     // the previous instruction falls through
+    bool skipping = false;      // unreachable code with an unknown depth
+    for (int offset = 0; ok && offset < chunk->count;) {
+        Instruction instruction;
+        decodeInstruction(chunk, offset, &instruction);
+        lifting.line = getLine(&chunk->lines, offset);
+        if (leader[offset]) {
+            if (!reachable) lifting.depth = targetDepths[offset];
+            skipping = lifting.depth == -1;
+            if (!skipping) {
+                if (targetDepths[offset] != -1 &&
+                        targetDepths[offset] != lifting.depth) {
+                    ok = false;
+                    break;
+                }
+                targetDepths[offset] = lifting.depth;
+                for (int depth = 0; depth < lifting.depth; depth++) {
+                    lifting.stack[depth] = -1;
+                }
+                blockAt[offset] = ir->blockCount;
+                addBlock(ir, lifting.depth);
+            }
+        }
+        offset += instruction.length;
+        if (skipping) continue;
+
+        ok = liftInstruction(&lifting, &instruction);
+        reachable = fallsThrough(instruction.opcode);
+        if (instruction.target >= 0) {
+            if (targetDepths[instruction.target] == -1) {
+                targetDepths[instruction.target] = lifting.depth;
+            }
+            ok = ok && targetDepths[instruction.target] == lifting.depth;
+        }
+        if (reachable && offset < chunk->count && leader[offset]) {
+            flushEntries(&lifting, lifting.depth);
+        }
+    }
+    if (reachable) ok = false;  // ran off the end without OP_RETURN
+
+    for (int i = 0; ok && i < ir->blockCount; i++) {
+        IRBlock* block = &ir->blocks[i];
+        if (!block->hasExit || block->exit.target < 0) continue;
+        block->exit.target = blockAt[block->exit.target];
+        ok = block->exit.target != -1;
+    }
+
+    FREE_ARRAY(int, lifting.stack, lifting.stackCapacity);
+    FREE_ARRAY(bool, leader, chunk->count + 1);
+    FREE_ARRAY(int, blockAt, chunk->count + 1);
+    FREE_ARRAY(int, targetDepths, chunk->count + 1);
+    if (!ok) freeIR(ir);
+    return ok;
+}
+
+int blockSuccessors(IR* ir, int block, int successors[2]) {
+    IRBlock* current = &ir->blocks[block];
+    int count = 0;
+    bool next = !current->hasExit || fallsThrough(current->exit.opcode);
+    if (next && block + 1 < ir->blockCount) successors[count++] = block + 1;
+    if (current->hasExit && current->exit.target >= 0) {
+        successors[count++] = current->exit.target;
+    }
+    return count;
+}
+
+static int stackOperands(IR* ir, int index) {
+    if (index == -1) return 0;
+    IRNode* node = &ir->nodes[index];
+    if (node->kind == NODE_STACK) return 1;
+    return stackOperands(ir, node->operands[0]) +
+        stackOperands(ir, node->operands[1]);
+}
+
+int exitDepth(IR* ir, int block) {
+    IRBlock* current = &ir->blocks[block];
+    int depth = current->depth;
+    for (int i = 0; i < current->count; i++) {
+        IRStatement* statement = &current->statements[i];
+        if (statement->removed) continue;
+        depth -= stackOperands(ir, statement->node);
+        if (statement->kind == STATEMENT_PUSH) depth++;
+    }
+    return depth;
+}
+
+// Emitting collects the instructions with jump targets as block indices,
+// then lays the blocks out in order and encodes them.
+
+typedef struct {
+    Instruction instruction;
+    int line;
+    int block;          // jump target, -1 if not a jump
+} Emitted;
+
+typedef struct {
+    IR* ir;
+    Emitted* code;
+    int count;
+    int capacity;
+} Emission;
+
+static void emitInstruction(Emission* emission, uint8_t opcode, int operand,
+                            int line) {
+    if (emission->capacity < emission->count + 1) {
+        int oldCapacity = emission->capacity;
+        emission->capacity = GROW_CAPACITY(oldCapacity);
+        emission->code = GROW_ARRAY(Emitted, emission->code, oldCapacity,
+                                    emission->capacity);
+    }
+    Emitted* emitted = &emission->code[emission->count++];
+    emitted->instruction.opcode = opcode;
+    emitted->instruction.operandCount = operand == -1 ? 0 : 1;
+    emitted->instruction.operands[0] = operand;
+    emitted->instruction.target = -1;
+    emitted->line = line;
+    emitted->block = -1;
+}
+
+// The shortest load of value, as emitValue() in the compiler picks it.
+static void emitLoad(Emission* emission, Value value, int line) {
+    uint8_t opcode;
+    int operand;
+    if (IS_NIL(value)) {
+        emitInstruction(emission, OP_NIL, -1, line);
+    } else if (IS_BOOL(value)) {
+        emitInstruction(emission, AS_BOOL(value) ? OP_TRUE : OP_FALSE, -1,
+                        line);
+    } else if (IS_NUMBER(value) &&
+               immediateNumber(AS_NUMBER(value), &opcode, &operand)) {
+        emitInstruction(emission, opcode, operand, line);
+    } else {
+        if (IS_NUMBER(value)) value = numberValue(AS_NUMBER(value));
+        emitInstruction(emission, OP_CONSTANT,
+                        addConstant(emission->ir->chunk, value), line);
+    }
+}
+
+static void emitNode(Emission* emission, int index) {
+    IRNode* node = &emission->ir->nodes[index];
+    switch (node->kind) {
+        case NODE_CONSTANT:
+            emitLoad(emission, node->value, node->line);
+            break;
+        case NODE_STACK:
+            break;
+        case NODE_LOCAL:
+            emitInstruction(emission, OP_GET_LOCAL, node->slot, node->line);
+            break;
+        case NODE_GLOBAL:
+            emitInstruction(emission, OP_GET_GLOBAL, node->slot, node->line);
+            break;
+        case NODE_UNARY:
+            emitNode(emission, node->operands[0]);
+            emitInstruction(emission, node->opcode, -1, node->line);
+            break;
+        case NODE_BINARY:
+            emitNode(emission, node->operands[0]);
+            emitNode(emission, node->operands[1]);
+            emitInstruction(emission, node->opcode, -1, node->line);
+            break;
+        case NODE_SET_LOCAL:
+            emitNode(emission, node->operands[0]);
+            emitInstruction(emission, OP_SET_LOCAL, node->slot, node->line);
+            break;
+        case NODE_SET_GLOBAL:
+            emitNode(emission, node->operands[0]);
+            emitInstruction(emission, OP_SET_GLOBAL, node->slot, node->line);
+            break;
+    }
+}
+
+static void emitStatement(Emission* emission, IRStatement* statement) {
+    emitNode(emission, statement->node);
+    switch (statement->kind) {
+        case STATEMENT_PUSH:
+            break;
+        case STATEMENT_EVAL:
+            emitInstruction(emission, OP_POP, -1, statement->line);
+            break;
+        case STATEMENT_PRINT:
+            emitInstruction(emission, OP_PRINT, -1, statement->line);
+            break;
+        case STATEMENT_DEFINE_GLOBAL:
+            emitInstruction(emission, OP_DEFINE_GLOBAL, statement->slot,
+                            statement->line);
+            break;
+    }
+}
+
+// Whether the encoded jump reaches target from end, the offset after it.
+static bool jumpFits(Instruction* instruction, int end) {
+    int distance;
+    switch (instruction->opcode) {
+        case OP_LOOP:
+        case OP_INCREMENT_LOOP_IF_LESS:
+        case OP_INCREMENT_LOOP_IF_LESS_EQUAL:
+        case OP_INCREMENT_LOOP_IF_GREATER:
+        case OP_INCREMENT_LOOP_IF_GREATER_EQUAL:
+            distance = end - instruction->target;
+            break;
+        default:
+            distance = instruction->target - end;
+            break;
+    }
+    return distance >= 0 && distance <= UINT16_MAX;
+}
+
+bool emitIR(IR* ir) {
+    Emission emission;
+    emission.ir = ir;
+    emission.code = NULL;
+    emission.count = 0;
+    emission.capacity = 0;
+
+    int* blockStart = ALLOCATE(int, ir->blockCount);
+    for (int i = 0; i < ir->blockCount; i++) {
+        IRBlock* block = &ir->blocks[i];
+        blockStart[i] = emission.count;
+        for (int j = 0; j < block->count; j++) {
+            if (!block->statements[j].removed) {
+                emitStatement(&emission, &block->statements[j]);
+            }
+        }
+        if (block->hasExit) {
+            emitInstruction(&emission, block->exit.opcode, -1,
+                            block->exitLine);
+            Emitted* exit = &emission.code[emission.count - 1];
+            exit->instruction = block->exit;
+            exit->block = block->exit.target;
+        }
+    }
+
+    int* offsets = ALLOCATE(int, emission.count + 1);
+    int offset = 0;
+    for (int i = 0; i < emission.count; i++) {
+        offsets[i] = offset;
+        offset += encodedLength(&emission.code[i].instruction);
+    }
+    offsets[emission.count] = offset;
+    bool ok = true;
+    for (int i = 0; i < emission.count; i++) {
+        Emitted* emitted = &emission.code[i];
+        if (emitted->block == -1) continue;
+        emitted->instruction.target = offsets[blockStart[emitted->block]];
+        ok = ok && jumpFits(&emitted->instruction, offsets[i + 1]);
+    }
+
+    if (ok) {
+        truncateChunk(ir->chunk, 0);
+        for (int i = 0; i < emission.count; i++) {
+            writeInstruction(ir->chunk, &emission.code[i].instruction,
+                             emission.code[i].line);
+        }
+    }
+    FREE_ARRAY(int, offsets, emission.count + 1);
+    FREE_ARRAY(int, blockStart, ir->blockCount);
+    FREE_ARRAY(Emitted, emission.code, emission.capacity);
+    return ok;
+}
@@ -0,0 +1,653 @@
+#include <stdio.h>
+
+#include "../include/jit.h"
+#include "../include/memory.h"
+#include "../include/object.h"
+
+#ifdef JIT_SUPPORTED
+
+// A baseline, template JIT: every instruction becomes a fixed snippet of
+// machine code and control flow becomes native jumps, so dispatch goes
+// away entirely. Stack, local, global and constant traffic is inlined;
+// everything that needs type checks calls one of the helpers below.
+//
+// RBX holds &vm.stackTop for the whole function and R12 the QNAN mask
+// used to tell numbers apart. vm.stackTop itself stays in memory, so
+// helpers can use push()/pop() as usual. Arithmetic and compare-and-branch
+// on two numbers run inline in SSE registers and only call out otherwise.
+// Integer constants are widened to doubles as they are embedded and the
+// helpers only produce doubles, so integers never reach compiled code.
+
+// Helpers that can fail receive the offset just past their instruction,
+// so runtimeError() sees the same vm.ip it would in run() and reports the
+// same line. They return -1 on error; branching helpers return 1 to take
+// the branch.
+
+#define PEEK(distance) (vm.stackTop[-1 - (distance)])
+
+static int fail(int next, const char* message) {
+    vm.ip = vm.chunk->code + next;
+    runtimeError(message);
+    return -1;
+}
+
+#define CHECK_NUMBERS(next) \
+    if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+        return fail(next, "Operands must be numbers."); \
+    }
+
+static int jitUndefinedVariable(int slot, int next) {
+    vm.ip = vm.chunk->code + next;
+    runtimeError("Undefined variable '%s'.",
+                 AS_CSTRING(vm.globalIdentifiers.values[slot]));
+    return -1;
+}
+
+static void jitEqual() {
+    Value b = pop();
+    Value a = pop();
+    push(BOOL_VAL(valuesEqual(a, b)));
+}
+
+static void jitNotEqual() {
+    Value b = pop();
+    Value a = pop();
+    push(BOOL_VAL(!valuesEqual(a, b)));
+}
+
+static void jitNot() {
+    push(BOOL_VAL(isFalsey(pop())));
+}
+
+static void jitPrint() {
+    printValue(pop());
+    printf("\n");
+}
+
+#define NUMBER_HELPER(name, valueType, expression) \
+    static int name(int next) { \
+        CHECK_NUMBERS(next); \
+        double b = AS_NUMBER(pop()); \
+        double a = AS_NUMBER(pop()); \
+        push(valueType(expression)); \
+        return 0; \
+    }
+
+NUMBER_HELPER(jitGreater, BOOL_VAL, a > b)
+NUMBER_HELPER(jitLess, BOOL_VAL, a < b)
+NUMBER_HELPER(jitGreaterEqual, BOOL_VAL, !(a < b))
+NUMBER_HELPER(jitLessEqual, BOOL_VAL, !(a > b))
+NUMBER_HELPER(jitSubtract, NUMBER_VAL, a - b)
+NUMBER_HELPER(jitMultiply, NUMBER_VAL, a * b)
+NUMBER_HELPER(jitDivide, NUMBER_VAL, a / b)
+
+#define COMPARE_JUMP_HELPER(name, condition) \
+    static int name(int next) { \
+        CHECK_NUMBERS(next); \
+        double b = AS_NUMBER(pop()); \
+        double a = AS_NUMBER(pop()); \
+        return !(condition); \
+    }
+
+COMPARE_JUMP_HELPER(jitJumpIfNotGreater, a > b)
+COMPARE_JUMP_HELPER(jitJumpIfNotLess, a < b)
+COMPARE_JUMP_HELPER(jitJumpIfNotGreaterEqual, !(a < b))
+COMPARE_JUMP_HELPER(jitJumpIfNotLessEqual, !(a > b))
+
+static int jitJumpIfEqual() {
+    Value b = pop();
+    Value a = pop();
+    return valuesEqual(a, b);
+}
+
+static int jitJumpIfNotEqual() {
+    Value b = pop();
+    Value a = pop();
+    return !valuesEqual(a, b);
+}
+
+static int jitNegate(int next) {
+    if (!IS_NUMBER(PEEK(0))) return fail(next, "Operand must be a number.");
+    push(NUMBER_VAL(-AS_NUMBER(pop())));
+    return 0;
+}
+
+static int jitAdd(int next) {
+    if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {
+        concatenate();
+    } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+        double b = AS_NUMBER(pop());
+        double a = AS_NUMBER(pop());
+        push(NUMBER_VAL(a + b));
+    } else {
+        return fail(next, "Operands must be two numbers or two strings");
+    }
+    return 0;
+}
+
+static int jitAddLocalConstant(int slot, int constant, int next) {
+    push(vm.stack[slot]);
+    push(vm.chunk->constants.values[constant]);
+    return jitAdd(next);
+}
+
+static int jitSubtractLocalConstant(int slot, int constant, int next) {
+    push(vm.stack[slot]);
+    push(vm.chunk->constants.values[constant]);
+    return jitSubtract(next);
+}
+
+// The entry of a switch on the value on top of the stack. Compared as a
+// whole register, so it returns 64 bits.
+static int64_t jitSwitch(int opcode, int operand, int count) {
+    return switchCase(vm.chunk, (uint8_t) opcode, operand, count, PEEK(0));
+}
+
+// The counter of a counted loop is not a number.
+static int jitCountedLoopError(int kinds, int counter, int next) {
+    if (LOOP_COUNTER_KIND(kinds) == LOOP_GLOBAL &&
+        IS_UNDEFINED(vm.globalValues.values[counter])) {
+        return jitUndefinedVariable(counter, next);
+    }
+    return fail(next, kinds & LOOP_SUBTRACT
+        ? "Operands must be numbers."
+        : "Operands must be two numbers or two strings");
+}
+
+typedef struct {
+    int position;
+    int target;
+} Fixup;
+
+typedef struct {
+    Assembler as;
+    Chunk* chunk;
+    int* labels;
+    Fixup* fixups;
+    int fixupCount;
+    int fixupCapacity;
+} JitCompiler;
+
+static void addFixup(JitCompiler* jit, int position, int target) {
+    if (jit->fixupCapacity < jit->fixupCount + 1) {
+        int oldCapacity = jit->fixupCapacity;
+        jit->fixupCapacity = GROW_CAPACITY(oldCapacity);
+        jit->fixups = GROW_ARRAY(Fixup, jit->fixups, oldCapacity,
+                                 jit->fixupCapacity);
+    }
+    jit->fixups[jit->fixupCount].position = position;
+    jit->fixups[jit->fixupCount].target = target;
+    jit->fixupCount++;
+}
+
+// Bytecode offset used as the target of jumps to the shared error exit.
+#define ERROR_EXIT -1
+
+static void jumpTo(JitCompiler* jit, int target) {
+    addFixup(jit, asmJump(&jit->as), target);
+}
+
+static void jumpIfTo(JitCompiler* jit, Condition condition, int target) {
+    addFixup(jit, asmJumpIf(&jit->as, condition), target);
+}
+
+static void call(JitCompiler* jit, void* helper, int argCount,
+                 int arg0, int arg1, int arg2) {
+    if (argCount > 0) asmMovImm32(&jit->as, RDI, (uint32_t) arg0);
+    if (argCount > 1) asmMovImm32(&jit->as, RSI, (uint32_t) arg1);
+    if (argCount > 2) asmMovImm32(&jit->as, RDX, (uint32_t) arg2);
+    asmCall(&jit->as, helper);
+}
+
+// Calls a helper that returns -1 on error.
+static void callChecked(JitCompiler* jit, void* helper, int argCount,
+                        int arg0, int arg1, int arg2) {
+    call(jit, helper, argCount, arg0, arg1, arg2);
+    asmTest32(&jit->as, RAX, RAX);
+    jumpIfTo(jit, CC_S, ERROR_EXIT);
+}
+
+// Calls a helper that returns 1 to branch to target, -1 on error.
+static void callBranch(JitCompiler* jit, void* helper, int next, int target) {
+    callChecked(jit, helper, 1, next, 0, 0);
+    jumpIfTo(jit, CC_NE, target);
+}
+
+// *vm.stackTop++ = RCX
+static void pushRcx(JitCompiler* jit) {
+    asmLoad(&jit->as, RAX, RBX, 0);
+    asmStore(&jit->as, RAX, 0, RCX);
+    asmAddMem(&jit->as, RBX, 0, sizeof(Value));
+}
+
+static void pushValue(JitCompiler* jit, Value value) {
+    asmMovImm64(&jit->as, RCX, widenInteger(value));
+    pushRcx(jit);
+}
+
+// RCX = vm.stackTop[-1]
+static void peekRcx(JitCompiler* jit) {
+    asmLoad(&jit->as, RAX, RBX, 0);
+    asmLoad(&jit->as, RCX, RAX, -(int32_t) sizeof(Value));
+}
+
+// RCX = *--vm.stackTop
+static void popRcx(JitCompiler* jit) {
+    asmSubMem(&jit->as, RBX, 0, sizeof(Value));
+    asmLoad(&jit->as, RAX, RBX, 0);
+    asmLoad(&jit->as, RCX, RAX, 0);
+}
+
+// Branches to target when RCX is nil or false.
+static void branchIfFalseyRcx(JitCompiler* jit, int target) {
+    asmMovImm64(&jit->as, RDX, NIL_VAL);
+    asmCmp(&jit->as, RCX, RDX);
+    jumpIfTo(jit, CC_E, target);
+    asmMovImm64(&jit->as, RDX, FALSE_VAL);
+    asmCmp(&jit->as, RCX, RDX);
+    jumpIfTo(jit, CC_E, target);
+}
+
+// RDX = &vm.globalValues.values[slot]; RCX = *RDX, leaving for the error
+// exit if the global is not defined yet.
+static void loadGlobal(JitCompiler* jit, int slot, int next) {
+    asmMovImm64(&jit->as, RDX,
+                (uint64_t) (uintptr_t) &vm.globalValues.values[slot]);
+    asmLoad(&jit->as, RCX, RDX, 0);
+    asmMovImm64(&jit->as, RAX, UNDEFINED_VAL);
+    asmCmp(&jit->as, RCX, RAX);
+    int defined = asmJumpIf(&jit->as, CC_NE);
+    call(jit, jitUndefinedVariable, 2, slot, next, 0);
+    jumpTo(jit, ERROR_EXIT);
+    asmPatch(&jit->as, defined, jit->as.count);
+}
+
+static void prologue(JitCompiler* jit) {
+    asmPush(&jit->as, RBX);
+    asmPush(&jit->as, R12);
+    // Keeps the stack 16-byte aligned for helper calls.
+    asmPush(&jit->as, R13);
+    asmMovImm64(&jit->as, RBX, (uint64_t) (uintptr_t) &vm.stackTop);
+    asmMovImm64(&jit->as, R12, QNAN);
+}
+
+static void epilogue(JitCompiler* jit, InterpretResult result) {
+    asmMovImm32(&jit->as, RAX, result);
+    asmPop(&jit->as, R13);
+    asmPop(&jit->as, R12);
+    asmPop(&jit->as, RBX);
+    asmRet(&jit->as);
+}
+
+// Jumps (to a position to be patched) when reg does not hold a number.
+// Clobbers RSI.
+static int jumpIfNotNumber(JitCompiler* jit, Register reg) {
+    asmMovReg(&jit->as, RSI, reg);
+    asmAnd(&jit->as, RSI, R12);
+    asmCmp(&jit->as, RSI, R12);
+    return asmJumpIf(&jit->as, CC_E);
+}
+
+typedef void (*SseOp)(Assembler* as, XmmRegister dst, XmmRegister src);
+
+// RAX = vm.stackTop, RCX = b, RDX = a, leaving through the returned jumps
+// when either is not a number.
+static void loadNumberOperands(JitCompiler* jit, int* notA, int* notB) {
+    asmLoad(&jit->as, RAX, RBX, 0);
+    asmLoad(&jit->as, RCX, RAX, -(int32_t) sizeof(Value));
+    asmLoad(&jit->as, RDX, RAX, -2 * (int32_t) sizeof(Value));
+    *notA = jumpIfNotNumber(jit, RDX);
+    *notB = jumpIfNotNumber(jit, RCX);
+    asmMovqToXmm(&jit->as, XMM0, RDX);
+    asmMovqToXmm(&jit->as, XMM1, RCX);
+}
+
+static void arithmetic(JitCompiler* jit, SseOp op, void* helper, int next) {
+    Assembler* as = &jit->as;
+    int notA, notB;
+    loadNumberOperands(jit, &notA, &notB);
+    op(as, XMM0, XMM1);
+    asmMovqFromXmm(as, RCX, XMM0);
+    asmStore(as, RAX, -2 * (int32_t) sizeof(Value), RCX);
+    asmSubMem(as, RBX, 0, sizeof(Value));
+    int done = asmJump(as);
+
+    asmPatch(as, notA, as->count);
+    asmPatch(as, notB, as->count);
+    callChecked(jit, helper, 1, next, 0, 0);
+    asmPatch(as, done, as->count);
+}
+
+// Compares a and b with UCOMISD (b against a when swap is set) and
+// branches on jumpWhen. Unordered operands set CF and ZF, which the
+// conditions used below treat the same way as the C comparisons.
+static void compareJump(JitCompiler* jit, bool swap, Condition jumpWhen,
+                        void* helper, int next, int target) {
+    Assembler* as = &jit->as;
+    int notA, notB;
+    loadNumberOperands(jit, &notA, &notB);
+    asmSubMem(as, RBX, 0, 2 * sizeof(Value));
+    if (swap) {
+        asmUcomisd(as, XMM1, XMM0);
+    } else {
+        asmUcomisd(as, XMM0, XMM1);
+    }
+    jumpIfTo(jit, jumpWhen, target);
+    int done = asmJump(as);
+
+    asmPatch(as, notA, as->count);
+    asmPatch(as, notB, as->count);
+    callBranch(jit, helper, next, target);
+    asmPatch(as, done, as->count);
+}
+
+static void localConstant(JitCompiler* jit, SseOp op, void* helper,
+                          Instruction* instruction, int next) {
+    Assembler* as = &jit->as;
+    int slot = instruction->operands[0];
+    int constant = instruction->operands[1];
+    Value b = widenInteger(jit->chunk->constants.values[constant]);
+    if (!IS_NUMBER(b)) {
+        callChecked(jit, helper, 3, slot, constant, next);
+        return;
+    }
+    asmMovImm64(as, RDX, (uint64_t) (uintptr_t) &vm.stack[slot]);
+    asmLoad(as, RDX, RDX, 0);
+    int notA = jumpIfNotNumber(jit, RDX);
+    asmMovqToXmm(as, XMM0, RDX);
+    asmMovImm64(as, RCX, b);
+    asmMovqToXmm(as, XMM1, RCX);
+    op(as, XMM0, XMM1);
+    asmMovqFromXmm(as, RCX, XMM0);
+    pushRcx(jit);
+    int done = asmJump(as);
+
+    asmPatch(as, notA, as->count);
+    callChecked(jit, helper, 3, slot, constant, next);
+    asmPatch(as, done, as->count);
+}
+
+static Value* loopOperand(int kind, int index) {
+    return kind == LOOP_LOCAL
+        ? &vm.stack[index] : &vm.globalValues.values[index];
+}
+
+// Adds the step to the counter in place and branches to target while the
+// condition holds, comparing as compareJump() does. A bound that is not a
+// number falls through to the OP_LOOP, and the header reports it.
+static void countedLoop(JitCompiler* jit, bool swap, Condition jumpWhen,
+                        Instruction* instruction, int next) {
+    Assembler* as = &jit->as;
+    int kinds = instruction->operands[0];
+    int counter = instruction->operands[1];
+    Value step =
+        widenInteger(jit->chunk->constants.values[instruction->operands[2]]);
+    int boundKind = LOOP_BOUND_KIND(kinds);
+    int bound = instruction->operands[3];
+
+    asmMovImm64(as, RDX, (uint64_t) (uintptr_t)
+                loopOperand(LOOP_COUNTER_KIND(kinds), counter));
+    asmLoad(as, RCX, RDX, 0);
+    int notCounter = jumpIfNotNumber(jit, RCX);
+    asmMovqToXmm(as, XMM0, RCX);
+    asmMovImm64(as, RCX, step);
+    asmMovqToXmm(as, XMM1, RCX);
+    asmAddsd(as, XMM0, XMM1);
+    asmMovqFromXmm(as, RCX, XMM0);
+    asmStore(as, RDX, 0, RCX);
+
+    int notBound = -1;
+    bool numberBound = true;
+    if (boundKind == LOOP_CONSTANT) {
+        Value value = widenInteger(jit->chunk->constants.values[bound]);
+        numberBound = IS_NUMBER(value);
+        asmMovImm64(as, RCX, value);
+    } else {
+        asmMovImm64(as, RDX, (uint64_t) (uintptr_t)
+                    loopOperand(boundKind, bound));
+        asmLoad(as, RCX, RDX, 0);
+        notBound = jumpIfNotNumber(jit, RCX);
+    }
+    if (numberBound) {
+        asmMovqToXmm(as, XMM1, RCX);
+        if (swap) {
+            asmUcomisd(as, XMM1, XMM0);
+        } else {
+            asmUcomisd(as, XMM0, XMM1);
+        }
+        jumpIfTo(jit, jumpWhen, instruction->target);
+    }
+    int done = asmJump(as);
+
+    asmPatch(as, notCounter, as->count);
+    call(jit, jitCountedLoopError, 3, kinds, counter, next);
+    jumpTo(jit, ERROR_EXIT);
+    asmPatch(as, done, as->count);
+    if (notBound >= 0) asmPatch(as, notBound, as->count);
+}
+
+static bool compileInstruction(JitCompiler* jit, int offset,
+                               Instruction* instruction) {
+    Assembler* as = &jit->as;
+    int next = offset + instruction->length;
+    int operand = instruction->operands[0];
+    switch (instruction->opcode) {
+        case OP_CONSTANT:
+            pushValue(jit, jit->chunk->constants.values[operand]);
+            break;
+        case OP_INTEGER:
+        case OP_DECIMAL:
+            pushValue(jit, immediateValue(instruction->opcode, operand));
+            break;
+        case OP_NIL: pushValue(jit, NIL_VAL); break;
+        case OP_TRUE: pushValue(jit, TRUE_VAL); break;
+        case OP_FALSE: pushValue(jit, FALSE_VAL); break;
+        case OP_POP:
+            asmSubMem(as, RBX, 0, sizeof(Value));
+            break;
+        case OP_POPN:
+            asmSubMem(as, RBX, 0, operand * (int32_t) sizeof(Value));
+            break;
+        case OP_GET_LOCAL:
+            asmMovImm64(as, RDX, (uint64_t) (uintptr_t) &vm.stack[operand]);
+            asmLoad(as, RCX, RDX, 0);
+            pushRcx(jit);
+            break;
+        case OP_SET_LOCAL:
+            peekRcx(jit);
+            asmMovImm64(as, RDX, (uint64_t) (uintptr_t) &vm.stack[operand]);
+            asmStore(as, RDX, 0, RCX);
+            break;
+        case OP_GET_GLOBAL:
+            loadGlobal(jit, operand, next);
+            pushRcx(jit);
+            break;
+        case OP_SET_GLOBAL:
+            loadGlobal(jit, operand, next);
+            peekRcx(jit);
+            asmStore(as, RDX, 0, RCX);
+            break;
+        case OP_DEFINE_GLOBAL:
+            popRcx(jit);
+            asmMovImm64(as, RDX,
+                        (uint64_t) (uintptr_t) &vm.globalValues.values[operand]);
+            asmStore(as, RDX, 0, RCX);
+            break;
+        case OP_EQUAL: call(jit, jitEqual, 0, 0, 0, 0); break;
+        case OP_NOT_EQUAL: call(jit, jitNotEqual, 0, 0, 0, 0); break;
+        case OP_GREATER: callChecked(jit, jitGreater, 1, next, 0, 0); break;
+        case OP_LESS: callChecked(jit, jitLess, 1, next, 0, 0); break;
+        case OP_GREATER_EQUAL:
+            callChecked(jit, jitGreaterEqual, 1, next, 0, 0);
+            break;
+        case OP_LESS_EQUAL:
+            callChecked(jit, jitLessEqual, 1, next, 0, 0);
+            break;
+        case OP_ADD:
+        case OP_ADD_GENERIC:
+        case OP_ADD_NUMBER:
+        case OP_ADD_STRING:
+        case OP_ADD_UNCHECKED:
+            arithmetic(jit, asmAddsd, jitAdd, next);
+            break;
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_UNCHECKED:
+            arithmetic(jit, asmSubsd, jitSubtract, next);
+            break;
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_UNCHECKED:
+            arithmetic(jit, asmMulsd, jitMultiply, next);
+            break;
+        case OP_DIVIDE:
+        case OP_DIVIDE_UNCHECKED:
+            arithmetic(jit, asmDivsd, jitDivide, next);
+            break;
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_ADD_LOCAL_CONSTANT_GENERIC:
+        case OP_ADD_LOCAL_NUMBER:
+            localConstant(jit, asmAddsd, jitAddLocalConstant, instruction, next);
+            break;
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+        case OP_SUBTRACT_LOCAL_NUMBER:
+            localConstant(jit, asmSubsd, jitSubtractLocalConstant,
+                          instruction, next);
+            break;
+        case OP_NOT: call(jit, jitNot, 0, 0, 0, 0); break;
+        case OP_NEGATE:
+        case OP_NEGATE_UNCHECKED:
+            callChecked(jit, jitNegate, 1, next, 0, 0);
+            break;
+        case OP_PRINT: call(jit, jitPrint, 0, 0, 0, 0); break;
+        case OP_JUMP:
+        case OP_LOOP:
+            jumpTo(jit, instruction->target);
+            break;
+        case OP_JUMP_IF_FALSE:
+            peekRcx(jit);
+            branchIfFalseyRcx(jit, instruction->target);
+            break;
+        case OP_POP_JUMP_IF_FALSE:
+            popRcx(jit);
+            branchIfFalseyRcx(jit, instruction->target);
+            break;
+        case OP_JUMP_IF_EQUAL:
+            callBranch(jit, jitJumpIfEqual, next, instruction->target);
+            break;
+        case OP_JUMP_IF_NOT_EQUAL:
+            callBranch(jit, jitJumpIfNotEqual, next, instruction->target);
+            break;
+        case OP_JUMP_IF_NOT_GREATER:
+            compareJump(jit, false, CC_BE, jitJumpIfNotGreater, next,
+                        instruction->target);
+            break;
+        case OP_JUMP_IF_NOT_LESS:
+            compareJump(jit, true, CC_BE, jitJumpIfNotLess, next,
+                        instruction->target);
+            break;
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+            compareJump(jit, true, CC_A, jitJumpIfNotGreaterEqual, next,
+                        instruction->target);
+            break;
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+            compareJump(jit, false, CC_A, jitJumpIfNotLessEqual, next,
+                        instruction->target);
+            break;
+        case OP_INCREMENT_LOOP_IF_LESS:
+            countedLoop(jit, true, CC_A, instruction, next);
+            break;
+        case OP_INCREMENT_LOOP_IF_LESS_EQUAL:
+            countedLoop(jit, false, CC_BE, instruction, next);
+            break;
+        case OP_INCREMENT_LOOP_IF_GREATER:
+            countedLoop(jit, false, CC_A, instruction, next);
+            break;
+        case OP_INCREMENT_LOOP_IF_GREATER_EQUAL:
+            countedLoop(jit, true, CC_BE, instruction, next);
+            break;
+        case OP_SWITCH_INTEGER:
+        case OP_SWITCH_STRING: {
+            // Native code has no indexed jump here, so the entry the
+            // helper picks is found by comparing; entry 0 falls through.
+            int count = instruction->operands[1];
+            call(jit, jitSwitch, 3, instruction->opcode, operand, count);
+            int entry = next;
+            for (int i = 0; i <= count; i++) {
+                Instruction jump;
+                decodeInstruction(jit->chunk, entry, &jump);
+                if (i > 0) {
+                    asmMovImm32(as, RDX, (uint32_t) i);
+                    asmCmp(as, RAX, RDX);
+                    jumpIfTo(jit, CC_E, jump.target);
+                }
+                entry += jump.length;
+            }
+            break;
+        }
+        case OP_RETURN:
+            epilogue(jit, INTERPRET_OK);
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+bool jitCompile(Chunk* chunk, JitFunction* function) {
+    JitCompiler jit;
+    initAssembler(&jit.as);
+    jit.chunk = chunk;
+    jit.labels = ALLOCATE(int, chunk->count);
+    jit.fixups = NULL;
+    jit.fixupCount = 0;
+    jit.fixupCapacity = 0;
+
+    prologue(&jit);
+
+    bool supported = true;
+    for (int offset = 0; offset < chunk->count && supported;) {
+        Instruction instruction;
+        decodeInstruction(chunk, offset, &instruction);
+        jit.labels[offset] = jit.as.count;
+        supported = compileInstruction(&jit, offset, &instruction);
+        offset += instruction.length;
+    }
+
+    int errorExit = jit.as.count;
+    epilogue(&jit, INTERPRET_RUNTIME_ERROR);
+
+    for (int i = 0; i < jit.fixupCount && supported; i++) {
+        Fixup* fixup = &jit.fixups[i];
+        int target = fixup->target == ERROR_EXIT
+            ? errorExit : jit.labels[fixup->target];
+        asmPatch(&jit.as, fixup->position, target);
+    }
+
+    if (supported) {
+        supported = makeExecutable(&jit.as, &function->executable);
+        function->entry = (JitEntry) function->executable.code;
+    }
+
+    FREE_ARRAY(int, jit.labels, chunk->count);
+    FREE_ARRAY(Fixup, jit.fixups, jit.fixupCapacity);
+    freeAssembler(&jit.as);
+    return supported;
+}
+
+void jitFree(JitFunction* function) {
+    freeExecutable(&function->executable);
+    function->entry = NULL;
+}
+
+#else
+
+bool jitCompile(Chunk* chunk, JitFunction* function) {
+    (void) chunk;
+    function->entry = NULL;
+    return false;
+}
+
+void jitFree(JitFunction* function) {
+    function->entry = NULL;
+}
+
+#endif
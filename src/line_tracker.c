@@ -33,6 +33,18 @@ void freeLineArray(LineArray* array) {
     initLineArray(array);
 }
 
+void truncateLineArray(LineArray* array, int count) {
+    int c = 0;
+    for (int i = 0; i < array->count; i += STORAGE_LENGTH) {
+        if (c + array->values[i] >= count) {
+            array->values[i] = count - c;
+            array->count = array->values[i] == 0 ? i : i + STORAGE_LENGTH;
+            return;
+        }
+        c += array->values[i];
+    }
+}
+
 int getLine(LineArray * array, int index) {
     int c = 0;
     for (int i = 0; i < array->count; i++) {
@@ -1,7 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "../include/aot.h"
 #include "../include/common.h"
+#include "../include/profile.h"
 #include "../include/vm.h"
 
 
@@ -44,25 +46,112 @@ static char* readFile(const char* path) {
     return buffer;
 }
 
+// Type profiles to record and to compile with, see profile.h.
+static const char* profilePath = NULL;
+static const char* feedbackPath = NULL;
+
+static void loadFeedback(const char* source, TypeProfile* feedback) {
+    if (feedbackPath == NULL) return;
+    if (readProfile(feedback, feedbackPath, source)) {
+        vm.feedback = feedback;
+    } else {
+        fprintf(stderr, "Ignoring profile \"%s\", which was not recorded "
+                        "for this script and flags.\n", feedbackPath);
+    }
+}
+
 static void runFile(const char* path) {
     char* source = readFile(path);
+    TypeProfile profile;
+    TypeProfile feedback;
+    if (profilePath != NULL) {
+        initProfile(&profile, source);
+        vm.profile = &profile;
+    }
+    loadFeedback(source, &feedback);
     InterpretResult result = interpret(source);
     free(source);
+    if (vm.feedback != NULL) freeProfile(&feedback);
+    if (vm.profile != NULL && result != INTERPRET_COMPILE_ERROR &&
+        !writeProfile(&profile, profilePath)) {
+        fprintf(stderr, "Could not write profile \"%s\".\n", profilePath);
+        exit(74);
+    }
+    if (vm.profile != NULL) freeProfile(&profile);
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+// Writes the script as C to stdout instead of running it, see aot.h.
+static void emitFile(const char* path) {
+    char* source = readFile(path);
+    TypeProfile feedback;
+    loadFeedback(source, &feedback);
+    bool compiled = emitC(source, stdout);
+    free(source);
+    if (vm.feedback != NULL) freeProfile(&feedback);
+    if (!compiled) exit(65);
+}
+
 
 
+static void usage() {
+    fprintf(stderr, "Usage: clox [--jit] [--trace] [--registers] "
+                    "[--optimize] [--use-profile file | --pipeline] "
+                    "[path]\n"
+                    "       clox [--optimize] --profile file path\n"
+                    "       clox [--optimize] [--use-profile file] "
+                    "--emit-c path\n");
+    exit(64);
+}
+
 int main(int argc, const char * argv[]) {
     initVM();
-    if (argc == 1) {
+    const char* path = NULL;
+    bool emit = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--jit") == 0) {
+            vm.useJit = true;
+        } else if (strcmp(argv[i], "--trace") == 0) {
+            vm.useTracing = true;
+        } else if (strcmp(argv[i], "--registers") == 0) {
+            vm.useRegisters = true;
+        } else if (strcmp(argv[i], "--optimize") == 0) {
+            vm.useOptimizer = true;
+        } else if (strcmp(argv[i], "--pipeline") == 0) {
+            vm.usePipeline = true;
+        } else if (strcmp(argv[i], "--emit-c") == 0) {
+            emit = true;
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profilePath = argv[++i];
+        } else if (strcmp(argv[i], "--use-profile") == 0 && i + 1 < argc) {
+            feedbackPath = argv[++i];
+        } else if (argv[i][0] == '-' || path != NULL) {
+            usage();
+        } else {
+            path = argv[i];
+        }
+    }
+    // Only run() records a profile, and a specialized chunk would hide
+    // the sites that were already specialized.
+    if (profilePath != NULL &&
+        (path == NULL || emit || feedbackPath != NULL ||
+         vm.useJit || vm.useTracing || vm.useRegisters)) {
+        usage();
+    }
+    // Profiles are kept by offset into the one chunk of the whole script,
+    // which a pipelined run never builds.
+    if (vm.usePipeline &&
+        (profilePath != NULL || feedbackPath != NULL || emit)) {
+        usage();
+    }
+    if (emit) {
+        if (path == NULL) usage();
+        emitFile(path);
+    } else if (path == NULL) {
         repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        runFile(path);
     }
     freeVM();
     return 0;
@@ -7,9 +7,31 @@
 #include "../include/value.h"
 #include "../include/vm.h"
 
+#ifdef PIPELINE
+#include <pthread.h>
+#endif
+
 #define ALLOCATE_OBJ(type, objectType) \
 		(type*)allocateObject(sizeof(type), objectType)
 
+// While the compiler runs on its own thread, it interns strings while
+// run() concatenates them, so the string table and the object list are
+// taken under a lock.
+#ifdef PIPELINE
+static pthread_mutex_t stringLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void lockStrings() {
+	if (vm.pipelining) pthread_mutex_lock(&stringLock);
+}
+
+static void unlockStrings() {
+	if (vm.pipelining) pthread_mutex_unlock(&stringLock);
+}
+#else
+static void lockStrings() {}
+static void unlockStrings() {}
+#endif
+
 
 static Obj* allocateObject(size_t size, ObjType type) {
 	Obj* object = (Obj*)reallocate(NULL, 0, size);
@@ -40,22 +62,38 @@ static uint32_t hashString(const char* key, int length) {
 
 ObjString* takeString(char* chars, int length) {
 	uint32_t hash = hashString(chars, length);
-	ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
-	if (interned != NULL) {
+	lockStrings();
+	ObjString* string = tableFindString(&vm.strings, chars, length, hash);
+	if (string != NULL) {
 		FREE_ARRAY(char, chars, length + 1);
-		return interned;
+	} else {
+		string = allocateString(chars, length, hash);
 	}
-	return allocateString(chars, length, hash);
+	unlockStrings();
+	return string;
 }
 
 ObjString* copyString(const char* chars, int length) {
 	uint32_t hash = hashString(chars, length);
-	ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
-	if (interned != NULL) return interned;
-	char* heapChars = ALLOCATE(char, length + 1);
-	memcpy(heapChars, chars, length);
-	heapChars[length] = '\0';
-	return allocateString(heapChars, length, hash);
+	lockStrings();
+	ObjString* string = tableFindString(&vm.strings, chars, length, hash);
+	if (string == NULL) {
+		char* heapChars = ALLOCATE(char, length + 1);
+		memcpy(heapChars, chars, length);
+		heapChars[length] = '\0';
+		string = allocateString(heapChars, length, hash);
+	}
+	unlockStrings();
+	return string;
+}
+
+ObjString* concatenateStrings(ObjString* a, ObjString* b) {
+	int length = a->length + b->length;
+	char* chars = ALLOCATE(char, length + 1);
+	memcpy(chars, a->chars, a->length);
+	memcpy(chars + a->length, b->chars, b->length);
+	chars[length] = '\0';
+	return takeString(chars, length);
 }
 
 void printObject(Value value) {
@@ -0,0 +1,1343 @@
+#include <stdlib.h>
+
+#include "../include/ir.h"
+#include "../include/memory.h"
+#include "../include/object.h"
+#include "../include/optimizer.h"
+#include "../include/vm.h"
+
+// Places are what a store can write: the stack slots, then the globals
+// starting at ir->slotCount.
+static int placeCount(IR* ir) {
+    return ir->slotCount + vm.globalIdentifiers.count;
+}
+
+// Nodes that pop the stack or store somewhere, which no pass may drop.
+static bool hasEffect(IRNode* node) {
+    return node->kind == NODE_STACK || node->kind == NODE_SET_LOCAL ||
+        node->kind == NODE_SET_GLOBAL;
+}
+
+static bool isCountedLoop(uint8_t opcode) {
+    switch (opcode) {
+        case OP_INCREMENT_LOOP_IF_LESS:
+        case OP_INCREMENT_LOOP_IF_LESS_EQUAL:
+        case OP_INCREMENT_LOOP_IF_GREATER:
+        case OP_INCREMENT_LOOP_IF_GREATER_EQUAL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Evaluates an operator on constant operands the way run() would. Anything
+// run() reports an error for is left to run().
+static bool fold(uint8_t opcode, Value a, Value b, Value* result) {
+    double x, y;
+    switch (opcode) {
+        case OP_NOT:
+            *result = BOOL_VAL(isFalsey(a));
+            return true;
+        case OP_NEGATE:
+            if (!IS_NUMBER(a)) return false;
+            *result = negateNumber(a);
+            return true;
+        case OP_EQUAL:
+            *result = BOOL_VAL(valuesEqual(a, b));
+            return true;
+        case OP_ADD:
+            if (IS_STRING(a) && IS_STRING(b)) {
+                *result = OBJ_VAL(concatenateStrings(AS_STRING(a),
+                                                     AS_STRING(b)));
+                return true;
+            }
+            return addNumbers(a, b, result);
+        case OP_SUBTRACT: return subtractNumbers(a, b, result);
+        case OP_MULTIPLY: return multiplyNumbers(a, b, result);
+        case OP_DIVIDE: return divideNumbers(a, b, result);
+        case OP_GREATER:
+            if (!toDoubles(a, b, &x, &y)) return false;
+            *result = BOOL_VAL(x > y);
+            return true;
+        case OP_LESS:
+            if (!toDoubles(a, b, &x, &y)) return false;
+            *result = BOOL_VAL(x < y);
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Copy propagation. A forward dataflow over the blocks finds, for every
+// place, whether it holds a known constant or a copy of a stack slot.
+// Reads are then rewritten to the constant or to the slot copied from,
+// and operators whose operands all became constants are folded.
+
+typedef enum {
+    FACT_NONE,          // no path seen yet
+    FACT_CONSTANT,      // value
+    FACT_COPY,          // the value in stack slot
+    FACT_UNKNOWN,
+} FactKind;
+
+typedef struct {
+    FactKind kind;
+    int slot;
+    Value value;
+} Fact;
+
+// Facts for every place at every block cost memory, so very big chunks
+// are not propagated through.
+#define MAX_FACTS (1 << 20)
+// hoistInvariants() types the whole chunk again for every loop, so it
+// gives up on the rest of a chunk with many loops and many places once
+// it has found this many.
+#define MAX_HOIST_FACTS (1 << 24)
+
+typedef struct {
+    IR* ir;
+    Fact* facts;
+    bool rewrite;
+    bool changed;
+} Propagation;
+
+static Fact makeFact(FactKind kind, int slot, Value value) {
+    Fact fact;
+    fact.kind = kind;
+    fact.slot = slot;
+    fact.value = value;
+    return fact;
+}
+
+static Fact unknownFact() {
+    return makeFact(FACT_UNKNOWN, -1, NIL_VAL);
+}
+
+static bool sameFact(Fact a, Fact b) {
+    if (a.kind != b.kind) return false;
+    switch (a.kind) {
+        case FACT_CONSTANT: return valuesIdentical(a.value, b.value);
+        case FACT_COPY: return a.slot == b.slot;
+        default: return true;
+    }
+}
+
+// The value in slot changes, so its copies are no longer copies.
+static void killCopies(Propagation* propagation, int slot) {
+    for (int i = 0; i < propagation->ir->slotCount; i++) {
+        Fact* fact = &propagation->facts[i];
+        if (fact->kind == FACT_COPY && fact->slot == slot) {
+            *fact = unknownFact();
+        }
+    }
+}
+
+static void setSlotFact(Propagation* propagation, int slot, Fact fact) {
+    killCopies(propagation, slot);
+    propagation->facts[slot] = fact;
+}
+
+static void replaceWithConstant(Propagation* propagation, IRNode* node,
+                                Value value) {
+    if (!propagation->rewrite) return;
+    node->kind = NODE_CONSTANT;
+    node->value = value;
+    node->operands[0] = -1;
+    node->operands[1] = -1;
+    propagation->changed = true;
+}
+
+// Whether the operand is, or is about to be rewritten to, a constant.
+static bool foldable(Propagation* propagation, int operand, Fact fact) {
+    return fact.kind == FACT_CONSTANT &&
+        !hasEffect(&propagation->ir->nodes[operand]);
+}
+
+static Fact propagateNode(Propagation* propagation, int index) {
+    IR* ir = propagation->ir;
+    IRNode* node = &ir->nodes[index];
+    switch (node->kind) {
+        case NODE_CONSTANT:
+            return makeFact(FACT_CONSTANT, -1, node->value);
+        case NODE_STACK:
+            setSlotFact(propagation, node->slot, unknownFact());
+            return unknownFact();
+        case NODE_LOCAL: {
+            Fact fact = propagation->facts[node->slot];
+            if (fact.kind == FACT_CONSTANT) {
+                replaceWithConstant(propagation, node, fact.value);
+                return fact;
+            }
+            if (fact.kind == FACT_COPY) {
+                if (propagation->rewrite) {
+                    node->slot = fact.slot;
+                    propagation->changed = true;
+                }
+                return fact;
+            }
+            return makeFact(FACT_COPY, node->slot, NIL_VAL);
+        }
+        case NODE_GLOBAL: {
+            Fact fact = propagation->facts[ir->slotCount + node->slot];
+            if (fact.kind != FACT_CONSTANT) return unknownFact();
+            // Only a global that has been defined holds a constant.
+            replaceWithConstant(propagation, node, fact.value);
+            return fact;
+        }
+        case NODE_UNARY:
+        case NODE_BINARY: {
+            Fact a = propagateNode(propagation, node->operands[0]);
+            Fact b = a;
+            if (node->kind == NODE_BINARY) {
+                b = propagateNode(propagation, node->operands[1]);
+            }
+            Value result;
+            if (foldable(propagation, node->operands[0], a) &&
+                    (node->kind == NODE_UNARY ||
+                     foldable(propagation, node->operands[1], b)) &&
+                    fold(node->opcode, a.value, b.value, &result)) {
+                replaceWithConstant(propagation, node, result);
+                return makeFact(FACT_CONSTANT, -1, result);
+            }
+            return unknownFact();
+        }
+        case NODE_SET_LOCAL: {
+            Fact value = propagateNode(propagation, node->operands[0]);
+            // Storing a slot into itself changes nothing.
+            if (value.kind != FACT_COPY || value.slot != node->slot) {
+                setSlotFact(propagation, node->slot, value);
+            }
+            return value;
+        }
+        case NODE_SET_GLOBAL: {
+            Fact value = propagateNode(propagation, node->operands[0]);
+            propagation->facts[ir->slotCount + node->slot] =
+                value.kind == FACT_CONSTANT ? value : unknownFact();
+            return value;
+        }
+    }
+    return unknownFact();
+}
+
+// A counted loop bound by a place holding a constant gets the constant
+// instead. The counter changes.
+static void propagateExit(Propagation* propagation, IRBlock* block) {
+    if (!block->hasExit || !isCountedLoop(block->exit.opcode)) return;
+    IR* ir = propagation->ir;
+    Instruction* exit = &block->exit;
+    int kinds = exit->operands[0];
+    int counter = exit->operands[1];
+    int bound = exit->operands[3];
+
+    Fact fact = unknownFact();
+    if (LOOP_BOUND_KIND(kinds) == LOOP_LOCAL) {
+        fact = propagation->facts[bound];
+    } else if (LOOP_BOUND_KIND(kinds) == LOOP_GLOBAL) {
+        fact = propagation->facts[ir->slotCount + bound];
+    }
+    if (propagation->rewrite && fact.kind == FACT_CONSTANT &&
+            IS_NUMBER(fact.value)) {
+        exit->operands[0] = LOOP_KINDS(LOOP_COUNTER_KIND(kinds),
+                                       LOOP_CONSTANT) |
+            (kinds & LOOP_SUBTRACT);
+        exit->operands[3] = addConstant(ir->chunk, fact.value);
+        propagation->changed = true;
+    }
+
+    if (LOOP_COUNTER_KIND(kinds) == LOOP_LOCAL) {
+        setSlotFact(propagation, counter, unknownFact());
+    } else {
+        propagation->facts[ir->slotCount + counter] = unknownFact();
+    }
+}
+
+static void propagateBlock(Propagation* propagation, int index) {
+    IR* ir = propagation->ir;
+    IRBlock* block = &ir->blocks[index];
+    for (int i = 0; i < block->count; i++) {
+        IRStatement* statement = &block->statements[i];
+        if (statement->removed) continue;
+        Fact value = propagateNode(propagation, statement->node);
+        if (statement->kind == STATEMENT_PUSH) {
+            setSlotFact(propagation, statement->slot, value);
+        } else if (statement->kind == STATEMENT_DEFINE_GLOBAL) {
+            propagation->facts[ir->slotCount + statement->slot] =
+                value.kind == FACT_CONSTANT ? value : unknownFact();
+        }
+    }
+    propagateExit(propagation, block);
+}
+
+// Starts a block from the facts on entry. Slots above its depth hold
+// nothing yet.
+static void enterBlock(Propagation* propagation, Fact* entry, int depth) {
+    IR* ir = propagation->ir;
+    for (int i = 0; i < placeCount(ir); i++) {
+        Fact fact = entry[i];
+        bool gone = fact.kind == FACT_NONE ||
+            (i < ir->slotCount && i >= depth) ||
+            (fact.kind == FACT_COPY && fact.slot >= depth);
+        propagation->facts[i] = gone ? unknownFact() : fact;
+    }
+}
+
+// Merges facts into entry, returning whether entry changed.
+static bool mergeFacts(Fact* entry, Fact* facts, int count) {
+    bool changed = false;
+    for (int i = 0; i < count; i++) {
+        if (facts[i].kind == FACT_NONE || entry[i].kind == FACT_UNKNOWN ||
+                sameFact(entry[i], facts[i])) {
+            continue;
+        }
+        entry[i] = entry[i].kind == FACT_NONE ? facts[i] : unknownFact();
+        changed = true;
+    }
+    return changed;
+}
+
+static bool propagateCopies(IR* ir) {
+    int places = placeCount(ir);
+    if ((long) places * ir->blockCount > MAX_FACTS) return false;
+    Fact* entries = ALLOCATE(Fact, places * ir->blockCount);
+    bool* reached = ALLOCATE(bool, ir->blockCount);
+    for (int i = 0; i < places * ir->blockCount; i++) {
+        entries[i] = makeFact(FACT_NONE, -1, NIL_VAL);
+    }
+    for (int i = 0; i < ir->blockCount; i++) reached[i] = false;
+    // Nothing is known about the globals earlier REPL lines left.
+    for (int i = 0; i < places; i++) entries[i] = unknownFact();
+    reached[0] = true;
+
+    Propagation propagation;
+    propagation.ir = ir;
+    propagation.facts = ALLOCATE(Fact, places);
+    propagation.rewrite = false;
+    propagation.changed = false;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = 0; i < ir->blockCount; i++) {
+            if (!reached[i]) continue;
+            enterBlock(&propagation, &entries[i * places],
+                       ir->blocks[i].depth);
+            propagateBlock(&propagation, i);
+            int successors[2];
+            int count = blockSuccessors(ir, i, successors);
+            for (int j = 0; j < count; j++) {
+                int successor = successors[j];
+                if (mergeFacts(&entries[successor * places],
+                               propagation.facts, places) ||
+                        !reached[successor]) {
+                    changed = true;
+                }
+                reached[successor] = true;
+            }
+        }
+    }
+
+    propagation.rewrite = true;
+    for (int i = 0; i < ir->blockCount; i++) {
+        if (!reached[i]) continue;
+        enterBlock(&propagation, &entries[i * places], ir->blocks[i].depth);
+        propagateBlock(&propagation, i);
+    }
+
+    FREE_ARRAY(Fact, propagation.facts, places);
+    FREE_ARRAY(Fact, entries, places * ir->blockCount);
+    FREE_ARRAY(bool, reached, ir->blockCount);
+    return propagation.changed;
+}
+
+// Common-subexpression elimination by value numbering within a block.
+// Equal value numbers stand for equal values. A place remembers the
+// number of what it holds, so an operator whose value some place still
+// holds is replaced by a read of that place. Only trees without effects
+// are replaced, and the first evaluation already succeeded, so nothing
+// can fail differently.
+
+typedef struct {
+    uint8_t opcode;     // OP_CONSTANT for a constant in value
+    int a;
+    int b;
+    Value value;
+    int number;
+    int block;          // the entry is free unless this is the current one
+} Expression;
+
+typedef struct {
+    IR* ir;
+    int block;
+    int* placeNumbers;
+    int* placeBlocks;   // placeNumbers[i] is valid in this block only
+    int* holders;       // per number, the place that last got it
+    int nextNumber;
+    Expression* expressions;
+    int expressionCapacity;
+    bool changed;
+} Numbering;
+
+static int newNumber(Numbering* numbering) {
+    numbering->holders[numbering->nextNumber] = -1;
+    return numbering->nextNumber++;
+}
+
+static void setPlace(Numbering* numbering, int place, int number) {
+    numbering->placeNumbers[place] = number;
+    numbering->placeBlocks[place] = numbering->block;
+    numbering->holders[number] = place;
+}
+
+static bool holds(Numbering* numbering, int place, int number) {
+    return numbering->placeBlocks[place] == numbering->block &&
+        numbering->placeNumbers[place] == number;
+}
+
+static int placeNumber(Numbering* numbering, int place) {
+    if (numbering->placeBlocks[place] != numbering->block) {
+        setPlace(numbering, place, newNumber(numbering));
+    }
+    return numbering->placeNumbers[place];
+}
+
+static uint32_t hashExpression(uint8_t opcode, int a, int b, Value value) {
+    if (opcode == OP_CONSTANT) return hashValue(value);
+    uint32_t hash = (uint32_t) opcode * 0x9e3779b1u;
+    hash = (hash ^ (uint32_t) a) * 0x85ebca6bu;
+    hash = (hash ^ (uint32_t) b) * 0xc2b2ae35u;
+    return hash ^ (hash >> 16);
+}
+
+// The number of the expression, given one if it is new.
+static int expressionNumber(Numbering* numbering, uint8_t opcode, int a,
+                            int b, Value value) {
+    int mask = numbering->expressionCapacity - 1;
+    int index = hashExpression(opcode, a, b, value) & mask;
+    for (;;) {
+        Expression* expression = &numbering->expressions[index];
+        if (expression->block != numbering->block) {
+            expression->opcode = opcode;
+            expression->a = a;
+            expression->b = b;
+            expression->value = value;
+            expression->number = newNumber(numbering);
+            expression->block = numbering->block;
+            return expression->number;
+        }
+        if (expression->opcode == opcode && expression->a == a &&
+                expression->b == b && (opcode != OP_CONSTANT ||
+                                       valuesIdentical(expression->value,
+                                                       value))) {
+            return expression->number;
+        }
+        index = (index + 1) & mask;
+    }
+}
+
+static int numberNode(Numbering* numbering, int index, bool* pure) {
+    IR* ir = numbering->ir;
+    IRNode* node = &ir->nodes[index];
+    *pure = !hasEffect(node);
+    switch (node->kind) {
+        case NODE_CONSTANT:
+            return expressionNumber(numbering, OP_CONSTANT, 0, 0,
+                                    node->value);
+        case NODE_STACK: {
+            int number = placeNumber(numbering, node->slot);
+            numbering->placeBlocks[node->slot] = -1;
+            return number;
+        }
+        case NODE_LOCAL:
+            return placeNumber(numbering, node->slot);
+        case NODE_GLOBAL:
+            return placeNumber(numbering, ir->slotCount + node->slot);
+        case NODE_UNARY:
+        case NODE_BINARY: {
+            bool pureOperand = true;
+            int a = numberNode(numbering, node->operands[0], &pureOperand);
+            *pure = *pure && pureOperand;
+            int b = -1;
+            if (node->kind == NODE_BINARY) {
+                b = numberNode(numbering, node->operands[1], &pureOperand);
+                *pure = *pure && pureOperand;
+            }
+            if ((node->opcode == OP_EQUAL || node->opcode == OP_MULTIPLY) &&
+                    a > b) {
+                int swap = a;
+                a = b;
+                b = swap;
+            }
+            int number = expressionNumber(numbering, node->opcode, a, b,
+                                          NIL_VAL);
+            int holder = numbering->holders[number];
+            if (*pure && holder != -1 && holds(numbering, holder, number)) {
+                bool global = holder >= ir->slotCount;
+                node->kind = global ? NODE_GLOBAL : NODE_LOCAL;
+                node->slot = global ? holder - ir->slotCount : holder;
+                node->operands[0] = -1;
+                node->operands[1] = -1;
+                numbering->changed = true;
+            }
+            return number;
+        }
+        case NODE_SET_LOCAL:
+        case NODE_SET_GLOBAL: {
+            bool pureOperand;
+            int number = numberNode(numbering, node->operands[0],
+                                    &pureOperand);
+            int place = node->slot;
+            if (node->kind == NODE_SET_GLOBAL) place += ir->slotCount;
+            setPlace(numbering, place, number);
+            return number;
+        }
+    }
+    return newNumber(numbering);
+}
+
+static void numberBlock(Numbering* numbering, int index) {
+    IR* ir = numbering->ir;
+    IRBlock* block = &ir->blocks[index];
+    numbering->block = index;
+    for (int i = 0; i < block->count; i++) {
+        IRStatement* statement = &block->statements[i];
+        if (statement->removed) continue;
+        bool pure;
+        int number = numberNode(numbering, statement->node, &pure);
+        if (statement->kind == STATEMENT_PUSH) {
+            setPlace(numbering, statement->slot, number);
+        } else if (statement->kind == STATEMENT_DEFINE_GLOBAL) {
+            setPlace(numbering, ir->slotCount + statement->slot, number);
+        }
+    }
+}
+
+static bool eliminateCommonSubexpressions(IR* ir) {
+    int places = placeCount(ir);
+    Numbering numbering;
+    numbering.ir = ir;
+    numbering.placeNumbers = ALLOCATE(int, places);
+    numbering.placeBlocks = ALLOCATE(int, places);
+    for (int i = 0; i < places; i++) numbering.placeBlocks[i] = -1;
+    // Every node and every place read gets at most one new number.
+    int numbers = ir->nodeCount + 1;
+    numbering.holders = ALLOCATE(int, numbers);
+    numbering.nextNumber = 0;
+    numbering.expressionCapacity = 8;
+    while (numbering.expressionCapacity < numbers * 2) {
+        numbering.expressionCapacity *= 2;
+    }
+    numbering.expressions = ALLOCATE(Expression,
+                                     numbering.expressionCapacity);
+    for (int i = 0; i < numbering.expressionCapacity; i++) {
+        numbering.expressions[i].block = -1;
+    }
+    numbering.changed = false;
+
+    for (int i = 0; i < ir->blockCount; i++) {
+        numberBlock(&numbering, i);
+    }
+
+    FREE_ARRAY(int, numbering.placeNumbers, places);
+    FREE_ARRAY(int, numbering.placeBlocks, places);
+    FREE_ARRAY(int, numbering.holders, numbers);
+    FREE_ARRAY(Expression, numbering.expressions,
+               numbering.expressionCapacity);
+    return numbering.changed;
+}
+
+// Dead-store elimination. A backward liveness analysis over the stack
+// slots finds stores to a slot that nothing reads before it is written
+// again or popped. The store is dropped and its value kept, and an
+// expression statement left without effects is removed entirely.
+// Globals stay: a store to one that is not defined yet is an error.
+
+typedef struct {
+    IR* ir;
+    bool* live;
+    bool rewrite;
+    bool changed;
+} Liveness;
+
+// Whether evaluating the node can neither fail nor change anything.
+static bool isPure(IR* ir, int index) {
+    IRNode* node = &ir->nodes[index];
+    switch (node->kind) {
+        case NODE_CONSTANT:
+        case NODE_LOCAL:
+            return true;
+        case NODE_UNARY:
+            return node->opcode == OP_NOT && isPure(ir, node->operands[0]);
+        case NODE_BINARY:
+            return node->opcode == OP_EQUAL &&
+                isPure(ir, node->operands[0]) &&
+                isPure(ir, node->operands[1]);
+        default:
+            return false;
+    }
+}
+
+// Walks the node backward, from its last effect to its first.
+static void liveNode(Liveness* liveness, int index) {
+    IR* ir = liveness->ir;
+    IRNode* node = &ir->nodes[index];
+    switch (node->kind) {
+        case NODE_CONSTANT:
+        case NODE_GLOBAL:
+            break;
+        case NODE_STACK:
+        case NODE_LOCAL:
+            liveness->live[node->slot] = true;
+            break;
+        case NODE_UNARY:
+            liveNode(liveness, node->operands[0]);
+            break;
+        case NODE_BINARY:
+            liveNode(liveness, node->operands[1]);
+            liveNode(liveness, node->operands[0]);
+            break;
+        case NODE_SET_LOCAL:
+            if (!liveness->live[node->slot] && liveness->rewrite) {
+                *node = ir->nodes[node->operands[0]];
+                liveness->changed = true;
+                liveNode(liveness, index);
+                break;
+            }
+            liveness->live[node->slot] = false;
+            liveNode(liveness, node->operands[0]);
+            break;
+        case NODE_SET_GLOBAL:
+            liveNode(liveness, node->operands[0]);
+            break;
+    }
+}
+
+static void liveExit(Liveness* liveness, int index) {
+    IR* ir = liveness->ir;
+    IRBlock* block = &ir->blocks[index];
+    if (!block->hasExit) return;
+    Instruction* exit = &block->exit;
+    if (exit->opcode == OP_JUMP_IF_FALSE) {
+        liveness->live[exitDepth(ir, index) - 1] = true;
+    } else if (isCountedLoop(exit->opcode)) {
+        int kinds = exit->operands[0];
+        if (LOOP_COUNTER_KIND(kinds) == LOOP_LOCAL) {
+            liveness->live[exit->operands[1]] = true;
+        }
+        if (LOOP_BOUND_KIND(kinds) == LOOP_LOCAL) {
+            liveness->live[exit->operands[3]] = true;
+        }
+    }
+}
+
+static void liveBlock(Liveness* liveness, int index) {
+    IR* ir = liveness->ir;
+    IRBlock* block = &ir->blocks[index];
+    liveExit(liveness, index);
+    for (int i = block->count - 1; i >= 0; i--) {
+        IRStatement* statement = &block->statements[i];
+        if (statement->removed) continue;
+        IRNode* node = &ir->nodes[statement->node];
+        if (statement->kind == STATEMENT_EVAL && node->kind == NODE_STACK) {
+            // A plain pop; the value dies here.
+            liveness->live[node->slot] = false;
+            continue;
+        }
+        if (statement->kind == STATEMENT_PUSH) {
+            liveness->live[statement->slot] = false;
+        }
+        liveNode(liveness, statement->node);
+        if (liveness->rewrite && statement->kind == STATEMENT_EVAL &&
+                isPure(ir, statement->node)) {
+            statement->removed = true;
+            liveness->changed = true;
+        }
+    }
+}
+
+// Slots live on entry to each block's successors.
+static void liveOut(Liveness* liveness, bool* entries, int index) {
+    IR* ir = liveness->ir;
+    for (int i = 0; i < ir->slotCount; i++) liveness->live[i] = false;
+    int successors[2];
+    int count = blockSuccessors(ir, index, successors);
+    for (int i = 0; i < count; i++) {
+        bool* entry = &entries[successors[i] * ir->slotCount];
+        for (int j = 0; j < ir->slotCount; j++) {
+            liveness->live[j] = liveness->live[j] || entry[j];
+        }
+    }
+}
+
+static bool eliminateDeadStores(IR* ir) {
+    int slots = ir->slotCount;
+    if (slots == 0) return false;
+    bool* entries = ALLOCATE(bool, slots * ir->blockCount);
+    for (int i = 0; i < slots * ir->blockCount; i++) entries[i] = false;
+    Liveness liveness;
+    liveness.ir = ir;
+    liveness.live = ALLOCATE(bool, slots);
+    liveness.rewrite = false;
+    liveness.changed = false;
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = ir->blockCount - 1; i >= 0; i--) {
+            liveOut(&liveness, entries, i);
+            liveBlock(&liveness, i);
+            bool* entry = &entries[i * slots];
+            for (int j = 0; j < slots; j++) {
+                if (entry[j] != liveness.live[j]) {
+                    entry[j] = liveness.live[j];
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    liveness.rewrite = true;
+    for (int i = 0; i < ir->blockCount; i++) {
+        liveOut(&liveness, entries, i);
+        liveBlock(&liveness, i);
+    }
+
+    FREE_ARRAY(bool, liveness.live, slots);
+    FREE_ARRAY(bool, entries, slots * ir->blockCount);
+    return liveness.changed;
+}
+
+// Type inference. A forward dataflow over the blocks finds the type of
+// what every place holds, and the globals defined on every path, on entry
+// to each block. Arithmetic whose operands are then proven numbers gets
+// an unchecked opcode that skips the type checks in run().
+
+typedef enum {
+    TYPE_NONE,          // nothing stored yet
+    TYPE_NUMBER,
+    TYPE_STRING,
+    TYPE_BOOL,
+    TYPE_NIL,
+    TYPE_ANY,
+} KnownType;
+
+typedef struct {
+    IR* ir;
+    // Per place, the type of what it holds, and per global whether it is
+    // defined, on entry to each block and while walking one.
+    KnownType* typeEntries;
+    bool* definedEntries;
+    KnownType* types;
+    bool* defined;
+    bool rewrite;       // give proven arithmetic its unchecked opcode
+    bool changed;
+} Typing;
+
+static KnownType valueType(Value value) {
+    if (IS_NUMBER(value)) return TYPE_NUMBER;
+    if (IS_STRING(value)) return TYPE_STRING;
+    if (IS_BOOL(value)) return TYPE_BOOL;
+    if (IS_NIL(value)) return TYPE_NIL;
+    return TYPE_ANY;
+}
+
+static KnownType joinTypes(KnownType a, KnownType b) {
+    if (a == TYPE_NONE) return b;
+    if (b == TYPE_NONE || a == b) return a;
+    return TYPE_ANY;
+}
+
+// The type an operator gives if it succeeds.
+static KnownType operatorType(uint8_t opcode, KnownType a, KnownType b) {
+    switch (opcode) {
+        case OP_NOT:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+            return TYPE_BOOL;
+        case OP_ADD:
+            if (a == b && (a == TYPE_NUMBER || a == TYPE_STRING)) return a;
+            return TYPE_ANY;
+        default:
+            return TYPE_NUMBER;
+    }
+}
+
+// The form of an arithmetic opcode that skips the checks, or opcode
+// itself.
+static uint8_t uncheckedForm(uint8_t opcode) {
+    switch (opcode) {
+        case OP_ADD: return OP_ADD_UNCHECKED;
+        case OP_SUBTRACT: return OP_SUBTRACT_UNCHECKED;
+        case OP_MULTIPLY: return OP_MULTIPLY_UNCHECKED;
+        case OP_DIVIDE: return OP_DIVIDE_UNCHECKED;
+        case OP_NEGATE: return OP_NEGATE_UNCHECKED;
+        default: return opcode;
+    }
+}
+
+static void specialize(Typing* typing, IRNode* node, KnownType a,
+                       KnownType b) {
+    if (!typing->rewrite || a != TYPE_NUMBER || b != TYPE_NUMBER) return;
+    uint8_t opcode = uncheckedForm(node->opcode);
+    if (opcode == node->opcode) return;
+    node->opcode = opcode;
+    typing->changed = true;
+}
+
+// Walks the node, storing the types it stores. A global read or stored to
+// without an error is defined from then on.
+static KnownType typeNode(Typing* typing, int index) {
+    IR* ir = typing->ir;
+    IRNode* node = &ir->nodes[index];
+    switch (node->kind) {
+        case NODE_CONSTANT:
+            return valueType(node->value);
+        case NODE_STACK:
+        case NODE_LOCAL:
+            return typing->types[node->slot];
+        case NODE_GLOBAL:
+            typing->defined[node->slot] = true;
+            return typing->types[ir->slotCount + node->slot];
+        case NODE_UNARY: {
+            KnownType a = typeNode(typing, node->operands[0]);
+            specialize(typing, node, a, a);
+            return operatorType(node->opcode, a, TYPE_NONE);
+        }
+        case NODE_BINARY: {
+            KnownType a = typeNode(typing, node->operands[0]);
+            KnownType b = typeNode(typing, node->operands[1]);
+            specialize(typing, node, a, b);
+            return operatorType(node->opcode, a, b);
+        }
+        case NODE_SET_LOCAL: {
+            KnownType type = typeNode(typing, node->operands[0]);
+            typing->types[node->slot] = type;
+            return type;
+        }
+        case NODE_SET_GLOBAL: {
+            KnownType type = typeNode(typing, node->operands[0]);
+            typing->types[ir->slotCount + node->slot] = type;
+            typing->defined[node->slot] = true;
+            return type;
+        }
+    }
+    return TYPE_ANY;
+}
+
+static void typeBlock(Typing* typing, int index) {
+    IR* ir = typing->ir;
+    IRBlock* block = &ir->blocks[index];
+    for (int i = 0; i < block->count; i++) {
+        IRStatement* statement = &block->statements[i];
+        if (statement->removed) continue;
+        KnownType type = typeNode(typing, statement->node);
+        if (statement->kind == STATEMENT_PUSH) {
+            typing->types[statement->slot] = type;
+        } else if (statement->kind == STATEMENT_DEFINE_GLOBAL) {
+            typing->types[ir->slotCount + statement->slot] = type;
+            typing->defined[statement->slot] = true;
+        }
+    }
+    if (!block->hasExit || !isCountedLoop(block->exit.opcode)) return;
+    int kinds = block->exit.operands[0];
+    int counter = block->exit.operands[1];
+    int bound = block->exit.operands[3];
+    if (LOOP_COUNTER_KIND(kinds) == LOOP_LOCAL) {
+        typing->types[counter] = TYPE_NUMBER;
+    } else {
+        typing->types[ir->slotCount + counter] = TYPE_NUMBER;
+        typing->defined[counter] = true;
+    }
+    if (LOOP_BOUND_KIND(kinds) == LOOP_GLOBAL) typing->defined[bound] = true;
+}
+
+// Merges the walked block's facts into the entry of successor, returning
+// whether the entry changed.
+static bool mergeTypes(Typing* typing, int successor, bool first) {
+    IR* ir = typing->ir;
+    int places = placeCount(ir);
+    int globals = vm.globalIdentifiers.count;
+    KnownType* types = &typing->typeEntries[successor * places];
+    bool* defined = &typing->definedEntries[successor * globals];
+    int depth = ir->blocks[successor].depth;
+    bool changed = first;
+    for (int i = 0; i < places; i++) {
+        KnownType type = typing->types[i];
+        if (i < ir->slotCount && i >= depth) type = TYPE_NONE;
+        if (!first) type = joinTypes(types[i], type);
+        if (type != types[i]) changed = true;
+        types[i] = type;
+    }
+    for (int i = 0; i < globals; i++) {
+        bool known = typing->defined[i] && (first || defined[i]);
+        if (known != defined[i]) changed = true;
+        defined[i] = known;
+    }
+    return changed;
+}
+
+// Starts walking block from what holds on entry to it.
+static void enterTypes(Typing* typing, int block) {
+    int places = placeCount(typing->ir);
+    int globals = vm.globalIdentifiers.count;
+    for (int i = 0; i < places; i++) {
+        typing->types[i] = typing->typeEntries[block * places + i];
+    }
+    for (int i = 0; i < globals; i++) {
+        typing->defined[i] = typing->definedEntries[block * globals + i];
+    }
+}
+
+static void inferTypes(Typing* typing) {
+    IR* ir = typing->ir;
+    int places = placeCount(ir);
+    int globals = vm.globalIdentifiers.count;
+    bool* reached = ALLOCATE(bool, ir->blockCount);
+    for (int i = 0; i < ir->blockCount; i++) reached[i] = false;
+    for (int i = 0; i < places * ir->blockCount; i++) {
+        typing->typeEntries[i] = TYPE_NONE;
+    }
+    for (int i = 0; i < globals * ir->blockCount; i++) {
+        typing->definedEntries[i] = false;
+    }
+    // Earlier REPL lines may have left values in the globals. Pipelined,
+    // earlier segments are running and may store anything.
+    for (int i = 0; i < globals && vm.pipelining; i++) {
+        typing->typeEntries[ir->slotCount + i] = TYPE_ANY;
+    }
+    for (int i = 0; i < globals && !vm.pipelining; i++) {
+        Value value = vm.globalValues.values[i];
+        typing->definedEntries[i] = !IS_UNDEFINED(value);
+        if (!IS_UNDEFINED(value)) {
+            typing->typeEntries[ir->slotCount + i] = valueType(value);
+        }
+    }
+    reached[0] = true;
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = 0; i < ir->blockCount; i++) {
+            if (!reached[i]) continue;
+            enterTypes(typing, i);
+            typeBlock(typing, i);
+            int successors[2];
+            int count = blockSuccessors(ir, i, successors);
+            for (int j = 0; j < count; j++) {
+                if (mergeTypes(typing, successors[j],
+                               !reached[successors[j]])) {
+                    changed = true;
+                }
+                reached[successors[j]] = true;
+            }
+        }
+    }
+    FREE_ARRAY(bool, reached, ir->blockCount);
+}
+
+// Returns false, with nothing to free, if the chunk is too big to type.
+static bool initTyping(Typing* typing, IR* ir) {
+    int places = placeCount(ir);
+    int globals = vm.globalIdentifiers.count;
+    if ((long) places * ir->blockCount > MAX_FACTS) return false;
+    typing->ir = ir;
+    typing->typeEntries = ALLOCATE(KnownType, places * ir->blockCount);
+    typing->definedEntries = ALLOCATE(bool, globals * ir->blockCount);
+    typing->types = ALLOCATE(KnownType, places);
+    typing->defined = ALLOCATE(bool, globals);
+    typing->rewrite = false;
+    typing->changed = false;
+    inferTypes(typing);
+    return true;
+}
+
+// Frees typing for ir as it was when typed.
+static void freeTyping(Typing* typing, int places, int blocks) {
+    int globals = vm.globalIdentifiers.count;
+    FREE_ARRAY(KnownType, typing->typeEntries, places * blocks);
+    FREE_ARRAY(bool, typing->definedEntries, globals * blocks);
+    FREE_ARRAY(KnownType, typing->types, places);
+    FREE_ARRAY(bool, typing->defined, globals);
+}
+
+static bool specializeArithmetic(IR* ir) {
+    Typing typing;
+    if (!initTyping(&typing, ir)) return false;
+    typing.rewrite = true;
+    for (int i = 0; i < ir->blockCount; i++) {
+        enterTypes(&typing, i);
+        typeBlock(&typing, i);
+    }
+    freeTyping(&typing, placeCount(ir), ir->blockCount);
+    return typing.changed;
+}
+
+// Loop-invariant code motion. A while loop is the blocks from its header
+// to the OP_LOOP that jumps back to it. An operator whose operands nothing
+// in the loop writes computes the same value every iteration, so it is
+// evaluated once, into a hidden local pushed by a new block in front of
+// the header, and the loop reads the local instead. The hidden locals sit
+// below the loop's own slots, which move up to make room, and are popped
+// where the loop exits. Hoisted code runs even when the loop body would
+// not have, so it must not be able to fail: a global it reads is defined
+// on every path to the loop, and the operand types of each operator rule
+// out an error.
+
+// Hidden locals per loop, which the loop's slots move up by.
+#define MAX_HOISTED 32
+
+typedef struct {
+    IR* ir;
+    Typing typing;
+    bool* written;      // per place, stored to inside the loop
+    int depth;          // stack depth at the loop header
+    int hoisted[MAX_HOISTED];   // the tree each hidden local holds
+    int count;
+    bool changed;
+} Hoisting;
+
+static void markWritten(Hoisting* hoisting, int index) {
+    IR* ir = hoisting->ir;
+    IRNode* node = &ir->nodes[index];
+    for (int i = 0; i < 2; i++) {
+        if (node->operands[i] != -1) markWritten(hoisting, node->operands[i]);
+    }
+    if (node->kind == NODE_SET_LOCAL) {
+        hoisting->written[node->slot] = true;
+    } else if (node->kind == NODE_SET_GLOBAL) {
+        hoisting->written[ir->slotCount + node->slot] = true;
+    }
+}
+
+static bool isInvariant(Hoisting* hoisting, int index) {
+    IR* ir = hoisting->ir;
+    IRNode* node = &ir->nodes[index];
+    switch (node->kind) {
+        case NODE_CONSTANT:
+            return true;
+        case NODE_LOCAL:
+            return node->slot < hoisting->depth &&
+                !hoisting->written[node->slot];
+        case NODE_GLOBAL:
+            return !hoisting->written[ir->slotCount + node->slot];
+        case NODE_UNARY:
+            return isInvariant(hoisting, node->operands[0]);
+        case NODE_BINARY:
+            return isInvariant(hoisting, node->operands[0]) &&
+                isInvariant(hoisting, node->operands[1]);
+        default:
+            return false;
+    }
+}
+
+// Whether the invariant tree can fail where the loop is entered, given
+// what holds on entry to its header.
+static bool canFail(Hoisting* hoisting, int index, KnownType* type) {
+    IR* ir = hoisting->ir;
+    IRNode* node = &ir->nodes[index];
+    KnownType a = TYPE_NONE;
+    KnownType b = TYPE_NONE;
+    switch (node->kind) {
+        case NODE_CONSTANT:
+            *type = valueType(node->value);
+            return false;
+        case NODE_LOCAL:
+            *type = hoisting->typing.types[node->slot];
+            return false;
+        case NODE_GLOBAL:
+            *type = hoisting->typing.types[ir->slotCount + node->slot];
+            return !hoisting->typing.defined[node->slot];
+        case NODE_UNARY:
+            if (canFail(hoisting, node->operands[0], &a)) return true;
+            *type = operatorType(node->opcode, a, b);
+            return node->opcode == OP_NEGATE && a != TYPE_NUMBER;
+        case NODE_BINARY:
+            if (canFail(hoisting, node->operands[0], &a) ||
+                    canFail(hoisting, node->operands[1], &b)) {
+                return true;
+            }
+            *type = operatorType(node->opcode, a, b);
+            if (node->opcode == OP_EQUAL) return false;
+            if (node->opcode == OP_ADD && *type == TYPE_STRING) return false;
+            return a != TYPE_NUMBER || b != TYPE_NUMBER;
+        default:
+            return true;
+    }
+}
+
+static bool sameTree(IR* ir, int a, int b) {
+    if (a == -1 || b == -1) return a == b;
+    IRNode* x = &ir->nodes[a];
+    IRNode* y = &ir->nodes[b];
+    if (x->kind != y->kind || x->opcode != y->opcode || x->slot != y->slot) {
+        return false;
+    }
+    if (x->kind == NODE_CONSTANT) return valuesIdentical(x->value, y->value);
+    return sameTree(ir, x->operands[0], y->operands[0]) &&
+        sameTree(ir, x->operands[1], y->operands[1]);
+}
+
+// Finds the biggest trees under index worth hoisting and gives each a
+// hidden local. Sites holds the node and local of every use.
+static void findInvariants(Hoisting* hoisting, int index, int* sites,
+                           int* siteCount) {
+    IR* ir = hoisting->ir;
+    IRNode* node = &ir->nodes[index];
+    bool worth = node->kind == NODE_GLOBAL || node->kind == NODE_UNARY ||
+        node->kind == NODE_BINARY;
+    KnownType type;
+    if (worth && isInvariant(hoisting, index) &&
+            !canFail(hoisting, index, &type)) {
+        int local = 0;
+        while (local < hoisting->count &&
+               !sameTree(ir, hoisting->hoisted[local], index)) {
+            local++;
+        }
+        if (local == hoisting->count) {
+            if (hoisting->count == MAX_HOISTED) return;
+            hoisting->hoisted[hoisting->count++] = index;
+        }
+        sites[*siteCount * 2] = index;
+        sites[*siteCount * 2 + 1] = local;
+        (*siteCount)++;
+        return;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (node->operands[i] != -1) {
+            findInvariants(hoisting, node->operands[i], sites, siteCount);
+        }
+    }
+}
+
+static void shiftNode(IR* ir, int index, int depth, int count) {
+    IRNode* node = &ir->nodes[index];
+    for (int i = 0; i < 2; i++) {
+        if (node->operands[i] != -1) {
+            shiftNode(ir, node->operands[i], depth, count);
+        }
+    }
+    bool local = node->kind == NODE_STACK || node->kind == NODE_LOCAL ||
+        node->kind == NODE_SET_LOCAL;
+    if (local && node->slot >= depth) node->slot += count;
+}
+
+// Moves the slots from depth up in the block by count.
+static void shiftBlock(IR* ir, int index, int depth, int count) {
+    IRBlock* block = &ir->blocks[index];
+    block->depth += count;
+    for (int i = 0; i < block->count; i++) {
+        IRStatement* statement = &block->statements[i];
+        shiftNode(ir, statement->node, depth, count);
+        if (statement->kind == STATEMENT_PUSH && statement->slot >= depth) {
+            statement->slot += count;
+        }
+    }
+    if (block->hasExit && isCountedLoop(block->exit.opcode)) {
+        int kinds = block->exit.operands[0];
+        int* counter = &block->exit.operands[1];
+        int* bound = &block->exit.operands[3];
+        if (LOOP_COUNTER_KIND(kinds) == LOOP_LOCAL && *counter >= depth) {
+            *counter += count;
+        }
+        if (LOOP_BOUND_KIND(kinds) == LOOP_LOCAL && *bound >= depth) {
+            *bound += count;
+        }
+    }
+}
+
+// Whether the loop has one way in, through the header, and one way out,
+// from the header's branch to the block after the latch, which starts by
+// popping the condition.
+static bool isSimpleLoop(IR* ir, int header, int latch) {
+    IRBlock* first = &ir->blocks[header];
+    int exit = latch + 1;
+    if (exit >= ir->blockCount || !first->hasExit ||
+            first->exit.opcode != OP_JUMP_IF_FALSE ||
+            first->exit.target != exit) {
+        return false;
+    }
+    IRBlock* last = &ir->blocks[exit];
+    if (last->depth != first->depth + 1 || last->count == 0) return false;
+    IRStatement* pop = &last->statements[0];
+    IRNode* popped = &ir->nodes[pop->node];
+    if (pop->removed || pop->kind != STATEMENT_EVAL ||
+            popped->kind != NODE_STACK) {
+        return false;
+    }
+    for (int i = 0; i < ir->blockCount; i++) {
+        bool inside = i >= header && i <= latch;
+        int successors[2];
+        int count = blockSuccessors(ir, i, successors);
+        for (int j = 0; j < count; j++) {
+            int successor = successors[j];
+            if (successor == exit && i != header) return false;
+            if (!inside && successor > header && successor <= latch) {
+                return false;
+            }
+            if (inside && successor != exit &&
+                    (successor < header || successor > latch)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void hoistLoop(Hoisting* hoisting, int header, int latch) {
+    IR* ir = hoisting->ir;
+    int places = placeCount(ir);
+    int depth = ir->blocks[header].depth;
+    if (!isSimpleLoop(ir, header, latch)) return;
+
+    for (int i = 0; i < places; i++) hoisting->written[i] = false;
+    for (int i = header; i <= latch; i++) {
+        IRBlock* block = &ir->blocks[i];
+        for (int j = 0; j < block->count; j++) {
+            IRStatement* statement = &block->statements[j];
+            markWritten(hoisting, statement->node);
+            if (statement->kind == STATEMENT_PUSH) {
+                hoisting->written[statement->slot] = true;
+            } else if (statement->kind == STATEMENT_DEFINE_GLOBAL) {
+                hoisting->written[ir->slotCount + statement->slot] = true;
+            }
+        }
+        if (block->hasExit && isCountedLoop(block->exit.opcode)) {
+            int counter = block->exit.operands[1];
+            if (LOOP_COUNTER_KIND(block->exit.operands[0]) != LOOP_LOCAL) {
+                counter += ir->slotCount;
+            }
+            hoisting->written[counter] = true;
+        }
+    }
+
+    int siteCapacity = ir->nodeCount;
+    int* sites = ALLOCATE(int, siteCapacity * 2);
+    int siteCount = 0;
+    // Nothing the trees read changes in the loop, so what holds on entry
+    // to the header holds wherever they are.
+    enterTypes(&hoisting->typing, header);
+    hoisting->depth = depth;
+    hoisting->count = 0;
+    for (int i = header; i <= latch; i++) {
+        IRBlock* block = &ir->blocks[i];
+        for (int j = 0; j < block->count; j++) {
+            if (block->statements[j].removed) continue;
+            findInvariants(hoisting, block->statements[j].node, sites,
+                           &siteCount);
+        }
+    }
+    int count = hoisting->count;
+    if (count == 0) {
+        FREE_ARRAY(int, sites, siteCapacity * 2);
+        return;
+    }
+
+    // The trees move to the new block, and their sites read the locals.
+    int trees[MAX_HOISTED];
+    for (int i = 0; i < count; i++) {
+        trees[i] = addNode(ir, NODE_CONSTANT, 0);
+        ir->nodes[trees[i]] = ir->nodes[hoisting->hoisted[i]];
+    }
+    int exit = latch + 1;
+    for (int i = header; i <= latch; i++) shiftBlock(ir, i, depth, count);
+    // After the loop only the condition's pop is still above the locals.
+    ir->blocks[exit].depth += count;
+    shiftNode(ir, ir->blocks[exit].statements[0].node, depth, count);
+    for (int i = 0; i < siteCount; i++) {
+        IRNode* node = &ir->nodes[sites[i * 2]];
+        node->kind = NODE_LOCAL;
+        node->slot = depth + sites[i * 2 + 1];
+        node->operands[0] = -1;
+        node->operands[1] = -1;
+    }
+    FREE_ARRAY(int, sites, siteCapacity * 2);
+
+    int line = ir->blocks[exit].statements[0].line;
+    for (int i = 0; i < count; i++) {
+        int pop = addNode(ir, NODE_STACK, line);
+        ir->nodes[pop].slot = depth + count - 1 - i;
+        insertStatement(ir, exit, 1 + i, STATEMENT_EVAL, pop, -1, line);
+    }
+
+    // Jumps from outside the loop to the header enter the new block.
+    insertBlock(ir, header, depth);
+    for (int i = 0; i < ir->blockCount; i++) {
+        IRBlock* block = &ir->blocks[i];
+        bool inside = i > header && i <= latch + 1;
+        if (!inside && block->hasExit && block->exit.target == header + 1) {
+            block->exit.target = header;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        IRNode* tree = &ir->nodes[trees[i]];
+        insertStatement(ir, header, i, STATEMENT_PUSH, trees[i], depth + i,
+                        tree->line);
+    }
+    ir->slotCount += count;
+    hoisting->changed = true;
+}
+
+static bool hoistInvariants(IR* ir) {
+    Hoisting hoisting;
+    hoisting.ir = ir;
+    hoisting.changed = false;
+    long facts = 0;
+
+    // From the last header back, so an inner loop is done before the one
+    // around it and hoisting never renumbers a block still to come.
+    for (int header = ir->blockCount - 1; header >= 0; header--) {
+        int latch = -1;
+        for (int i = header; i < ir->blockCount; i++) {
+            IRBlock* block = &ir->blocks[i];
+            if (block->hasExit && block->exit.opcode == OP_LOOP &&
+                    block->exit.target == header) {
+                latch = i;
+            }
+        }
+        if (latch == -1) continue;
+
+        // Hoisting moves slots and adds blocks, so the facts are found
+        // again for every loop.
+        int places = placeCount(ir);
+        int blocks = ir->blockCount;
+        facts += (long) places * blocks;
+        if (facts > MAX_HOIST_FACTS) break;
+        if (!initTyping(&hoisting.typing, ir)) break;
+        hoisting.written = ALLOCATE(bool, places);
+        hoistLoop(&hoisting, header, latch);
+        freeTyping(&hoisting.typing, places, blocks);
+        FREE_ARRAY(bool, hoisting.written, places);
+    }
+    return hoisting.changed;
+}
+
+// Each pass returns whether it changed anything. One can make work for
+// another, as when a propagated copy leaves a dead store behind, so the
+// list runs again until nothing changes.
+typedef bool (*Pass)(IR* ir);
+
+static const Pass passes[] = {
+    propagateCopies,
+    eliminateCommonSubexpressions,
+    hoistInvariants,
+    eliminateDeadStores,
+};
+
+#define MAX_ROUNDS 4
+
+void optimizeChunk(Chunk* chunk) {
+    IR ir;
+    if (!buildIR(chunk, &ir)) return;
+    for (int round = 0; round < MAX_ROUNDS; round++) {
+        bool changed = false;
+        for (size_t i = 0; i < sizeof(passes) / sizeof(passes[0]); i++) {
+            if (passes[i](&ir)) changed = true;
+        }
+        if (!changed) break;
+    }
+    // Unchecked opcodes compute the same values, so no other pass has
+    // anything new to do after this one.
+    specializeArithmetic(&ir);
+    // Leaves the chunk as it was if the code no longer fits.
+    emitIR(&ir);
+    freeIR(&ir);
+}
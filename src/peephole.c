@@ -0,0 +1,435 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../include/memory.h"
+#include "../include/peephole.h"
+
+// The pass decodes the chunk into a list of instructions, rewrites
+// common sequences into superinstructions and encodes the list again.
+// Jumps are kept as instruction indices while rewriting, so only the
+// final encoding has to compute byte offsets.
+
+typedef struct {
+    Instruction instruction;
+    int line;
+    int offset;     // in the chunk as compiled
+    int target;     // index of the jump target, -1 if not a jump
+    bool isTarget;  // some jump lands on this instruction
+    bool isEntry;   // an OP_JUMP a switch indexes into, which must stay
+    bool removed;
+} Node;
+
+typedef struct {
+    Node* nodes;
+    int count;
+    int end;        // offset of the end of the compiled code
+} NodeList;
+
+static int nextLive(NodeList* list, int index) {
+    do {
+        index++;
+    } while (index < list->count && list->nodes[index].removed);
+    return index;
+}
+
+// Index of the n-th live instruction after index, or -1 if there is none
+// or a jump lands on it (which would make fusing it unsafe).
+static int follower(NodeList* list, int index, int n) {
+    for (int i = 0; i < n; i++) {
+        index = nextLive(list, index);
+        if (index >= list->count || list->nodes[index].isTarget) return -1;
+    }
+    return index;
+}
+
+static uint8_t opAt(NodeList* list, int index) {
+    return list->nodes[index].instruction.opcode;
+}
+
+static void replace(NodeList* list, int index, uint8_t opcode, int line) {
+    Node* node = &list->nodes[index];
+    node->instruction.opcode = opcode;
+    node->line = line;
+}
+
+static void removeNode(NodeList* list, int index) {
+    list->nodes[index].removed = true;
+}
+
+static bool isSwitch(uint8_t opcode) {
+    return opcode == OP_SWITCH_INTEGER || opcode == OP_SWITCH_STRING;
+}
+
+// The jumps following a switch: one per case and the default.
+static int switchEntries(Node* node) {
+    return node->instruction.operands[1] + 1;
+}
+
+static void decode(Chunk* chunk, NodeList* list) {
+    int* offsetToIndex = ALLOCATE(int, chunk->count + 1);
+    for (int i = 0; i <= chunk->count; i++) offsetToIndex[i] = -1;
+    list->nodes = ALLOCATE(Node, chunk->count);
+    list->count = 0;
+    for (int offset = 0; offset < chunk->count;) {
+        Node* node = &list->nodes[list->count];
+        decodeInstruction(chunk, offset, &node->instruction);
+        node->line = getLine(&chunk->lines, offset);
+        node->offset = offset;
+        node->isTarget = false;
+        node->isEntry = false;
+        node->removed = false;
+        offsetToIndex[offset] = list->count++;
+        offset += node->instruction.length;
+    }
+    offsetToIndex[chunk->count] = list->count;
+    list->end = chunk->count;
+    for (int i = 0; i < list->count; i++) {
+        Node* node = &list->nodes[i];
+        if (isSwitch(node->instruction.opcode)) {
+            for (int entry = 1; entry <= switchEntries(node); entry++) {
+                list->nodes[i + entry].isEntry = true;
+            }
+        }
+        node->target = -1;
+        if (node->instruction.target != -1) {
+            // The compiler only ever jumps to the start of an instruction.
+            int target = node->instruction.target;
+            if (target > chunk->count || offsetToIndex[target] == -1) {
+                fprintf(stderr, "Jump at %d lands inside an instruction.\n",
+                        node->offset);
+                abort();
+            }
+            node->target = offsetToIndex[target];
+            list->nodes[node->target].isTarget = true;
+        }
+    }
+    FREE_ARRAY(int, offsetToIndex, chunk->count + 1);
+}
+
+static void encode(Chunk* chunk, NodeList* list) {
+    int* newOffset = ALLOCATE(int, list->count + 1);
+    int offset = 0;
+    for (int i = 0; i < list->count; i++) {
+        Instruction* instruction = &list->nodes[i].instruction;
+        newOffset[i] = offset;
+        if (!list->nodes[i].removed) {
+            instruction->length = encodedLength(instruction);
+            offset += instruction->length;
+        }
+    }
+    newOffset[list->count] = offset;
+
+    Chunk optimized;
+    initChunk(&optimized);
+    for (int i = 0; i < list->count; i++) {
+        Node* node = &list->nodes[i];
+        if (node->removed) continue;
+        if (node->target != -1) {
+            node->instruction.target = newOffset[node->target];
+        }
+        writeInstruction(&optimized, &node->instruction, node->line);
+    }
+    FREE_ARRAY(int, newOffset, list->count + 1);
+
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    freeLineArray(&chunk->lines);
+    chunk->code = optimized.code;
+    chunk->count = optimized.count;
+    chunk->capacity = optimized.capacity;
+    chunk->lines = optimized.lines;
+    freeValueArray(&optimized.constants);
+}
+
+static bool endsBlock(uint8_t opcode) {
+    return opcode == OP_JUMP || opcode == OP_LOOP || opcode == OP_RETURN;
+}
+
+// The first live instruction at or after index.
+static int liveAt(NodeList* list, int index) {
+    if (index < list->count && list->nodes[index].removed) {
+        return nextLive(list, index);
+    }
+    return index;
+}
+
+static int offsetOf(NodeList* list, int index) {
+    return index < list->count ? list->nodes[index].offset : list->end;
+}
+
+// Whether the jump at index can go to target in the direction its opcode
+// encodes. Code only shrinks while rewriting, so a distance that fits in
+// the compiled chunk still fits once it is encoded.
+static bool canJump(NodeList* list, int index, int target) {
+    Node* node = &list->nodes[index];
+    int end = node->offset + node->instruction.length;
+    // instruction.target is still the offset the jump was compiled with.
+    bool backward = node->instruction.target < end;
+    int distance = backward
+        ? end - offsetOf(list, target) : offsetOf(list, target) - end;
+    return distance >= 0 && distance <= UINT16_MAX;
+}
+
+// Recomputes isTarget from the live jumps, moving targets off removed
+// instructions.
+static void markTargets(NodeList* list) {
+    for (int i = 0; i < list->count; i++) list->nodes[i].isTarget = false;
+    for (int i = liveAt(list, 0); i < list->count; i = nextLive(list, i)) {
+        Node* node = &list->nodes[i];
+        if (node->target == -1) continue;
+        node->target = liveAt(list, node->target);
+        if (node->target < list->count) {
+            list->nodes[node->target].isTarget = true;
+        }
+    }
+}
+
+static uint8_t negatedComparison(uint8_t opcode) {
+    switch (opcode) {
+        case OP_EQUAL: return OP_NOT_EQUAL;
+        case OP_LESS: return OP_GREATER_EQUAL;
+        case OP_GREATER: return OP_LESS_EQUAL;
+        default: return opcode;
+    }
+}
+
+static uint8_t compareAndBranch(uint8_t opcode) {
+    switch (opcode) {
+        case OP_EQUAL: return OP_JUMP_IF_NOT_EQUAL;
+        case OP_NOT_EQUAL: return OP_JUMP_IF_EQUAL;
+        case OP_GREATER: return OP_JUMP_IF_NOT_GREATER;
+        case OP_LESS: return OP_JUMP_IF_NOT_LESS;
+        case OP_GREATER_EQUAL: return OP_JUMP_IF_NOT_GREATER_EQUAL;
+        case OP_LESS_EQUAL: return OP_JUMP_IF_NOT_LESS_EQUAL;
+        default: return opcode;
+    }
+}
+
+// The constant an OP_CONSTANT, OP_INTEGER or OP_DECIMAL pushes, adding
+// immediates to the pool; -1 for anything else.
+static int constantOf(Chunk* chunk, Instruction* instruction) {
+    switch (instruction->opcode) {
+        case OP_CONSTANT:
+            return instruction->operands[0];
+        case OP_INTEGER:
+        case OP_DECIMAL:
+            return addConstant(chunk, immediateValue(
+                instruction->opcode, instruction->operands[0]));
+        default:
+            return -1;
+    }
+}
+
+// OP_EQUAL/OP_LESS/OP_GREATER followed by OP_NOT and
+// OP_GET_LOCAL + a number or constant + OP_ADD/OP_SUBTRACT.
+static void fuseOperators(Chunk* chunk, NodeList* list) {
+    for (int i = 0; i < list->count; i = nextLive(list, i)) {
+        Node* node = &list->nodes[i];
+        if (node->removed) continue;
+        uint8_t opcode = node->instruction.opcode;
+
+        if (negatedComparison(opcode) != opcode) {
+            int next = follower(list, i, 1);
+            if (next != -1 && opAt(list, next) == OP_NOT) {
+                replace(list, i, negatedComparison(opcode), node->line);
+                removeNode(list, next);
+            }
+        } else if (opcode == OP_GET_LOCAL) {
+            int constant = follower(list, i, 1);
+            int arithmetic = follower(list, i, 2);
+            if (constant == -1 || arithmetic == -1) continue;
+            uint8_t fused;
+            // One quickened instruction beats three unchecked ones.
+            switch (opAt(list, arithmetic)) {
+                case OP_ADD:
+                case OP_ADD_UNCHECKED:
+                    fused = OP_ADD_LOCAL_CONSTANT;
+                    break;
+                case OP_SUBTRACT:
+                case OP_SUBTRACT_UNCHECKED:
+                    fused = OP_SUBTRACT_LOCAL_CONSTANT;
+                    break;
+                default: continue;
+            }
+            int index = constantOf(chunk, &list->nodes[constant].instruction);
+            if (index == -1) continue;
+            // Errors are reported by the arithmetic, so keep its line.
+            replace(list, i, fused, list->nodes[arithmetic].line);
+            node->instruction.operandCount = 2;
+            node->instruction.operands[1] = index;
+            removeNode(list, constant);
+            removeNode(list, arithmetic);
+        }
+    }
+}
+
+// A jump that lands on OP_JUMP or OP_LOOP goes straight to where that one
+// goes, as nested ifs and loops produce. OP_JUMP_IF_FALSE landing on
+// another one, as `and` does in a condition, takes its branch as well,
+// since the same value is still on the stack. A jump keeps its direction:
+// an OP_JUMP turned into a second OP_LOOP would stop traceLoop() from
+// recording the loop.
+static void threadJumps(NodeList* list) {
+    for (int i = 0; i < list->count; i = nextLive(list, i)) {
+        Node* node = &list->nodes[i];
+        if (node->removed || node->target == -1) continue;
+        uint8_t opcode = node->instruction.opcode;
+        // Bounded, as a loop of jumps never ends.
+        for (int hops = 0; hops < list->count; hops++) {
+            int target = liveAt(list, node->target);
+            if (target >= list->count || target == i) break;
+            Node* landing = &list->nodes[target];
+            uint8_t next = landing->instruction.opcode;
+            bool follows = next == OP_JUMP || next == OP_LOOP ||
+                           (opcode == OP_JUMP_IF_FALSE &&
+                            next == OP_JUMP_IF_FALSE);
+            if (!follows || !canJump(list, i, landing->target)) break;
+            node->target = landing->target;
+        }
+    }
+}
+
+// OP_JUMP_IF_FALSE leaves the condition on the stack for an OP_POP on
+// each path. When both paths start with that pop, pop in the jump
+// instead and skip the pop at the target.
+static void fusePopJumps(NodeList* list) {
+    for (int i = 0; i < list->count; i = nextLive(list, i)) {
+        Node* node = &list->nodes[i];
+        if (node->removed || node->instruction.opcode != OP_JUMP_IF_FALSE) {
+            continue;
+        }
+        int next = follower(list, i, 1);
+        if (next == -1 || opAt(list, next) != OP_POP) continue;
+        if (opAt(list, node->target) != OP_POP) continue;
+        int afterTarget = nextLive(list, node->target);
+        if (afterTarget >= list->count) continue;
+
+        replace(list, i, OP_POP_JUMP_IF_FALSE, node->line);
+        removeNode(list, next);
+        node->target = afterTarget;
+        list->nodes[afterTarget].isTarget = true;
+    }
+}
+
+// Drops the instructions control cannot reach from the start of the
+// chunk, such as the pop at an else branch once fusePopJumps() has moved
+// the only jump to it past the pop.
+typedef struct {
+    bool* reached;
+    int* pending;
+    int count;
+} Reachability;
+
+static void reach(NodeList* list, Reachability* reachability, int index) {
+    if (index >= list->count || reachability->reached[index]) return;
+    reachability->reached[index] = true;
+    reachability->pending[reachability->count++] = index;
+}
+
+static void removeUnreachable(NodeList* list) {
+    Reachability reachability;
+    reachability.reached = ALLOCATE(bool, list->count);
+    reachability.pending = ALLOCATE(int, list->count);
+    reachability.count = 0;
+    for (int i = 0; i < list->count; i++) reachability.reached[i] = false;
+    reach(list, &reachability, liveAt(list, 0));
+    while (reachability.count > 0) {
+        int index = reachability.pending[--reachability.count];
+        Node* node = &list->nodes[index];
+        uint8_t opcode = node->instruction.opcode;
+        if (isSwitch(opcode)) {
+            // Every entry, which follow the switch.
+            for (int entry = 1; entry <= switchEntries(node); entry++) {
+                reach(list, &reachability, index + entry);
+            }
+        } else if (!endsBlock(opcode)) {
+            reach(list, &reachability, nextLive(list, index));
+        }
+        if (node->target != -1) {
+            reach(list, &reachability, liveAt(list, node->target));
+        }
+    }
+    for (int i = 0; i < list->count; i++) {
+        if (!reachability.reached[i]) list->nodes[i].removed = true;
+    }
+    FREE_ARRAY(bool, reachability.reached, list->count);
+    FREE_ARRAY(int, reachability.pending, list->count);
+}
+
+// An OP_JUMP to the instruction right after it, as is left when an if
+// without an else loses the pop it jumped over. Going backwards removes
+// the jumps of nested ifs that end together in one pass.
+static void removeEmptyJumps(NodeList* list) {
+    for (int i = list->count - 1; i >= 0; i--) {
+        Node* node = &list->nodes[i];
+        if (node->removed || node->instruction.opcode != OP_JUMP ||
+                node->isEntry) {
+            continue;
+        }
+        if (liveAt(list, node->target) == nextLive(list, i)) {
+            removeNode(list, i);
+        }
+    }
+}
+
+// Runs of OP_POP, mostly emitted by endScope().
+static void fusePops(NodeList* list) {
+    for (int i = 0; i < list->count; i = nextLive(list, i)) {
+        Node* node = &list->nodes[i];
+        if (node->removed || node->instruction.opcode != OP_POP) continue;
+        int count = 1;
+        int next = follower(list, i, 1);
+        while (next != -1 && opAt(list, next) == OP_POP &&
+                count < UINT8_MAX) {
+            removeNode(list, next);
+            count++;
+            next = follower(list, i, 1);
+        }
+        if (count > 1) {
+            replace(list, i, OP_POPN, node->line);
+            node->instruction.operandCount = 1;
+            node->instruction.operands[0] = count;
+        }
+    }
+}
+
+// A comparison that only feeds OP_POP_JUMP_IF_FALSE becomes a single
+// compare-and-branch.
+static void fuseCompareJumps(NodeList* list) {
+    for (int i = 0; i < list->count; i = nextLive(list, i)) {
+        Node* node = &list->nodes[i];
+        if (node->removed) continue;
+        uint8_t opcode = node->instruction.opcode;
+        if (compareAndBranch(opcode) == opcode) continue;
+        int jump = follower(list, i, 1);
+        if (jump == -1 || opAt(list, jump) != OP_POP_JUMP_IF_FALSE) continue;
+
+        // Errors are reported by the comparison, so keep its line.
+        replace(list, i, compareAndBranch(opcode), node->line);
+        node->target = list->nodes[jump].target;
+        removeNode(list, jump);
+    }
+}
+
+void peepholeOptimize(Chunk* chunk) {
+    if (chunk->count == 0) return;
+    int originalCount = chunk->count;
+    NodeList list;
+    decode(chunk, &list);
+
+    fuseOperators(chunk, &list);
+    threadJumps(&list);
+    markTargets(&list);
+    // Before fusePops(), which could merge the pop at a jump target with
+    // the pops that follow it.
+    fusePopJumps(&list);
+    // Again for the jumps fusePopJumps() moved onto an OP_JUMP.
+    threadJumps(&list);
+    removeUnreachable(&list);
+    removeEmptyJumps(&list);
+    markTargets(&list);
+    fusePops(&list);
+    fuseCompareJumps(&list);
+
+    encode(chunk, &list);
+    FREE_ARRAY(Node, list.nodes, originalCount);
+}
@@ -0,0 +1,144 @@
+#include "../include/pipeline.h"
+
+#ifdef PIPELINE
+
+#include <pthread.h>
+#include <string.h>
+
+#include "../include/compiler.h"
+#include "../include/memory.h"
+
+// Compiled segments waiting to run, oldest first. The compiler waits when
+// it gets this far ahead.
+#define QUEUE_CAPACITY 64
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+    Chunk* segments[QUEUE_CAPACITY];
+    int head;
+    int count;
+    // Set by the compiler thread once it has returned.
+    bool done;
+    bool compiled;
+    // Set by the VM after a runtime error; later segments are dropped.
+    bool stopped;
+    const char* source;
+} SegmentQueue;
+
+static void freeSegment(Chunk* segment) {
+    freeChunk(segment);
+    FREE(Chunk, segment);
+}
+
+static void pushSegment(Chunk* segment, void* context) {
+    SegmentQueue* queue = (SegmentQueue*) context;
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == QUEUE_CAPACITY && !queue->stopped) {
+        pthread_cond_wait(&queue->notFull, &queue->lock);
+    }
+    bool stopped = queue->stopped;
+    if (!stopped) {
+        int tail = (queue->head + queue->count) % QUEUE_CAPACITY;
+        queue->segments[tail] = segment;
+        queue->count++;
+        pthread_cond_signal(&queue->notEmpty);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    if (stopped) freeSegment(segment);
+}
+
+// NULL once the compiler is done and every segment has been taken.
+static Chunk* popSegment(SegmentQueue* queue) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && !queue->done) {
+        pthread_cond_wait(&queue->notEmpty, &queue->lock);
+    }
+    Chunk* segment = NULL;
+    if (queue->count > 0) {
+        segment = queue->segments[queue->head];
+        queue->head = (queue->head + 1) % QUEUE_CAPACITY;
+        queue->count--;
+        pthread_cond_signal(&queue->notFull);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return segment;
+}
+
+static void* compileThread(void* context) {
+    SegmentQueue* queue = (SegmentQueue*) context;
+    bool compiled = compileSegments(queue->source, pushSegment, queue);
+    pthread_mutex_lock(&queue->lock);
+    queue->done = true;
+    queue->compiled = compiled;
+    pthread_cond_signal(&queue->notEmpty);
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+static void stopQueue(SegmentQueue* queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->stopped = true;
+    pthread_cond_signal(&queue->notFull);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static void initQueue(SegmentQueue* queue, const char* source) {
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->notEmpty, NULL);
+    pthread_cond_init(&queue->notFull, NULL);
+    queue->head = 0;
+    queue->count = 0;
+    queue->done = false;
+    queue->compiled = false;
+    queue->stopped = false;
+    queue->source = source;
+}
+
+static void freeQueue(SegmentQueue* queue) {
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->notEmpty);
+    pthread_cond_destroy(&queue->notFull);
+}
+
+InterpretResult interpretPipelined(const char* source) {
+    SegmentQueue queue;
+    initQueue(&queue, source);
+
+    // Every global is named by an identifier of at least one character
+    // and a separator, so this many slots never run out.
+    int globals = vm.globalValues.count + (int) strlen(source) / 2 + 1;
+    reserveValueArray(&vm.globalValues, globals);
+    reserveValueArray(&vm.globalIdentifiers, globals);
+
+    vm.pipelining = true;
+    pthread_t compiler;
+    if (pthread_create(&compiler, NULL, compileThread, &queue) != 0) {
+        // No thread to spare: compile and run it all in this one.
+        vm.pipelining = false;
+        freeQueue(&queue);
+        vm.usePipeline = false;
+        InterpretResult result = interpret(source);
+        vm.usePipeline = true;
+        return result;
+    }
+
+    InterpretResult result = INTERPRET_OK;
+    Chunk* segment;
+    while ((segment = popSegment(&queue)) != NULL) {
+        if (result == INTERPRET_OK) {
+            result = runChunk(segment);
+            if (result != INTERPRET_OK) stopQueue(&queue);
+        }
+        freeSegment(segment);
+    }
+    pthread_join(compiler, NULL);
+    vm.pipelining = false;
+
+    freeQueue(&queue);
+    if (!queue.compiled) return INTERPRET_COMPILE_ERROR;
+    return result;
+}
+
+#endif
@@ -0,0 +1,118 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../include/memory.h"
+#include "../include/object.h"
+#include "../include/profile.h"
+#include "../include/vm.h"
+
+#define PROFILE_HEADER "clox-profile 1"
+
+// 64-bit FNV-1a; profiles of different scripts must not collide.
+static uint64_t hashSource(const char* source) {
+    uint64_t hash = 14695981039346656037u;
+    for (const char* c = source; *c != '\0'; c++) {
+        hash ^= (uint8_t) *c;
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+void initProfile(TypeProfile* profile, const char* source) {
+    profile->sourceHash = hashSource(source);
+    profile->optimized = vm.useOptimizer;
+    profile->count = 0;
+    profile->seen = NULL;
+}
+
+void freeProfile(TypeProfile* profile) {
+    FREE_ARRAY(uint8_t, profile->seen, profile->count);
+    profile->count = 0;
+    profile->seen = NULL;
+}
+
+void resetProfile(TypeProfile* profile, Chunk* chunk) {
+    freeProfile(profile);
+    profile->count = chunk->count;
+    profile->seen = ALLOCATE(uint8_t, chunk->count);
+    for (int i = 0; i < chunk->count; i++) profile->seen[i] = 0;
+}
+
+uint8_t typesSeen(Value a, Value b) {
+    if (IS_NUMBER(a) && IS_NUMBER(b)) return SEEN_NUMBERS;
+    if (IS_STRING(a) && IS_STRING(b)) return SEEN_STRINGS;
+    return SEEN_OTHER;
+}
+
+// A header line, the key, then one "offset types" line per site that
+// ran.
+bool writeProfile(TypeProfile* profile, const char* path) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) return false;
+    fprintf(file, PROFILE_HEADER "\n%016" PRIx64 " %d %d\n",
+            profile->sourceHash, profile->optimized, profile->count);
+    for (int i = 0; i < profile->count; i++) {
+        if (profile->seen[i] != 0) fprintf(file, "%d %d\n", i, profile->seen[i]);
+    }
+    return fclose(file) == 0;
+}
+
+bool readProfile(TypeProfile* profile, const char* path, const char* source) {
+    initProfile(profile, source);
+    FILE* file = fopen(path, "r");
+    if (file == NULL) return false;
+    char header[sizeof(PROFILE_HEADER)];
+    uint64_t hash;
+    int optimized, count;
+    bool matches =
+        fgets(header, sizeof(header), file) != NULL &&
+        strcmp(header, PROFILE_HEADER) == 0 &&
+        fscanf(file, "%" SCNx64 " %d %d", &hash, &optimized, &count) == 3 &&
+        hash == profile->sourceHash && optimized == profile->optimized &&
+        count >= 0;
+    if (matches) {
+        profile->count = count;
+        profile->seen = ALLOCATE(uint8_t, count);
+        for (int i = 0; i < count; i++) profile->seen[i] = 0;
+        int offset, seen;
+        while (fscanf(file, "%d %d", &offset, &seen) == 2) {
+            if (offset >= 0 && offset < count) {
+                profile->seen[offset] = (uint8_t) seen;
+            }
+        }
+    }
+    fclose(file);
+    return matches;
+}
+
+// The form of an add instruction for what it saw, or the instruction
+// itself if it never ran.
+static uint8_t specializedForm(uint8_t opcode, uint8_t seen) {
+    if (seen == 0) return opcode;
+    switch (opcode) {
+        case OP_ADD:
+            if (seen == SEEN_NUMBERS) return OP_ADD_NUMBER;
+            if (seen == SEEN_STRINGS) return OP_ADD_STRING;
+            return OP_ADD_GENERIC;
+        case OP_ADD_LOCAL_CONSTANT:
+            return seen == SEEN_NUMBERS
+                ? OP_ADD_LOCAL_NUMBER : OP_ADD_LOCAL_CONSTANT_GENERIC;
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+            return seen == SEEN_NUMBERS ? OP_SUBTRACT_LOCAL_NUMBER : opcode;
+        default:
+            return opcode;
+    }
+}
+
+// The quickened forms take the same operands, so offsets do not move.
+void specializeChunk(Chunk* chunk, TypeProfile* profile) {
+    if (profile->count != chunk->count) return;
+    for (int offset = 0; offset < chunk->count;) {
+        Instruction instruction;
+        decodeInstruction(chunk, offset, &instruction);
+        chunk->code[offset] =
+            specializedForm(instruction.opcode, profile->seen[offset]);
+        offset += instruction.length;
+    }
+}
@@ -0,0 +1,285 @@
+#include <stdio.h>
+
+#include "../include/regvm.h"
+#include "../include/memory.h"
+#include "../include/object.h"
+
+void initRegisterChunk(RegisterChunk* chunk) {
+    chunk->count = 0;
+    chunk->capacity = 0;
+    chunk->code = NULL;
+    chunk->registerCount = 0;
+}
+
+void freeRegisterChunk(RegisterChunk* chunk) {
+    FREE_ARRAY(RegisterInstruction, chunk->code, chunk->capacity);
+    initRegisterChunk(chunk);
+}
+
+int writeRegisterInstruction(RegisterChunk* chunk,
+                             RegisterInstruction* instruction) {
+    if (chunk->capacity < chunk->count + 1) {
+        int oldCapacity = chunk->capacity;
+        chunk->capacity = GROW_CAPACITY(oldCapacity);
+        chunk->code = GROW_ARRAY(RegisterInstruction, chunk->code,
+                                 oldCapacity, chunk->capacity);
+    }
+    chunk->code[chunk->count] = *instruction;
+    return chunk->count++;
+}
+
+static Value* resolve(RegisterArg arg) {
+    switch (arg.kind) {
+        case ARG_REGISTER: return &vm.stack[arg.index];
+        case ARG_CONSTANT: return &vm.chunk->constants.values[arg.index];
+        case ARG_GLOBAL: return &vm.globalValues.values[arg.index];
+        default: return NULL;
+    }
+}
+
+static void linkRegisters(RegisterChunk* chunk) {
+    for (int i = 0; i < chunk->count; i++) {
+        RegisterInstruction* instruction = &chunk->code[i];
+        instruction->dst = resolve(instruction->args[0]);
+        instruction->a = resolve(instruction->args[1]);
+        instruction->b = resolve(instruction->args[2]);
+        instruction->jump = instruction->target < 0
+            ? NULL : &chunk->code[instruction->target];
+    }
+}
+
+// Only global slots ever hold UNDEFINED_VAL, so a read of any operand can
+// be checked the same way and the name found from its address.
+static void undefinedVariable(Value* global) {
+    int slot = (int) (global - vm.globalValues.values);
+    runtimeError("Undefined variable '%s'.",
+                 AS_CSTRING(vm.globalIdentifiers.values[slot]));
+}
+
+InterpretResult runRegisters(RegisterChunk* chunk) {
+    linkRegisters(chunk);
+    // Scratch space for concatenate() above the register file.
+    vm.stackTop = vm.stack + chunk->registerCount;
+
+#define DST (*instruction->dst)
+#define A (*instruction->a)
+#define B (*instruction->b)
+#define JUMP() (ip = instruction->jump)
+#define RUNTIME_ERROR(...) \
+        do { \
+            vm.ip = vm.chunk->code + instruction->offset + 1; \
+            runtimeError(__VA_ARGS__); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } while(false)
+#define CHECK_DEFINED(operand) \
+        do { \
+            if (IS_UNDEFINED(*(operand))) { \
+                vm.ip = vm.chunk->code + instruction->offset + 1; \
+                undefinedVariable(operand); \
+                return INTERPRET_RUNTIME_ERROR; \
+            } \
+        } while(false)
+// Operands that are not numbers might still be undefined globals, which
+// the stack code would have reported when it pushed them.
+#define NUMBER_OPERANDS(message) \
+        do { \
+            if (!IS_NUMBER(A) || !IS_NUMBER(B)) { \
+                CHECK_DEFINED(instruction->a); \
+                CHECK_DEFINED(instruction->b); \
+                RUNTIME_ERROR(message); \
+            } \
+        } while(false)
+#define BINARY_OP(valueType, op) \
+        do { \
+            NUMBER_OPERANDS("Operands must be numbers."); \
+            DST = valueType(AS_NUMBER(A) op AS_NUMBER(B)); \
+        } while(false)
+#define COMPARE_JUMP(condition) \
+        do { \
+            NUMBER_OPERANDS("Operands must be numbers."); \
+            double a = AS_NUMBER(A); \
+            double b = AS_NUMBER(B); \
+            if (!(condition)) JUMP(); \
+        } while(false)
+// The back-edge of a counted loop. Operands that are not numbers are
+// left to the loop header, which reports them.
+#define LOOP_JUMP(condition) \
+        do { \
+            if (IS_NUMBER(A) && IS_NUMBER(B)) { \
+                double a = AS_NUMBER(A); \
+                double b = AS_NUMBER(B); \
+                if (condition) JUMP(); \
+            } \
+        } while(false)
+
+#ifdef COUNT_INSTRUCTIONS
+#define COUNT_INSTRUCTION() (vm.instructionCount++)
+#else
+#define COUNT_INSTRUCTION() do { } while(false)
+#endif
+
+#ifdef COMPUTED_GOTO
+    static void* dispatchTable[] = {
+        [REG_MOVE] = &&TARGET_REG_MOVE,
+        [REG_SET_GLOBAL] = &&TARGET_REG_SET_GLOBAL,
+        [REG_EQUAL] = &&TARGET_REG_EQUAL,
+        [REG_NOT_EQUAL] = &&TARGET_REG_NOT_EQUAL,
+        [REG_GREATER] = &&TARGET_REG_GREATER,
+        [REG_GREATER_EQUAL] = &&TARGET_REG_GREATER_EQUAL,
+        [REG_LESS] = &&TARGET_REG_LESS,
+        [REG_LESS_EQUAL] = &&TARGET_REG_LESS_EQUAL,
+        [REG_ADD] = &&TARGET_REG_ADD,
+        [REG_SUBTRACT] = &&TARGET_REG_SUBTRACT,
+        [REG_MULTIPLY] = &&TARGET_REG_MULTIPLY,
+        [REG_DIVIDE] = &&TARGET_REG_DIVIDE,
+        [REG_NOT] = &&TARGET_REG_NOT,
+        [REG_NEGATE] = &&TARGET_REG_NEGATE,
+        [REG_PRINT] = &&TARGET_REG_PRINT,
+        [REG_JUMP] = &&TARGET_REG_JUMP,
+        [REG_JUMP_IF_FALSE] = &&TARGET_REG_JUMP_IF_FALSE,
+        [REG_JUMP_IF_EQUAL] = &&TARGET_REG_JUMP_IF_EQUAL,
+        [REG_JUMP_IF_NOT_EQUAL] = &&TARGET_REG_JUMP_IF_NOT_EQUAL,
+        [REG_JUMP_IF_NOT_GREATER] = &&TARGET_REG_JUMP_IF_NOT_GREATER,
+        [REG_JUMP_IF_NOT_GREATER_EQUAL] =
+            &&TARGET_REG_JUMP_IF_NOT_GREATER_EQUAL,
+        [REG_JUMP_IF_NOT_LESS] = &&TARGET_REG_JUMP_IF_NOT_LESS,
+        [REG_JUMP_IF_NOT_LESS_EQUAL] = &&TARGET_REG_JUMP_IF_NOT_LESS_EQUAL,
+        [REG_LOOP_IF_LESS] = &&TARGET_REG_LOOP_IF_LESS,
+        [REG_LOOP_IF_LESS_EQUAL] = &&TARGET_REG_LOOP_IF_LESS_EQUAL,
+        [REG_LOOP_IF_GREATER] = &&TARGET_REG_LOOP_IF_GREATER,
+        [REG_LOOP_IF_GREATER_EQUAL] = &&TARGET_REG_LOOP_IF_GREATER_EQUAL,
+        [REG_RETURN] = &&TARGET_REG_RETURN,
+    };
+#define INTERPRET_LOOP  DISPATCH();
+#define CASE(name)      TARGET_##name:
+#define DISPATCH() \
+        do { \
+            COUNT_INSTRUCTION(); \
+            instruction = ip++; \
+            goto *dispatchTable[instruction->opcode]; \
+        } while(false)
+#else
+#define INTERPRET_LOOP \
+        loop: \
+            COUNT_INSTRUCTION(); \
+            instruction = ip++; \
+            switch (instruction->opcode)
+#define CASE(name)      case name:
+#define DISPATCH()      goto loop
+#endif
+
+    RegisterInstruction* ip = chunk->code;
+    RegisterInstruction* instruction;
+    INTERPRET_LOOP
+    {
+        CASE(REG_MOVE) CHECK_DEFINED(instruction->a); DST = A; DISPATCH();
+        CASE(REG_SET_GLOBAL) {
+            CHECK_DEFINED(instruction->a);
+            CHECK_DEFINED(instruction->dst);
+            DST = A;
+            DISPATCH();
+        }
+        CASE(REG_EQUAL) {
+            CHECK_DEFINED(instruction->a);
+            CHECK_DEFINED(instruction->b);
+            DST = BOOL_VAL(valuesEqual(A, B));
+            DISPATCH();
+        }
+        CASE(REG_NOT_EQUAL) {
+            CHECK_DEFINED(instruction->a);
+            CHECK_DEFINED(instruction->b);
+            DST = BOOL_VAL(!valuesEqual(A, B));
+            DISPATCH();
+        }
+        CASE(REG_GREATER) BINARY_OP(BOOL_VAL, >); DISPATCH();
+        CASE(REG_GREATER_EQUAL) {
+            NUMBER_OPERANDS("Operands must be numbers.");
+            DST = BOOL_VAL(!(AS_NUMBER(A) < AS_NUMBER(B)));
+            DISPATCH();
+        }
+        CASE(REG_LESS) BINARY_OP(BOOL_VAL, <); DISPATCH();
+        CASE(REG_LESS_EQUAL) {
+            NUMBER_OPERANDS("Operands must be numbers.");
+            DST = BOOL_VAL(!(AS_NUMBER(A) > AS_NUMBER(B)));
+            DISPATCH();
+        }
+        CASE(REG_ADD) {
+            if (IS_NUMBER(A) && IS_NUMBER(B)) {
+                DST = NUMBER_VAL(AS_NUMBER(A) + AS_NUMBER(B));
+            } else if (IS_STRING(A) && IS_STRING(B)) {
+                push(A);
+                push(B);
+                concatenate();
+                DST = pop();
+            } else {
+                NUMBER_OPERANDS("Operands must be two numbers or two strings");
+            }
+            DISPATCH();
+        }
+        CASE(REG_SUBTRACT) BINARY_OP(NUMBER_VAL, -); DISPATCH();
+        CASE(REG_MULTIPLY) BINARY_OP(NUMBER_VAL, *); DISPATCH();
+        CASE(REG_DIVIDE) BINARY_OP(NUMBER_VAL, /); DISPATCH();
+        CASE(REG_NOT) {
+            CHECK_DEFINED(instruction->a);
+            DST = BOOL_VAL(isFalsey(A));
+            DISPATCH();
+        }
+        CASE(REG_NEGATE) {
+            if (!IS_NUMBER(A)) {
+                CHECK_DEFINED(instruction->a);
+                RUNTIME_ERROR("Operand must be a number.");
+            }
+            DST = NUMBER_VAL(-AS_NUMBER(A));
+            DISPATCH();
+        }
+        CASE(REG_PRINT) {
+            CHECK_DEFINED(instruction->a);
+            printValue(A);
+            printf("\n");
+            DISPATCH();
+        }
+        CASE(REG_JUMP) JUMP(); DISPATCH();
+        CASE(REG_JUMP_IF_FALSE) {
+            CHECK_DEFINED(instruction->a);
+            if (isFalsey(A)) JUMP();
+            DISPATCH();
+        }
+        CASE(REG_JUMP_IF_EQUAL) {
+            CHECK_DEFINED(instruction->a);
+            CHECK_DEFINED(instruction->b);
+            if (valuesEqual(A, B)) JUMP();
+            DISPATCH();
+        }
+        CASE(REG_JUMP_IF_NOT_EQUAL) {
+            CHECK_DEFINED(instruction->a);
+            CHECK_DEFINED(instruction->b);
+            if (!valuesEqual(A, B)) JUMP();
+            DISPATCH();
+        }
+        CASE(REG_JUMP_IF_NOT_GREATER) COMPARE_JUMP(a > b); DISPATCH();
+        CASE(REG_JUMP_IF_NOT_GREATER_EQUAL) COMPARE_JUMP(!(a < b)); DISPATCH();
+        CASE(REG_JUMP_IF_NOT_LESS) COMPARE_JUMP(a < b); DISPATCH();
+        CASE(REG_JUMP_IF_NOT_LESS_EQUAL) COMPARE_JUMP(!(a > b)); DISPATCH();
+        CASE(REG_LOOP_IF_LESS) LOOP_JUMP(a < b); DISPATCH();
+        CASE(REG_LOOP_IF_LESS_EQUAL) LOOP_JUMP(!(a > b)); DISPATCH();
+        CASE(REG_LOOP_IF_GREATER) LOOP_JUMP(a > b); DISPATCH();
+        CASE(REG_LOOP_IF_GREATER_EQUAL) LOOP_JUMP(!(a < b)); DISPATCH();
+        CASE(REG_RETURN) return INTERPRET_OK;
+    }
+    RUNTIME_ERROR("Unknown opcode %d.", instruction->opcode);
+
+#undef DST
+#undef A
+#undef B
+#undef JUMP
+#undef RUNTIME_ERROR
+#undef CHECK_DEFINED
+#undef NUMBER_OPERANDS
+#undef BINARY_OP
+#undef COMPARE_JUMP
+#undef LOOP_JUMP
+#undef COUNT_INSTRUCTION
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
+}
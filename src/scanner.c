@@ -4,10 +4,21 @@
 #include "../include/common.h"
 #include "../include/scanner.h"
 
+#ifdef SCANNER_SIMD
+#ifdef __AVX2__
+#include <immintrin.h>
+#else
+#include <emmintrin.h>
+#endif
+#endif
+
 typedef struct {
     char* fileStart;
     const char* start;
     const char* current;
+    // The terminating '\0'. Blocks are only loaded while a whole one fits
+    // before it.
+    const char* end;
     int charCount;
     int line;
 } Scanner;
@@ -18,6 +29,7 @@ void initScanner(const char* source) {
     scanner.fileStart = source;
     scanner.start = source;
     scanner.current = source;
+    scanner.end = source + strlen(source);
     scanner.charCount = 0;
     scanner.line = 1;
 }
@@ -73,9 +85,135 @@ static char advance() {
     return *(scanner.current-1);
 }
 
+#ifdef SCANNER_SIMD
+// Each helper below classifies the block at p and returns a mask with bit
+// i set for every byte i in the class. The run functions skip whole
+// blocks and stop at the first byte outside the run, or where less than a
+// block is left, for the scalar loops to finish.
+
+#ifdef __AVX2__
+#define BLOCK_BYTES 32
+#define BLOCK_MASK 0xffffffffu
+typedef __m256i Block;
+#define LOAD_BLOCK(p) _mm256_loadu_si256((const __m256i*) (p))
+#define SPLAT(c) _mm256_set1_epi8((char) (c))
+#define EQUAL_BYTES(a, b) _mm256_cmpeq_epi8(a, b)
+#define OR_BYTES(a, b) _mm256_or_si256(a, b)
+#define SUBTRACT_BYTES(a, b) _mm256_sub_epi8(a, b)
+#define MIN_BYTES(a, b) _mm256_min_epu8(a, b)
+#define BYTE_MASK(a) ((uint32_t) _mm256_movemask_epi8(a))
+#else
+#define BLOCK_BYTES 16
+#define BLOCK_MASK 0xffffu
+typedef __m128i Block;
+#define LOAD_BLOCK(p) _mm_loadu_si128((const __m128i*) (p))
+#define SPLAT(c) _mm_set1_epi8((char) (c))
+#define EQUAL_BYTES(a, b) _mm_cmpeq_epi8(a, b)
+#define OR_BYTES(a, b) _mm_or_si128(a, b)
+#define SUBTRACT_BYTES(a, b) _mm_sub_epi8(a, b)
+#define MIN_BYTES(a, b) _mm_min_epu8(a, b)
+#define BYTE_MASK(a) ((uint32_t) _mm_movemask_epi8(a))
+#endif
+
+static inline uint32_t equalBytes(Block bytes, char c) {
+    return BYTE_MASK(EQUAL_BYTES(bytes, SPLAT(c)));
+}
+
+// low <= c && c <= high, compared unsigned: c - low wraps around below
+// low, so it is in range when the smaller of it and high - low is itself.
+static inline uint32_t rangeBytes(Block bytes, char low, char high) {
+    Block offset = SUBTRACT_BYTES(bytes, SPLAT(low));
+    return BYTE_MASK(EQUAL_BYTES(MIN_BYTES(offset, SPLAT(high - low)), offset));
+}
+
+static uint32_t digitBytes(const char* p) {
+    return rangeBytes(LOAD_BLOCK(p), '0', '9');
+}
+
+// isAlpha() || isDigit(). Setting bit 5 folds 'A'-'Z' onto 'a'-'z' and
+// nothing else onto them.
+static uint32_t identifierBytes(const char* p) {
+    Block bytes = LOAD_BLOCK(p);
+    return rangeBytes(OR_BYTES(bytes, SPLAT(0x20)), 'a', 'z') |
+           rangeBytes(bytes, '0', '9') | equalBytes(bytes, '_');
+}
+
+static uint32_t notNewlineBytes(const char* p) {
+    return ~equalBytes(LOAD_BLOCK(p), '\n') & BLOCK_MASK;
+}
+
+// Bytes from scanner.current on that inRun() puts in the run.
+static int runLength(uint32_t (*inRun)(const char* p)) {
+    const char* p = scanner.current;
+    while (scanner.end - p >= BLOCK_BYTES) {
+        uint32_t outside = ~inRun(p) & BLOCK_MASK;
+        if (outside != 0) {
+            return (int) (p - scanner.current) + __builtin_ctz(outside);
+        }
+        p += BLOCK_BYTES;
+    }
+    return (int) (p - scanner.current);
+}
+
+static void advanceRun(uint32_t (*inRun)(const char* p)) {
+    int length = runLength(inRun);
+    scanner.current += length;
+    scanner.charCount += length;
+}
+
+// Blanks as skipWhitespace() takes them, a newline counting a line and
+// restarting the column.
+static void skipBlankRun() {
+    while (scanner.end - scanner.current >= BLOCK_BYTES) {
+        Block bytes = LOAD_BLOCK(scanner.current);
+        uint32_t newlines = equalBytes(bytes, '\n');
+        uint32_t blanks = equalBytes(bytes, ' ') | equalBytes(bytes, '\t') |
+                          equalBytes(bytes, '\r') | newlines;
+        uint32_t outside = ~blanks & BLOCK_MASK;
+        int length = outside == 0 ? BLOCK_BYTES : __builtin_ctz(outside);
+        newlines &= (uint32_t) ((1ull << length) - 1);
+        if (newlines != 0) {
+            int last = 31 - __builtin_clz(newlines);
+            scanner.line += __builtin_popcount(newlines);
+            scanner.charCount = length - last - 1;
+        } else {
+            scanner.charCount += length;
+        }
+        scanner.current += length;
+        if (length < BLOCK_BYTES) return;
+    }
+}
+
+// Up to the closing quote, as string() does: newlines count lines but do
+// not restart the column.
+static void advanceStringRun() {
+    while (scanner.end - scanner.current >= BLOCK_BYTES) {
+        Block bytes = LOAD_BLOCK(scanner.current);
+        uint32_t quotes = equalBytes(bytes, '"');
+        uint32_t newlines = equalBytes(bytes, '\n');
+        int length = BLOCK_BYTES;
+        if (quotes != 0) {
+            length = __builtin_ctz(quotes);
+            newlines &= (1u << length) - 1;
+        }
+        scanner.line += __builtin_popcount(newlines);
+        scanner.current += length;
+        scanner.charCount += length;
+        if (quotes != 0) return;
+    }
+}
+#endif
+
 static void skipWhitespace() {
     for (;;) {
         char c = peek();
+#ifdef SCANNER_SIMD
+        // The lone blanks between tokens are cheaper one at a time.
+        if ((c == ' ' || c == '\n') && peekNext() == ' ') {
+            skipBlankRun();
+            c = peek();
+        }
+#endif
         switch (c)
         {
             case ' ':
@@ -90,7 +228,11 @@ static void skipWhitespace() {
                 break;
             case '/':
                 if(peekNext() == '/') {
+#ifdef SCANNER_SIMD
+                    advanceRun(notNewlineBytes);
+#endif
                     while(peek() != '\n' && !isAtEnd()) advance();
+                    break;
                 } else {
                     return;
                 }
@@ -116,10 +258,12 @@ static TokenType identifierType() {
         case 'c': 
             if (scanner.current - scanner.start > 1) {
                 switch(scanner.start[1]) {
+                    case 'a': return checkKeyword(2, 2, "se", TOKEN_CASE);
                     case 'l': return checkKeyword(2, 3, "ass", TOKEN_CLASS);
                 }
             }
             break;
+        case 'd': return checkKeyword(1, 6, "efault", TOKEN_DEFAULT);
         case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
         case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
         case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
@@ -130,6 +274,7 @@ static TokenType identifierType() {
             if (scanner.current - scanner.start > 1) {
                 switch(scanner.start[1]) {
                     case 'u': return checkKeyword(2, 3, "per", TOKEN_SUPER);
+                    case 'w': return checkKeyword(2, 4, "itch", TOKEN_SWITCH);
                 }
             }
             break;
@@ -173,20 +318,32 @@ static TokenType identifierType() {
 }
 
 static Token identifier() {
+#ifdef SCANNER_SIMD
+    advanceRun(identifierBytes);
+#endif
     while(isAlpha(peek()) || isDigit(peek())) advance();
     return makeToken(identifierType());
 }
 
 static Token number() {
+#ifdef SCANNER_SIMD
+    advanceRun(digitBytes);
+#endif
     while(isDigit(peek())) advance();
     if (peek() == '.' && isDigit(peekNext())) {
         advance();
+#ifdef SCANNER_SIMD
+        advanceRun(digitBytes);
+#endif
         while(isDigit(peek())) advance();
     }
     return makeToken(TOKEN_NUMBER);
 }
 
 static Token string() {
+#ifdef SCANNER_SIMD
+    advanceStringRun();
+#endif
     while(peek() != '"' && !isAtEnd()) {
         if (peek() == '\n') scanner.line++;
         advance();
@@ -222,6 +379,7 @@ Token scanToken() {
         case '{': return makeToken(TOKEN_LEFT_BRACE);
         case '}': return makeToken(TOKEN_RIGHT_BRACE);
         case ';': return makeToken(TOKEN_SEMICOLON);
+        case ':': return makeToken(TOKEN_COLON);
         case ',': return makeToken(TOKEN_COMMA);
         case '.': return makeToken(TOKEN_DOT);
         case '-': return makeToken(TOKEN_MINUS);
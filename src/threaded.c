@@ -0,0 +1,49 @@
+#include "../include/threaded.h"
+#include "../include/memory.h"
+
+void threadChunk(ThreadedCode* code, Chunk* chunk, void** handlers) {
+    code->chunkCount = chunk->count;
+    code->entries = ALLOCATE(int, chunk->count + 1);
+    code->count = 0;
+    for (int offset = 0; offset < chunk->count;) {
+        Instruction instruction;
+        decodeInstruction(chunk, offset, &instruction);
+        for (int i = 0; i < instruction.length; i++) {
+            code->entries[offset + i] = i == 0 ? code->count : -1;
+        }
+        code->count++;
+        offset += instruction.length;
+    }
+    code->entries[chunk->count] = code->count;
+
+    code->code = ALLOCATE(ThreadedInstruction, code->count);
+    code->offsets = ALLOCATE(int, code->count + 1);
+    int index = 0;
+    for (int offset = 0; offset < chunk->count; index++) {
+        Instruction instruction;
+        decodeInstruction(chunk, offset, &instruction);
+        ThreadedInstruction* threaded = &code->code[index];
+        threaded->opcode = instruction.opcode;
+        threaded->handler = handlers == NULL ? NULL : handlers[instruction.opcode];
+        for (int i = 0; i < 4; i++) {
+            threaded->operands[i] =
+                i < instruction.operandCount ? instruction.operands[i] : 0;
+        }
+        threaded->target = instruction.target < 0
+            ? NULL : &code->code[code->entries[instruction.target]];
+        code->offsets[index] = offset;
+        offset += instruction.length;
+    }
+    code->offsets[code->count] = chunk->count;
+}
+
+void freeThreadedCode(ThreadedCode* code) {
+    FREE_ARRAY(ThreadedInstruction, code->code, code->count);
+    FREE_ARRAY(int, code->offsets, code->count + 1);
+    FREE_ARRAY(int, code->entries, code->chunkCount + 1);
+    code->code = NULL;
+    code->offsets = NULL;
+    code->entries = NULL;
+    code->count = 0;
+    code->chunkCount = 0;
+}
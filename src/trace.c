@@ -0,0 +1,972 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "../include/trace.h"
+#include "../include/assembler.h"
+#include "../include/memory.h"
+#include "../include/object.h"
+#include "../include/vm.h"
+
+#ifdef JIT_SUPPORTED
+
+// Recording does not execute anything: it follows the path one iteration
+// would take from the loop header, using the current values of the loop
+// variables to pick branch directions, and emits code as it goes. Only
+// numeric traces are built. Every loop variable holds a number, checked
+// once on entry, so the only guards left inside the loop are the
+// comparisons whose outcome the recording depended on.
+//
+// Traces compute on doubles only. Integer constants are widened while
+// recording and integer loop variables on entry, see emitEntry().
+//
+// The operand stack above the loop's base is kept virtual: constants are
+// folded, temporaries live in XMM registers indexed by stack depth, and
+// the most used loop variables stay in callee-saved registers for the
+// whole trace. A side exit writes those back, materializes the virtual
+// stack into vm.stack and returns the offset to resume at.
+
+// Back-edges taken before a loop is recorded.
+#define HOT_LOOP 64
+#define BLACKLISTED -1
+#define MAX_TRACE_LENGTH 1024
+#define MAX_TRACE_VARIABLES 64
+// Temporaries use XMM0..XMM13; XMM14 and XMM15 are scratch.
+#define MAX_TRACE_DEPTH 14
+#define SCRATCH_A XMM14
+#define SCRATCH_B XMM15
+
+typedef int (*TraceEntry)();
+
+typedef struct {
+    int* counters;
+    Executable* traces;
+    int count;
+} TraceCache;
+
+static TraceCache cache;
+
+// Callee-saved, so loop variables survive calls out of the trace.
+static const Register variableRegisters[] = { RBX, RBP, R12, R13, R14, R15 };
+#define VARIABLE_REGISTER_COUNT \
+    ((int) (sizeof(variableRegisters) / sizeof(Register)))
+
+typedef enum {
+    OPERAND_CONSTANT,
+    OPERAND_VARIABLE,  // the current value of a loop variable
+    OPERAND_TEMP,      // a number in the XMM register of its depth
+    OPERAND_SPILLED,   // a number in its vm.stack slot
+} OperandType;
+
+// Only constants can hold something other than a number.
+typedef struct {
+    OperandType type;
+    int variable;
+    Value value;  // as seen while recording
+} Operand;
+
+// A local below the loop's base or a global used in the loop.
+typedef struct {
+    bool isGlobal;
+    int slot;
+    Value* home;
+    int uses;
+    bool inRegister;
+    Register reg;
+    bool accessed;
+    bool readFirst;
+    bool written;
+    Value value;
+} TraceVariable;
+
+// The interpreter state a guard leaves to.
+typedef struct {
+    int resume;
+    int stackCount;
+    Operand* stack;
+    int jumpCount;
+    int jumps[2];
+} TraceExit;
+
+typedef struct {
+    Assembler as;
+    Chunk* chunk;
+    int header;
+    int loop;
+    int base;
+    Operand stack[MAX_TRACE_DEPTH];
+    int stackCount;
+    TraceVariable variables[MAX_TRACE_VARIABLES];
+    int variableCount;
+    TraceExit* exits;
+    int exitCount;
+    int exitCapacity;
+} Recorder;
+
+typedef enum {
+    COMPARE_EQUAL,
+    COMPARE_GREATER,
+    COMPARE_LESS,
+    COMPARE_GREATER_EQUAL,  // !(a < b), as in run()
+    COMPARE_LESS_EQUAL,     // !(a > b)
+} Comparison;
+
+typedef void (*SseOp)(Assembler* as, XmmRegister dst, XmmRegister src);
+
+static void tracePrint(Value value) {
+    printValue(value);
+    printf("\n");
+}
+
+// Widens an integer loop variable for the trace; 0 if *home holds
+// something else.
+static int traceWiden(Value* home) {
+    if (!IS_INT(*home)) return 0;
+    *home = widenInteger(*home);
+    return 1;
+}
+
+static uint64_t address(void* pointer) {
+    return (uint64_t) (uintptr_t) pointer;
+}
+
+static XmmRegister tempRegister(int depth) {
+    return (XmmRegister) depth;
+}
+
+static Value* stackSlot(Recorder* recorder, int depth) {
+    return &vm.stack[recorder->base + depth];
+}
+
+static TraceVariable* findVariable(Recorder* recorder, bool isGlobal,
+                                   int slot) {
+    for (int i = 0; i < recorder->variableCount; i++) {
+        TraceVariable* variable = &recorder->variables[i];
+        if (variable->isGlobal == isGlobal && variable->slot == slot) {
+            return variable;
+        }
+    }
+    if (recorder->variableCount == MAX_TRACE_VARIABLES) return NULL;
+
+    TraceVariable* variable = &recorder->variables[recorder->variableCount++];
+    variable->isGlobal = isGlobal;
+    variable->slot = slot;
+    variable->home = isGlobal
+        ? &vm.globalValues.values[slot] : &vm.stack[slot];
+    variable->uses = 0;
+    variable->inRegister = false;
+    variable->accessed = false;
+    variable->readFirst = false;
+    variable->written = false;
+    variable->value = *variable->home;
+    return variable;
+}
+
+// Locals at or above the base are declared inside the loop body and live
+// on the virtual stack instead.
+static bool isLoopVariable(Recorder* recorder, Instruction* instruction,
+                           bool* isGlobal) {
+    switch (instruction->opcode) {
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+            *isGlobal = true;
+            return true;
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_ADD_LOCAL_CONSTANT_GENERIC:
+        case OP_ADD_LOCAL_NUMBER:
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+        case OP_SUBTRACT_LOCAL_NUMBER:
+            *isGlobal = false;
+            return instruction->operands[0] < recorder->base;
+        default:
+            return false;
+    }
+}
+
+static bool isCountedLoop(uint8_t opcode) {
+    return opcode == OP_INCREMENT_LOOP_IF_LESS ||
+           opcode == OP_INCREMENT_LOOP_IF_LESS_EQUAL ||
+           opcode == OP_INCREMENT_LOOP_IF_GREATER ||
+           opcode == OP_INCREMENT_LOOP_IF_GREATER_EQUAL;
+}
+
+static bool countUse(Recorder* recorder, bool isGlobal, int slot) {
+    TraceVariable* variable = findVariable(recorder, isGlobal, slot);
+    if (variable == NULL) return false;
+    variable->uses++;
+    return true;
+}
+
+// The counter and bound of a counted loop, when they are variables.
+static bool countLoopUses(Recorder* recorder, Instruction* instruction) {
+    int kinds = instruction->operands[0];
+    int operands[2] = {instruction->operands[1], instruction->operands[3]};
+    int operandKinds[2] = {LOOP_COUNTER_KIND(kinds), LOOP_BOUND_KIND(kinds)};
+    for (int i = 0; i < 2; i++) {
+        if (operandKinds[i] == LOOP_CONSTANT) continue;
+        bool isGlobal = operandKinds[i] == LOOP_GLOBAL;
+        if (!isGlobal && operands[i] >= recorder->base) continue;
+        if (!countUse(recorder, isGlobal, operands[i])) return false;
+    }
+    return true;
+}
+
+// Counts the uses of every loop variable in the body and gives the
+// registers to the busiest ones.
+static bool allocateVariables(Recorder* recorder) {
+    for (int offset = recorder->header; offset <= recorder->loop;) {
+        Instruction instruction;
+        decodeInstruction(recorder->chunk, offset, &instruction);
+        bool isGlobal;
+        if (isLoopVariable(recorder, &instruction, &isGlobal)) {
+            if (!countUse(recorder, isGlobal, instruction.operands[0])) {
+                return false;
+            }
+        } else if (isCountedLoop(instruction.opcode)) {
+            if (!countLoopUses(recorder, &instruction)) return false;
+        }
+        offset += instruction.length;
+    }
+
+    for (int i = 0; i < VARIABLE_REGISTER_COUNT; i++) {
+        TraceVariable* busiest = NULL;
+        for (int j = 0; j < recorder->variableCount; j++) {
+            TraceVariable* variable = &recorder->variables[j];
+            if (variable->inRegister) continue;
+            if (busiest == NULL || variable->uses > busiest->uses) {
+                busiest = variable;
+            }
+        }
+        if (busiest == NULL) break;
+        busiest->inRegister = true;
+        busiest->reg = variableRegisters[i];
+    }
+    return true;
+}
+
+// dst = bits of the operand at depth.
+static void loadBits(Recorder* recorder, Register dst, Operand* operand,
+                     int depth) {
+    Assembler* as = &recorder->as;
+    switch (operand->type) {
+        case OPERAND_CONSTANT:
+            asmMovImm64(as, dst, operand->value);
+            break;
+        case OPERAND_VARIABLE: {
+            TraceVariable* variable = &recorder->variables[operand->variable];
+            if (variable->inRegister) {
+                asmMovReg(as, dst, variable->reg);
+            } else {
+                asmMovImm64(as, dst, address(variable->home));
+                asmLoad(as, dst, dst, 0);
+            }
+            break;
+        }
+        case OPERAND_TEMP:
+            asmMovqFromXmm(as, dst, tempRegister(depth));
+            break;
+        case OPERAND_SPILLED:
+            asmMovImm64(as, dst, address(stackSlot(recorder, depth)));
+            asmLoad(as, dst, dst, 0);
+            break;
+    }
+}
+
+// Returns an XMM register holding the operand at depth, loading it into
+// scratch unless it already is a temporary. Clobbers RAX.
+static XmmRegister operandXmm(Recorder* recorder, Operand* operand,
+                              int depth, XmmRegister scratch) {
+    if (operand->type == OPERAND_TEMP) return tempRegister(depth);
+    if (operand->type == OPERAND_VARIABLE &&
+        recorder->variables[operand->variable].inRegister) {
+        asmMovqToXmm(&recorder->as, scratch,
+                     recorder->variables[operand->variable].reg);
+        return scratch;
+    }
+    loadBits(recorder, RAX, operand, depth);
+    asmMovqToXmm(&recorder->as, scratch, RAX);
+    return scratch;
+}
+
+static void makeTemp(Recorder* recorder, int depth) {
+    Operand* operand = &recorder->stack[depth];
+    if (operand->type == OPERAND_TEMP) return;
+    operandXmm(recorder, operand, depth, tempRegister(depth));
+    operand->type = OPERAND_TEMP;
+}
+
+// XMM registers do not survive calls, so temporaries go to vm.stack.
+static void spillTemps(Recorder* recorder) {
+    Assembler* as = &recorder->as;
+    for (int i = 0; i < recorder->stackCount; i++) {
+        Operand* operand = &recorder->stack[i];
+        if (operand->type != OPERAND_TEMP) continue;
+        asmMovqFromXmm(as, RAX, tempRegister(i));
+        asmMovImm64(as, RCX, address(stackSlot(recorder, i)));
+        asmStore(as, RCX, 0, RAX);
+        operand->type = OPERAND_SPILLED;
+    }
+}
+
+static bool pushOperand(Recorder* recorder, OperandType type, int variable,
+                        Value value) {
+    if (recorder->stackCount == MAX_TRACE_DEPTH) return false;
+    Operand* operand = &recorder->stack[recorder->stackCount++];
+    operand->type = type;
+    operand->variable = variable;
+    operand->value = value;
+    return true;
+}
+
+static bool pushConstant(Recorder* recorder, Value value) {
+    return pushOperand(recorder, OPERAND_CONSTANT, 0, widenInteger(value));
+}
+
+static bool popOperands(Recorder* recorder, int count) {
+    if (recorder->stackCount < count) return false;
+    recorder->stackCount -= count;
+    return true;
+}
+
+static TraceExit* addExit(Recorder* recorder, int resume) {
+    if (recorder->exitCapacity < recorder->exitCount + 1) {
+        int oldCapacity = recorder->exitCapacity;
+        recorder->exitCapacity = GROW_CAPACITY(oldCapacity);
+        recorder->exits = GROW_ARRAY(TraceExit, recorder->exits,
+                                     oldCapacity, recorder->exitCapacity);
+    }
+    TraceExit* exit = &recorder->exits[recorder->exitCount++];
+    exit->resume = resume;
+    exit->stackCount = recorder->stackCount;
+    exit->stack = NULL;
+    if (recorder->stackCount > 0) {
+        exit->stack = ALLOCATE(Operand, recorder->stackCount);
+        memcpy(exit->stack, recorder->stack,
+               sizeof(Operand) * recorder->stackCount);
+    }
+    exit->jumpCount = 0;
+    return exit;
+}
+
+static void exitIf(Recorder* recorder, TraceExit* exit, Condition condition) {
+    exit->jumps[exit->jumpCount++] = asmJumpIf(&recorder->as, condition);
+}
+
+static bool getVariable(Recorder* recorder, bool isGlobal, int slot) {
+    TraceVariable* variable = findVariable(recorder, isGlobal, slot);
+    if (!variable->accessed) {
+        variable->accessed = true;
+        variable->readFirst = true;
+    }
+    if (!IS_NUMBER(variable->value)) return false;
+    return pushOperand(recorder, OPERAND_VARIABLE,
+                       (int) (variable - recorder->variables),
+                       variable->value);
+}
+
+static bool setVariable(Recorder* recorder, bool isGlobal, int slot) {
+    Assembler* as = &recorder->as;
+    TraceVariable* variable = findVariable(recorder, isGlobal, slot);
+    int index = (int) (variable - recorder->variables);
+    int top = recorder->stackCount - 1;
+    if (top < 0) return false;
+    Operand* value = &recorder->stack[top];
+    if (!IS_NUMBER(value->value)) return false;
+    // Assigning an undefined global is a runtime error.
+    if (isGlobal && IS_UNDEFINED(variable->value)) return false;
+    if (!variable->accessed) variable->accessed = true;
+
+    // Copies of the old value already on the stack have to keep it.
+    for (int i = 0; i < recorder->stackCount; i++) {
+        Operand* operand = &recorder->stack[i];
+        if (operand->type == OPERAND_VARIABLE && operand->variable == index) {
+            makeTemp(recorder, i);
+        }
+    }
+
+    if (variable->inRegister) {
+        loadBits(recorder, variable->reg, value, top);
+    } else {
+        loadBits(recorder, RCX, value, top);
+        asmMovImm64(as, RDX, address(variable->home));
+        asmStore(as, RDX, 0, RCX);
+    }
+    variable->value = value->value;
+    variable->written = true;
+    return true;
+}
+
+static bool getLocal(Recorder* recorder, int slot) {
+    if (slot < recorder->base) return getVariable(recorder, false, slot);
+
+    int depth = slot - recorder->base;
+    if (depth >= recorder->stackCount) return false;
+    Operand operand = recorder->stack[depth];
+    if (!pushOperand(recorder, operand.type, operand.variable, operand.value)) {
+        return false;
+    }
+    int top = recorder->stackCount - 1;
+    if (operand.type == OPERAND_TEMP) {
+        asmMovsdReg(&recorder->as, tempRegister(top), tempRegister(depth));
+    } else if (operand.type == OPERAND_SPILLED) {
+        operandXmm(recorder, &operand, depth, tempRegister(top));
+        recorder->stack[top].type = OPERAND_TEMP;
+    }
+    return true;
+}
+
+static bool setLocal(Recorder* recorder, int slot) {
+    if (slot < recorder->base) return setVariable(recorder, false, slot);
+
+    int depth = slot - recorder->base;
+    int top = recorder->stackCount - 1;
+    if (depth >= top) return false;
+    Operand* value = &recorder->stack[top];
+    recorder->stack[depth] = *value;
+    if (value->type == OPERAND_TEMP) {
+        asmMovsdReg(&recorder->as, tempRegister(depth), tempRegister(top));
+    } else if (value->type == OPERAND_SPILLED) {
+        operandXmm(recorder, value, top, tempRegister(depth));
+        recorder->stack[depth].type = OPERAND_TEMP;
+    }
+    return true;
+}
+
+static bool arithmetic(Recorder* recorder, uint8_t opcode) {
+    int top = recorder->stackCount - 1;
+    if (top < 1) return false;
+    Operand* a = &recorder->stack[top - 1];
+    Operand* b = &recorder->stack[top];
+    if (!IS_NUMBER(a->value) || !IS_NUMBER(b->value)) return false;
+
+    double x = AS_NUMBER(a->value);
+    double y = AS_NUMBER(b->value);
+    double result;
+    SseOp op;
+    switch (opcode) {
+        case OP_ADD: result = x + y; op = asmAddsd; break;
+        case OP_SUBTRACT: result = x - y; op = asmSubsd; break;
+        case OP_MULTIPLY: result = x * y; op = asmMulsd; break;
+        case OP_DIVIDE: result = x / y; op = asmDivsd; break;
+        default: return false;
+    }
+
+    if (a->type != OPERAND_CONSTANT || b->type != OPERAND_CONSTANT) {
+        XmmRegister right = operandXmm(recorder, b, top, SCRATCH_B);
+        makeTemp(recorder, top - 1);
+        op(&recorder->as, tempRegister(top - 1), right);
+    }
+    a->value = NUMBER_VAL(result);
+    recorder->stackCount--;
+    return true;
+}
+
+static bool negate(Recorder* recorder) {
+    int top = recorder->stackCount - 1;
+    if (top < 0) return false;
+    Operand* operand = &recorder->stack[top];
+    if (!IS_NUMBER(operand->value)) return false;
+
+    if (operand->type != OPERAND_CONSTANT) {
+        makeTemp(recorder, top);
+        asmMovImm64(&recorder->as, RAX, SIGN_BIT);
+        asmMovqToXmm(&recorder->as, SCRATCH_B, RAX);
+        asmXorpd(&recorder->as, tempRegister(top), SCRATCH_B);
+    }
+    operand->value = NUMBER_VAL(-AS_NUMBER(operand->value));
+    return true;
+}
+
+static bool not(Recorder* recorder) {
+    if (recorder->stackCount == 0) return false;
+    // Only constants can be falsey.
+    Operand* operand = &recorder->stack[recorder->stackCount - 1];
+    operand->type = OPERAND_CONSTANT;
+    operand->value = BOOL_VAL(isFalsey(operand->value));
+    return true;
+}
+
+static bool print(Recorder* recorder) {
+    int top = recorder->stackCount - 1;
+    if (top < 0) return false;
+    loadBits(recorder, RDI, &recorder->stack[top], top);
+    recorder->stackCount--;
+    spillTemps(recorder);
+    asmCall(&recorder->as, tracePrint);
+    return true;
+}
+
+// Pops and compares the top two operands. *holds is the outcome seen
+// while recording. When it depends on run-time values, *dynamic is set
+// and UCOMISD is emitted for guardComparison(). Returns false where run()
+// would raise an error.
+static bool compare(Recorder* recorder, Comparison comparison, bool* holds,
+                    bool* dynamic) {
+    int top = recorder->stackCount - 1;
+    if (top < 1) return false;
+    Operand* a = &recorder->stack[top - 1];
+    Operand* b = &recorder->stack[top];
+    bool numbers = IS_NUMBER(a->value) && IS_NUMBER(b->value);
+    *dynamic = numbers && (a->type != OPERAND_CONSTANT ||
+                           b->type != OPERAND_CONSTANT);
+
+    if (comparison == COMPARE_EQUAL) {
+        *holds = valuesEqual(a->value, b->value);
+    } else {
+        if (!numbers) return false;
+        double x = AS_NUMBER(a->value);
+        double y = AS_NUMBER(b->value);
+        switch (comparison) {
+            case COMPARE_GREATER: *holds = x > y; break;
+            case COMPARE_LESS: *holds = x < y; break;
+            case COMPARE_GREATER_EQUAL: *holds = !(x < y); break;
+            case COMPARE_LESS_EQUAL: *holds = !(x > y); break;
+            default: return false;
+        }
+    }
+
+    if (*dynamic) {
+        XmmRegister left = operandXmm(recorder, a, top - 1, SCRATCH_A);
+        XmmRegister right = operandXmm(recorder, b, top, SCRATCH_B);
+        if (comparison == COMPARE_LESS ||
+            comparison == COMPARE_GREATER_EQUAL) {
+            asmUcomisd(&recorder->as, right, left);
+        } else {
+            asmUcomisd(&recorder->as, left, right);
+        }
+    }
+    recorder->stackCount -= 2;
+    return true;
+}
+
+// Leaves through exit unless the comparison comes out as holds again.
+static void guardComparison(Recorder* recorder, Comparison comparison,
+                            bool holds, TraceExit* exit) {
+    if (comparison == COMPARE_EQUAL) {
+        // Equal is ZF set with PF clear; unordered operands set both.
+        if (holds) {
+            exitIf(recorder, exit, CC_NE);
+            exitIf(recorder, exit, CC_P);
+        } else {
+            int unordered = asmJumpIf(&recorder->as, CC_P);
+            exitIf(recorder, exit, CC_E);
+            asmPatch(&recorder->as, unordered, recorder->as.count);
+        }
+        return;
+    }
+    Condition condition = comparison == COMPARE_GREATER ||
+                          comparison == COMPARE_LESS ? CC_A : CC_BE;
+    exitIf(recorder, exit, holds ? (Condition) (condition ^ 1) : condition);
+}
+
+static bool comparisonValue(Recorder* recorder, Comparison comparison,
+                            bool negated, int next) {
+    bool holds, dynamic;
+    if (!compare(recorder, comparison, &holds, &dynamic)) return false;
+    bool result = holds != negated;
+    if (dynamic) {
+        pushConstant(recorder, BOOL_VAL(!result));
+        TraceExit* exit = addExit(recorder, next);
+        recorder->stackCount--;
+        guardComparison(recorder, comparison, holds, exit);
+    }
+    return pushConstant(recorder, BOOL_VAL(result));
+}
+
+// Returns the offset the recording continues at, or -1.
+static int comparisonBranch(Recorder* recorder, Comparison comparison,
+                            bool branchIfHolds, Instruction* instruction,
+                            int next) {
+    bool holds, dynamic;
+    if (!compare(recorder, comparison, &holds, &dynamic)) return -1;
+    bool taken = holds == branchIfHolds;
+    if (dynamic) {
+        TraceExit* exit = addExit(recorder, taken ? next : instruction->target);
+        guardComparison(recorder, comparison, holds, exit);
+    }
+    return taken ? instruction->target : next;
+}
+
+static bool getLoopOperand(Recorder* recorder, int kind, int index) {
+    switch (kind) {
+        case LOOP_CONSTANT:
+            return pushConstant(recorder,
+                                recorder->chunk->constants.values[index]);
+        case LOOP_LOCAL: return getLocal(recorder, index);
+        default: return getVariable(recorder, true, index);
+    }
+}
+
+// Records the increment and the test of a counted loop ending the trace.
+// The trace only closes the loop if the test held while recording; once
+// it fails, the exit resumes at the OP_LOOP after the instruction.
+static bool countedLoop(Recorder* recorder, Instruction* instruction,
+                        Comparison comparison, int next) {
+    int kinds = instruction->operands[0];
+    int counterKind = LOOP_COUNTER_KIND(kinds);
+    int counter = instruction->operands[1];
+    Value step = recorder->chunk->constants.values[instruction->operands[2]];
+    if (!getLoopOperand(recorder, counterKind, counter) ||
+        !pushConstant(recorder, step) ||
+        !arithmetic(recorder, OP_ADD)) {
+        return false;
+    }
+    bool stored = counterKind == LOOP_LOCAL
+        ? setLocal(recorder, counter)
+        : setVariable(recorder, true, counter);
+    if (!stored || !popOperands(recorder, 1)) return false;
+
+    if (!getLoopOperand(recorder, counterKind, counter) ||
+        !getLoopOperand(recorder, LOOP_BOUND_KIND(kinds),
+                        instruction->operands[3])) {
+        return false;
+    }
+    return comparisonBranch(recorder, comparison, true, instruction, next) ==
+           instruction->target;
+}
+
+// Follows one iteration from the header until the back-edge.
+static bool record(Recorder* recorder) {
+    Value* constants = recorder->chunk->constants.values;
+    int offset = recorder->header;
+    for (int length = 0; length < MAX_TRACE_LENGTH; length++) {
+        if (offset < recorder->header || offset > recorder->loop) return false;
+
+        Instruction instruction;
+        decodeInstruction(recorder->chunk, offset, &instruction);
+        int operand = instruction.operands[0];
+        int next = offset + instruction.length;
+        bool recorded = true;
+
+        switch (instruction.opcode) {
+            case OP_CONSTANT:
+                recorded = pushConstant(recorder, constants[operand]);
+                break;
+            case OP_INTEGER:
+            case OP_DECIMAL:
+                recorded = pushConstant(recorder, immediateValue(
+                    instruction.opcode, operand));
+                break;
+            case OP_NIL: recorded = pushConstant(recorder, NIL_VAL); break;
+            case OP_TRUE: recorded = pushConstant(recorder, TRUE_VAL); break;
+            case OP_FALSE: recorded = pushConstant(recorder, FALSE_VAL); break;
+            case OP_POP: recorded = popOperands(recorder, 1); break;
+            case OP_POPN: recorded = popOperands(recorder, operand); break;
+            case OP_GET_LOCAL: recorded = getLocal(recorder, operand); break;
+            case OP_SET_LOCAL: recorded = setLocal(recorder, operand); break;
+            case OP_GET_GLOBAL:
+                recorded = getVariable(recorder, true, operand);
+                break;
+            case OP_SET_GLOBAL:
+                recorded = setVariable(recorder, true, operand);
+                break;
+            case OP_EQUAL:
+                recorded = comparisonValue(recorder, COMPARE_EQUAL, false, next);
+                break;
+            case OP_NOT_EQUAL:
+                recorded = comparisonValue(recorder, COMPARE_EQUAL, true, next);
+                break;
+            case OP_GREATER:
+                recorded = comparisonValue(recorder, COMPARE_GREATER, false,
+                                           next);
+                break;
+            case OP_LESS:
+                recorded = comparisonValue(recorder, COMPARE_LESS, false, next);
+                break;
+            case OP_GREATER_EQUAL:
+                recorded = comparisonValue(recorder, COMPARE_GREATER_EQUAL,
+                                           false, next);
+                break;
+            case OP_LESS_EQUAL:
+                recorded = comparisonValue(recorder, COMPARE_LESS_EQUAL, false,
+                                           next);
+                break;
+            case OP_ADD:
+            case OP_ADD_GENERIC:
+            case OP_ADD_NUMBER:
+            case OP_ADD_STRING:
+            case OP_ADD_UNCHECKED:
+                recorded = arithmetic(recorder, OP_ADD);
+                break;
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+                recorded = arithmetic(recorder, instruction.opcode);
+                break;
+            case OP_SUBTRACT_UNCHECKED:
+                recorded = arithmetic(recorder, OP_SUBTRACT);
+                break;
+            case OP_MULTIPLY_UNCHECKED:
+                recorded = arithmetic(recorder, OP_MULTIPLY);
+                break;
+            case OP_DIVIDE_UNCHECKED:
+                recorded = arithmetic(recorder, OP_DIVIDE);
+                break;
+            case OP_ADD_LOCAL_CONSTANT:
+            case OP_ADD_LOCAL_CONSTANT_GENERIC:
+            case OP_ADD_LOCAL_NUMBER:
+                recorded = getLocal(recorder, operand) &&
+                    pushConstant(recorder, constants[instruction.operands[1]]) &&
+                    arithmetic(recorder, OP_ADD);
+                break;
+            case OP_SUBTRACT_LOCAL_CONSTANT:
+            case OP_SUBTRACT_LOCAL_NUMBER:
+                recorded = getLocal(recorder, operand) &&
+                    pushConstant(recorder, constants[instruction.operands[1]]) &&
+                    arithmetic(recorder, OP_SUBTRACT);
+                break;
+            case OP_NOT: recorded = not(recorder); break;
+            case OP_NEGATE:
+            case OP_NEGATE_UNCHECKED:
+                recorded = negate(recorder);
+                break;
+            case OP_PRINT: recorded = print(recorder); break;
+            case OP_JUMP:
+                next = instruction.target;
+                break;
+            case OP_JUMP_IF_FALSE:
+            case OP_POP_JUMP_IF_FALSE:
+                // Numbers are truthy, so the branch only depends on constants.
+                if (recorder->stackCount == 0) return false;
+                if (isFalsey(recorder->stack[recorder->stackCount - 1].value)) {
+                    next = instruction.target;
+                }
+                if (instruction.opcode == OP_POP_JUMP_IF_FALSE) {
+                    recorder->stackCount--;
+                }
+                break;
+            case OP_JUMP_IF_EQUAL:
+                next = comparisonBranch(recorder, COMPARE_EQUAL, true,
+                                        &instruction, next);
+                break;
+            case OP_JUMP_IF_NOT_EQUAL:
+                next = comparisonBranch(recorder, COMPARE_EQUAL, false,
+                                        &instruction, next);
+                break;
+            case OP_JUMP_IF_NOT_GREATER:
+                next = comparisonBranch(recorder, COMPARE_GREATER, false,
+                                        &instruction, next);
+                break;
+            case OP_JUMP_IF_NOT_LESS:
+                next = comparisonBranch(recorder, COMPARE_LESS, false,
+                                        &instruction, next);
+                break;
+            case OP_JUMP_IF_NOT_GREATER_EQUAL:
+                next = comparisonBranch(recorder, COMPARE_GREATER_EQUAL, false,
+                                        &instruction, next);
+                break;
+            case OP_JUMP_IF_NOT_LESS_EQUAL:
+                next = comparisonBranch(recorder, COMPARE_LESS_EQUAL, false,
+                                        &instruction, next);
+                break;
+            case OP_LOOP:
+                // Inner loops are left to traces of their own.
+                return offset == recorder->loop && recorder->stackCount == 0;
+            case OP_INCREMENT_LOOP_IF_LESS:
+            case OP_INCREMENT_LOOP_IF_LESS_EQUAL:
+            case OP_INCREMENT_LOOP_IF_GREATER:
+            case OP_INCREMENT_LOOP_IF_GREATER_EQUAL: {
+                if (offset != recorder->loop || recorder->stackCount != 0) {
+                    return false;
+                }
+                Comparison comparison =
+                    instruction.opcode == OP_INCREMENT_LOOP_IF_LESS
+                        ? COMPARE_LESS
+                    : instruction.opcode == OP_INCREMENT_LOOP_IF_LESS_EQUAL
+                        ? COMPARE_LESS_EQUAL
+                    : instruction.opcode == OP_INCREMENT_LOOP_IF_GREATER
+                        ? COMPARE_GREATER
+                        : COMPARE_GREATER_EQUAL;
+                return countedLoop(recorder, &instruction, comparison, next);
+            }
+            default:
+                return false;
+        }
+
+        if (!recorded || next < 0) return false;
+        offset = next;
+    }
+    return false;
+}
+
+static void emitEpilogue(Recorder* recorder) {
+    Assembler* as = &recorder->as;
+    asmAddImm(as, RSP, 8);
+    for (int i = VARIABLE_REGISTER_COUNT - 1; i >= 0; i--) {
+        asmPop(as, variableRegisters[i]);
+    }
+    asmRet(as);
+}
+
+static void emitExit(Recorder* recorder, TraceExit* exit, int epilogue) {
+    Assembler* as = &recorder->as;
+    for (int i = 0; i < exit->jumpCount; i++) {
+        asmPatch(as, exit->jumps[i], as->count);
+    }
+
+    for (int i = 0; i < recorder->variableCount; i++) {
+        TraceVariable* variable = &recorder->variables[i];
+        if (!variable->inRegister || !variable->written) continue;
+        asmMovImm64(as, RCX, address(variable->home));
+        asmStore(as, RCX, 0, variable->reg);
+    }
+
+    for (int i = 0; i < exit->stackCount; i++) {
+        Operand* operand = &exit->stack[i];
+        if (operand->type == OPERAND_SPILLED) continue;
+        loadBits(recorder, RAX, operand, i);
+        asmMovImm64(as, RCX, address(stackSlot(recorder, i)));
+        asmStore(as, RCX, 0, RAX);
+    }
+    asmMovImm64(as, RAX, address(stackSlot(recorder, exit->stackCount)));
+    asmMovImm64(as, RCX, address(&vm.stackTop));
+    asmStore(as, RCX, 0, RAX);
+
+    asmMovImm32(as, RAX, (uint32_t) exit->resume);
+    asmPatch(as, asmJump(as), epilogue);
+}
+
+// Loads the loop variables and checks the types the recording assumed.
+// A variable holding an integer is widened to a double and the entry
+// starts over; failing otherwise leaves before anything has changed.
+static void emitEntry(Recorder* recorder, int epilogue, int loopStart) {
+    Assembler* as = &recorder->as;
+    int guards[MAX_TRACE_VARIABLES];
+    int guardCount = 0;
+    int widens[MAX_TRACE_VARIABLES];
+    Value* homes[MAX_TRACE_VARIABLES];
+    int widenCount = 0;
+
+    int entry = as->count;
+    asmMovImm64(as, RDX, QNAN);
+    asmMovImm64(as, RDI, UNDEFINED_VAL);
+    for (int i = 0; i < recorder->variableCount; i++) {
+        TraceVariable* variable = &recorder->variables[i];
+        if (!variable->accessed) continue;
+        Register reg = variable->inRegister ? variable->reg : RCX;
+        asmMovImm64(as, RAX, address(variable->home));
+        asmLoad(as, reg, RAX, 0);
+        if (variable->readFirst) {
+            asmMovReg(as, RSI, reg);
+            asmAnd(as, RSI, RDX);
+            asmCmp(as, RSI, RDX);
+            homes[widenCount] = variable->home;
+            widens[widenCount++] = asmJumpIf(as, CC_E);
+        } else if (variable->isGlobal) {
+            asmCmp(as, reg, RDI);
+            guards[guardCount++] = asmJumpIf(as, CC_E);
+        }
+    }
+    asmPatch(as, asmJump(as), loopStart);
+
+    for (int i = 0; i < widenCount; i++) {
+        asmPatch(as, widens[i], as->count);
+        asmMovImm64(as, RDI, address(homes[i]));
+        asmCall(as, traceWiden);
+        asmTest32(as, RAX, RAX);
+        asmPatch(as, asmJumpIf(as, CC_NE), entry);
+        guards[guardCount++] = asmJump(as);
+    }
+    for (int i = 0; i < guardCount; i++) asmPatch(as, guards[i], as->count);
+    asmMovImm32(as, RAX, (uint32_t) recorder->header);
+    asmPatch(as, asmJump(as), epilogue);
+}
+
+static bool recordTrace(int loopOffset, Executable* trace) {
+    Recorder recorder;
+    initAssembler(&recorder.as);
+    recorder.chunk = vm.chunk;
+    recorder.header = (int) (vm.ip - vm.chunk->code);
+    recorder.loop = loopOffset;
+    recorder.base = (int) (vm.stackTop - vm.stack);
+    recorder.stackCount = 0;
+    recorder.variableCount = 0;
+    recorder.exits = NULL;
+    recorder.exitCount = 0;
+    recorder.exitCapacity = 0;
+
+    Assembler* as = &recorder.as;
+    bool recorded = allocateVariables(&recorder);
+    int entryJump = 0;
+    int loopStart = 0;
+    if (recorded) {
+        for (int i = 0; i < VARIABLE_REGISTER_COUNT; i++) {
+            asmPush(as, variableRegisters[i]);
+        }
+        // Keeps the stack 16-byte aligned for calls.
+        asmSubImm(as, RSP, 8);
+        entryJump = asmJump(as);
+        loopStart = as->count;
+        recorded = record(&recorder);
+    }
+
+    if (recorded) {
+        asmPatch(as, asmJump(as), loopStart);
+        int epilogue = as->count;
+        emitEpilogue(&recorder);
+        for (int i = 0; i < recorder.exitCount; i++) {
+            emitExit(&recorder, &recorder.exits[i], epilogue);
+        }
+        asmPatch(as, entryJump, as->count);
+        emitEntry(&recorder, epilogue, loopStart);
+        recorded = makeExecutable(as, trace);
+    }
+
+    for (int i = 0; i < recorder.exitCount; i++) {
+        FREE_ARRAY(Operand, recorder.exits[i].stack,
+                   recorder.exits[i].stackCount);
+    }
+    FREE_ARRAY(TraceExit, recorder.exits, recorder.exitCapacity);
+    freeAssembler(as);
+    return recorded;
+}
+
+void initTraces(Chunk* chunk) {
+    cache.count = chunk->count;
+    cache.counters = ALLOCATE(int, cache.count);
+    cache.traces = ALLOCATE(Executable, cache.count);
+    for (int i = 0; i < cache.count; i++) {
+        cache.counters[i] = 0;
+        cache.traces[i].code = NULL;
+        cache.traces[i].size = 0;
+    }
+}
+
+void freeTraces() {
+    for (int i = 0; i < cache.count; i++) freeExecutable(&cache.traces[i]);
+    FREE_ARRAY(int, cache.counters, cache.count);
+    FREE_ARRAY(Executable, cache.traces, cache.count);
+    cache.counters = NULL;
+    cache.traces = NULL;
+    cache.count = 0;
+}
+
+void traceLoop(int loopOffset) {
+    if (loopOffset >= cache.count) return;
+    Executable* trace = &cache.traces[loopOffset];
+    if (trace->code == NULL) {
+        int* counter = &cache.counters[loopOffset];
+        if (*counter == BLACKLISTED || ++*counter < HOT_LOOP) return;
+        if (!recordTrace(loopOffset, trace)) {
+            *counter = BLACKLISTED;
+            return;
+        }
+    }
+    int resume = ((TraceEntry) trace->code)();
+    vm.ip = vm.chunk->code + resume;
+}
+
+#else
+
+void initTraces(Chunk* chunk) {
+    (void) chunk;
+}
+
+void freeTraces() {}
+
+void traceLoop(int loopOffset) {
+    (void) loopOffset;
+}
+
+#endif
@@ -7,6 +7,21 @@
 
 
 bool valuesEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+	// Compare doubles as doubles so NaN != NaN and 0 == -0, and an integer
+	// and a double by value, like the tagged representation does. Anything
+	// else, two integers included, is equal when the bits are.
+	if (IS_DOUBLE(a) & IS_DOUBLE(b)) return AS_DOUBLE(a) == AS_DOUBLE(b);
+	if ((IS_INT(a) & IS_DOUBLE(b)) | (IS_DOUBLE(a) & IS_INT(b))) {
+		return AS_NUMBER(a) == AS_NUMBER(b);
+	}
+	return a == b;
+#else
+	// An integer equals the double of the same value.
+	if (IS_NUMBER(a) && IS_NUMBER(b)) {
+		if (ARE_INTS(a, b)) return AS_INT(a) == AS_INT(b);
+		return AS_NUMBER(a) == AS_NUMBER(b);
+	}
 	if (a.type != b.type) return false;
 	switch(a.type) {
 		case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
@@ -17,7 +32,42 @@ bool valuesEqual(Value a, Value b) {
 			return false; // Unreachable
 
 	}
+#endif
+}
+
+#ifndef NAN_BOXING
+// The payload of a value as 64 bits, whichever union member it is in.
+static uint64_t payloadBits(Value value) {
+	uint64_t bits = 0;
+	switch (value.type) {
+		case VAL_BOOL: return AS_BOOL(value);
+		case VAL_NUMBER: memcpy(&bits, &value.as.number, sizeof(double)); return bits;
+		case VAL_INT: return (uint64_t) AS_INT(value);
+		case VAL_OBJ: return (uint64_t)(uintptr_t) AS_OBJ(value);
+		default: return 0;
+	}
+}
+#endif
 
+bool valuesIdentical(Value a, Value b) {
+#ifdef NAN_BOXING
+	return a == b;
+#else
+	return a.type == b.type && payloadBits(a) == payloadBits(b);
+#endif
+}
+
+uint32_t hashValue(Value value) {
+#ifdef NAN_BOXING
+	uint64_t bits = value;
+#else
+	uint64_t bits = payloadBits(value) ^ (uint64_t) value.type;
+#endif
+	// Mixes the high bits, where doubles and tags differ, into the low ones.
+	bits ^= bits >> 33;
+	bits *= 0xff51afd7ed558ccdULL;
+	bits ^= bits >> 33;
+	return (uint32_t) bits;
 }
 
 void initValueArray(ValueArray* array) {
@@ -37,19 +87,33 @@ void writeValueArray(ValueArray* array, Value value) {
     array->count++;
 }
 
+void reserveValueArray(ValueArray* array, int capacity) {
+    if (array->capacity >= capacity) return;
+    array->values = GROW_ARRAY(Value, array->values, array->capacity, capacity);
+    array->capacity = capacity;
+}
+
 void freeValueArray(ValueArray* array) {
     FREE_ARRAY(Value, array->values, array->capacity);
     initValueArray(array);
 }
 
 void printValue(Value value) {
-    switch(value.type) {
-		case VAL_BOOL:
-			printf(AS_BOOL(value) ? "true" : "false");
-			break;
-		case VAL_NIL: printf("nil"); break;
-		case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
-		case VAL_OBJ: printObject(value); break;
+	if (IS_BOOL(value)) {
+		printf(AS_BOOL(value) ? "true" : "false");
+	} else if (IS_NIL(value)) {
+		printf("nil");
+	} else if (IS_INT(value)) {
+		// %g prints integers of up to six digits as they are.
+		int64_t integer = AS_INT(value);
+		if (integer > -1000000 && integer < 1000000) {
+			printf("%d", (int) integer);
+		} else {
+			printf("%g", (double) integer);
+		}
+	} else if (IS_NUMBER(value)) {
+		printf("%g", AS_NUMBER(value));
+	} else if (IS_OBJ(value)) {
+		printObject(value);
 	}
-
 }
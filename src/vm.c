@@ -8,6 +8,11 @@
 #include "../include/vm.h"
 #include "../include/compiler.h"
 #include "../include/debug.h"
+#include "../include/jit.h"
+#include "../include/pipeline.h"
+#include "../include/regvm.h"
+#include "../include/threaded.h"
+#include "../include/trace.h"
 
 
 VM vm;
@@ -16,7 +21,7 @@ static void resetStack() {
     vm.stackTop = vm.stack;
 }
 
-static void runtimeError(const char * format, ... ) {
+void runtimeError(const char * format, ... ) {
 	va_list args;
 	va_start(args, format);
 	vfprintf(stderr, format, args);
@@ -34,12 +39,26 @@ static void runtimeError(const char * format, ... ) {
 void initVM() {
     resetStack();
 	vm.objects = NULL;
-	initTable(&vm.globals);
+	initTable(&vm.globalNames);
+	initTable(&vm.finalGlobals);
+	initValueArray(&vm.globalIdentifiers);
+	initValueArray(&vm.globalValues);
 	initTable(&vm.strings);
+	vm.useJit = false;
+	vm.useTracing = false;
+	vm.useRegisters = false;
+	vm.useOptimizer = false;
+	vm.profile = NULL;
+	vm.feedback = NULL;
+	vm.usePipeline = false;
+	vm.pipelining = false;
 }
 
 void freeVM() {
-	freeTable(&vm.globals);
+	freeTable(&vm.globalNames);
+	freeTable(&vm.finalGlobals);
+	freeValueArray(&vm.globalIdentifiers);
+	freeValueArray(&vm.globalValues);
 	freeTable(&vm.strings);
 	freeObjects();
 }
@@ -54,229 +73,665 @@ Value pop() {
     return *vm.stackTop;
 }
 
+int globalSlot(ObjString* name) {
+	Value slot;
+	if (tableGet(&vm.globalNames, name, &slot)) {
+		return (int) AS_NUMBER(slot);
+	}
+	int newSlot = vm.globalValues.count;
+	writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+	writeValueArray(&vm.globalIdentifiers, OBJ_VAL(name));
+	tableSet(&vm.globalNames, name, NUMBER_VAL((double) newSlot));
+	return newSlot;
+}
+
+#ifndef REGISTER_STATE
 static Value peek(int distance) {
 	return vm.stackTop[-1 - distance];
 
 }
+#endif
+
+// The counter or bound of a counted loop.
+static inline Value* loopOperand(int kind, int index) {
+	switch (kind) {
+		case LOOP_LOCAL: return &vm.stack[index];
+		case LOOP_GLOBAL: return &vm.globalValues.values[index];
+		default: return &vm.chunk->constants.values[index];
+	}
+}
 
-static bool isFalsey(Value value) {
+bool isFalsey(Value value) {
 
 	return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 
 }
 
-static void concatenate() {
+void concatenate() {
 	ObjString* b = AS_STRING(pop());
 	ObjString* a = AS_STRING(pop());
-	int length = a->length + b->length;
-	char* chars = ALLOCATE(char, length + 1);
-	memcpy(chars, a->chars, a->length);
-	memcpy(chars + a->length, b->chars, b->length);
-	chars[length] = '\0';
-
-	ObjString* result = takeString(chars, length);
-	push(OBJ_VAL(result));
+	push(OBJ_VAL(concatenateStrings(a, b)));
 }
 
-static InterpretResult run() {
-#define READ_BYTE() (*vm.ip++)
-#define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
-#define READ_LONG_CONSTANT(byteArray) \
-        (vm.chunk->constants.values[CONVERT_BYTE_ARRAY_TO_INT(byteArray,4)])
-#define READ_SHORT() \
-		(vm.ip += 2, (uint16_t) ((vm.ip[-2] << 8) | vm.ip[-1]))
-#define READ_STRING() AS_STRING(READ_CONSTANT())
-#define READ_STRING_LONG(byteArray) AS_STRING(READ_LONG_CONSTANT(byteArray))
-#define BINARY_OP(valueType, op) \
+// Runs the chunk as threaded code (see threaded.h), which it fills in and
+// the caller frees. ip points into code->code; vm.ip keeps meaning a
+// byte offset into the chunk for everything outside run() and is only
+// written back around calls that read it.
+static InterpretResult run(ThreadedCode* code) {
+#ifdef REGISTER_STATE
+    // The stack pointer and the constant table live in locals, and the
+    // top of the stack is cached in top instead of memory. sp points at
+    // the slot top belongs in; slot zero is reserved, so there always is
+    // one.
+    Value* sp = vm.stackTop - 1;
+    Value top = *sp;
+    Value popped;
+    Value* constants = vm.chunk->constants.values;
+#define CONSTANTS constants
+#define PUSH(value) \
+        do { \
+            Value pushed = (value); \
+            *sp++ = top; \
+            top = pushed; \
+        } while(false)
+#define POP() (popped = top, top = *--sp, popped)
+#define PEEK(distance) ((distance) == 0 ? top : sp[-(distance)])
+#define DROP(count) (sp -= (count), top = *sp)
+#define SET_TOP(value) (top = (value))
+// Reads of vm.stack[slot] may hit the slot of the cached top.
+#define SYNC_TOP() (*sp = top)
+// After writing vm.stack[slot], which may be the cached top's slot.
+#define RELOAD_TOP() (top = *sp)
+#define SAVE_STACK() (*sp = top, vm.stackTop = sp + 1)
+#define LOAD_STACK() (sp = vm.stackTop - 1, top = *sp)
+#else
+#define CONSTANTS vm.chunk->constants.values
+#define PUSH(value) push(value)
+#define POP() pop()
+#define PEEK(distance) peek(distance)
+#define DROP(count) (vm.stackTop -= (count))
+#define SET_TOP(value) (vm.stackTop[-1] = (value))
+#define SYNC_TOP() do { } while(false)
+#define RELOAD_TOP() do { } while(false)
+#define SAVE_STACK() do { } while(false)
+#define LOAD_STACK() do { } while(false)
+#endif
+
+#define OPERAND(index) (instruction->operands[index])
+#define READ_CONSTANT(index) (CONSTANTS[OPERAND(index)])
+#define JUMP() (ip = instruction->target)
+#define OFFSET_OF(entry) (code->offsets[(entry) - code->code])
+#define SAVE_STATE() \
+        do { \
+            vm.ip = vm.chunk->code + OFFSET_OF(ip); \
+            SAVE_STACK(); \
+        } while(false)
+#define LOAD_STATE() \
         do { \
-			if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-				runtimeError("Operands must be numbers."); \
-				return INTERPRET_RUNTIME_ERROR; \
+            ip = &code->code[code->entries[vm.ip - vm.chunk->code]]; \
+            LOAD_STACK(); \
+        } while(false)
+// Only the generic handlers record, see profile.h.
+#define RECORD_TYPES(a, b) \
+        do { \
+            if (vm.profile != NULL) { \
+                recordTypes(vm.profile, OFFSET_OF(instruction), a, b); \
+            } \
+        } while(false)
+#define GLOBAL_NAME(slot) AS_CSTRING(vm.globalIdentifiers.values[slot])
+#define RUNTIME_ERROR(...) \
+        do { \
+            SAVE_STATE(); \
+            runtimeError(__VA_ARGS__); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } while(false)
+#define BINARY_OP(function) \
+        do { \
+            Value result; \
+			if (!function(PEEK(1), PEEK(0), &result)) { \
+				RUNTIME_ERROR("Operands must be numbers."); \
 			}\
-            double b = AS_NUMBER(pop()); \
-            double a = AS_NUMBER(pop()); \
-            push(valueType(a op b)); \
-        } while(false) \
+            DROP(1); \
+            SET_TOP(result); \
+        } while(false)
+
+// Arithmetic on operands the optimizer proved are numbers.
+#define UNCHECKED_OP(function) \
+        do { \
+            Value result = function(PEEK(1), PEEK(0)); \
+            DROP(1); \
+            SET_TOP(result); \
+        } while(false)
+
+// Compares two integers directly and anything else as doubles; both give
+// the same answer for integers.
+#define COMPARE(condition, result) \
+        do { \
+            Value right = PEEK(0); \
+            Value left = PEEK(1); \
+            if (LIKELY(ARE_INTS(left, right))) { \
+                int64_t b = AS_INT(right); \
+                int64_t a = AS_INT(left); \
+                result = (condition); \
+            } else { \
+                double a, b; \
+                if (!toDoubles(left, right, &a, &b)) { \
+                    RUNTIME_ERROR("Operands must be numbers."); \
+                } \
+                result = (condition); \
+            } \
+        } while(false)
+#define COMPARE_OP(condition) \
+        do { \
+            bool holds; \
+            COMPARE(condition, holds); \
+            DROP(1); \
+            SET_TOP(BOOL_VAL(holds)); \
+        } while(false)
+
+// Quickening: the generic form of an instruction rewrites its own
+// threaded entry to a form specialized for the operand types it saw, the
+// first time it runs. The specialized form only checks a guard; when the
+// guard fails it rewrites the entry to a generic form that never
+// quickens again and re-executes the instruction. The chunk's bytes are
+// left alone.
+#define REWRITE(to) \
+        do { \
+            instruction->opcode = (to); \
+            instruction->handler = HANDLER(to); \
+        } while(false)
+#define QUICKEN(from, to) \
+        do { \
+            if (instruction->opcode == (from)) REWRITE(to); \
+        } while(false)
+#define DEOPTIMIZE(generic) \
+        do { \
+            REWRITE(generic); \
+            ip = instruction; \
+            DISPATCH(); \
+        } while(false)
+
+// Fused comparison and OP_POP_JUMP_IF_FALSE. The condition is spelled
+// out the same way as the unfused sequence so NaN compares identically.
+#define COMPARE_JUMP(condition) \
+        do { \
+            bool holds; \
+            COMPARE(condition, holds); \
+            DROP(2); \
+            if (!holds) JUMP(); \
+        } while(false)
+
+// Increments the counter of a counted loop and jumps back into the body
+// while the condition holds. Falling through reaches the OP_LOOP to the
+// header, whose condition then exits the loop, or reports why the bound
+// is not a number. The step is always a number.
+#define COUNTED_LOOP(condition) \
+        do { \
+            SYNC_TOP(); \
+            int kinds = OPERAND(0); \
+            Value* counter = loopOperand(LOOP_COUNTER_KIND(kinds), OPERAND(1)); \
+            Value left; \
+            if (!addNumbers(*counter, READ_CONSTANT(2), &left)) { \
+                if (IS_UNDEFINED(*counter)) { \
+                    RUNTIME_ERROR("Undefined variable '%s'.", \
+                                  GLOBAL_NAME(OPERAND(1))); \
+                } \
+                RUNTIME_ERROR(kinds & LOOP_SUBTRACT \
+                        ? "Operands must be numbers." \
+                        : "Operands must be two numbers or two strings"); \
+            } \
+            *counter = left; \
+            RELOAD_TOP(); \
+            Value right = *loopOperand(LOOP_BOUND_KIND(kinds), OPERAND(3)); \
+            bool holds = false; \
+            if (LIKELY(ARE_INTS(left, right))) { \
+                int64_t a = AS_INT(left); \
+                int64_t b = AS_INT(right); \
+                holds = (condition); \
+            } else { \
+                double a, b; \
+                if (toDoubles(left, right, &a, &b)) holds = (condition); \
+            } \
+            if (holds) { \
+                JUMP(); \
+                TRACE_LOOP(); \
+            } \
+        } while(false)
+
+#define TRACE_LOOP() \
+        do { \
+            if (vm.useTracing) { \
+                int loop = OFFSET_OF(instruction); \
+                SAVE_STATE(); \
+                traceLoop(loop); \
+                LOAD_STATE(); \
+            } \
+        } while(false)
 
-    for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
-        printf("           ");
-        for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        disassembleInstruction(vm.chunk,
-        (int)(vm.ip - vm.chunk->code));
+#define TRACE_INSTRUCTION() \
+        do { \
+            SAVE_STATE(); \
+            printf("           "); \
+            for (Value* slot = vm.stack; slot < vm.stackTop; slot++) { \
+                printf("[ "); \
+                printValue(*slot); \
+                printf(" ]"); \
+            } \
+            printf("\n"); \
+            disassembleInstruction(vm.chunk, OFFSET_OF(ip)); \
+        } while(false)
+#elif defined(COUNT_INSTRUCTIONS)
+#define TRACE_INSTRUCTION() (vm.instructionCount++)
+#else
+#define TRACE_INSTRUCTION() do { } while(false)
 #endif
-        uint8_t instruction;
-        switch (instruction = READ_BYTE())
-        {
-            case OP_CONSTANT_LONG:
-                uint8_t byteArray[CONSTANT_LONG_BYTE_SIZE];
-                for (int i = 0; i< CONSTANT_LONG_BYTE_SIZE; i++)
-                    byteArray[i] = READ_BYTE();
-                Value longConstant = READ_LONG_CONSTANT(byteArray);
-                push(longConstant);
-                break;
-            case OP_CONSTANT: 
-                Value constant = READ_CONSTANT();
-                push(constant);
-                break;
-			case OP_NIL: push(NIL_VAL); break;
-			case OP_TRUE: push(BOOL_VAL(true)); break;
-			case OP_FALSE: push(BOOL_VAL(false)); break;
-			case OP_POP: pop(); break;
-			case OP_GET_LOCAL: {
-				uint8_t slot = READ_BYTE();
-				push(vm.stack[slot]);
-				break;
-			}
-			case OP_SET_LOCAL: {
-				uint8_t slot = READ_BYTE();
-				vm.stack[slot] = peek(0);
-				break;
-			}
-			case OP_GET_GLOBAL: {
-				ObjString* name = READ_STRING();
-				Value value;
-				if (!tableGet(&vm.globals, name, &value)) {
-					runtimeError("Undefined variable '%s'.", name->chars);
-					return INTERPRET_RUNTIME_ERROR;
-				}
-				push(value);
-				break;
-			}
-			case OP_GET_GLOBAL_LONG: {
-				uint8_t byteArray[CONSTANT_LONG_BYTE_SIZE];
-                for (int i = 0; i < CONSTANT_LONG_BYTE_SIZE; i++)
-                    byteArray[i] = READ_BYTE();
-				ObjString* name = READ_STRING_LONG(byteArray);
-				Value value;
-				if (!tableGet(&vm.globals, name, &value)) {
-					runtimeError("Undefined variable '%s'.", name->chars);
-					return INTERPRET_RUNTIME_ERROR;
-				}
-				push(value);
-				break;
-			}
-			case OP_DEFINE_GLOBAL: {
-				ObjString* name = READ_STRING();
-				tableSet(&vm.globals, name, peek(0));
-				pop();
-				break;
-			}
-			case OP_DEFINE_GLOBAL_LONG: {
-				uint8_t byteArray[CONSTANT_LONG_BYTE_SIZE];
-                for (int i = 0; i < CONSTANT_LONG_BYTE_SIZE; i++)
-                    byteArray[i] = READ_BYTE();
-				ObjString* name = READ_STRING_LONG(byteArray);
-				tableSet(&vm.globals, name, peek(0));
-				pop();
-                break;
-			}
-			case OP_SET_GLOBAL: {
-				ObjString* name = READ_STRING();
-				if (tableSet(&vm.globals, name, peek(0))) {
-					tableDelete(&vm.globals, name);
-					runtimeError("Undefined variable '%s'.", name->chars);
-					return INTERPRET_RUNTIME_ERROR;
-				}
-				break;
-			}
-			case OP_SET_GLOBAL_LONG: {
-				uint8_t byteArray[CONSTANT_LONG_BYTE_SIZE];
-                for (int i = 0; i < CONSTANT_LONG_BYTE_SIZE; i++)
-                    byteArray[i] = READ_BYTE();
-				ObjString* name = READ_STRING_LONG(byteArray);
-				if (tableSet(&vm.globals, name, peek(0))) {
-					tableDelete(&vm.globals, name);
-					runtimeError("Undefined variable '%s'.", name->chars);
-					return INTERPRET_RUNTIME_ERROR;
-				}
-				break;
-			}
-			case OP_EQUAL: {
-				Value b = pop();
-				Value a = pop();
-				push(BOOL_VAL(valuesEqual(a,b)));
-				break;
-			}
-			case OP_GREATER: BINARY_OP(BOOL_VAL, >); break;
-			case OP_LESS: BINARY_OP(BOOL_VAL, <); break;
-			case OP_ADD: {
-				if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-					concatenate();
-				} else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-					double b = AS_NUMBER(pop());
-					double a = AS_NUMBER(pop());
-					push(NUMBER_VAL(a+b));
-				} else {
-					runtimeError(
-							"Operands must be two numbers or two strings");
-					return INTERPRET_RUNTIME_ERROR;
-				}
-				break;
-			}
-			case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-            case OP_DIVIDE: BINARY_OP(NUMBER_VAL, /); break;
-			case OP_NOT: push(BOOL_VAL(isFalsey(pop()))); break;
-            case OP_NEGATE: 
-				if (!IS_NUMBER(peek(0))) {
-					runtimeError("Operand must be a number.");
-					return INTERPRET_RUNTIME_ERROR;
-				}
-				push(NUMBER_VAL(-AS_NUMBER(pop())));
-				break;
-			case OP_PRINT: {
-				printValue(pop());
-				printf("\n");
-				break;
-			}
-			case OP_JUMP: {
-				uint16_t offset = READ_SHORT();
-				vm.ip += offset;
-				break;
-			}
-			case OP_JUMP_IF_FALSE: {
-				uint16_t offset = READ_SHORT();
-				if (isFalsey(peek(0))) vm.ip += offset;
-				break;
-			}
-			case OP_LOOP: {
-				uint16_t offset = READ_SHORT();
-				vm.ip -= offset;
-				break;
-			}
-            case OP_RETURN:
-				// Exit interpreter
-                return INTERPRET_OK;
 
+#ifdef COMPUTED_GOTO
+    // One entry per opcode. Every handler ends in its own copy of
+    // DISPATCH(), so each one gets a separate indirect branch that the
+    // predictor can learn independently.
+    static void* dispatchTable[UINT8_COUNT] = {
+        [OP_CONSTANT] = &&TARGET_OP_CONSTANT,
+        [OP_INTEGER] = &&TARGET_OP_INTEGER,
+        [OP_DECIMAL] = &&TARGET_OP_DECIMAL,
+        [OP_NIL] = &&TARGET_OP_NIL,
+        [OP_TRUE] = &&TARGET_OP_TRUE,
+        [OP_FALSE] = &&TARGET_OP_FALSE,
+        [OP_POP] = &&TARGET_OP_POP,
+        [OP_GET_GLOBAL] = &&TARGET_OP_GET_GLOBAL,
+        [OP_GET_LOCAL] = &&TARGET_OP_GET_LOCAL,
+        [OP_DEFINE_GLOBAL] = &&TARGET_OP_DEFINE_GLOBAL,
+        [OP_SET_GLOBAL] = &&TARGET_OP_SET_GLOBAL,
+        [OP_SET_LOCAL] = &&TARGET_OP_SET_LOCAL,
+        [OP_EQUAL] = &&TARGET_OP_EQUAL,
+        [OP_GREATER] = &&TARGET_OP_GREATER,
+        [OP_LESS] = &&TARGET_OP_LESS,
+        [OP_NOT] = &&TARGET_OP_NOT,
+        [OP_NEGATE] = &&TARGET_OP_NEGATE,
+        [OP_ADD] = &&TARGET_OP_ADD,
+        [OP_SUBTRACT] = &&TARGET_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&TARGET_OP_MULTIPLY,
+        [OP_DIVIDE] = &&TARGET_OP_DIVIDE,
+        [OP_PRINT] = &&TARGET_OP_PRINT,
+        [OP_JUMP_IF_FALSE] = &&TARGET_OP_JUMP_IF_FALSE,
+        [OP_JUMP] = &&TARGET_OP_JUMP,
+        [OP_LOOP] = &&TARGET_OP_LOOP,
+        [OP_RETURN] = &&TARGET_OP_RETURN,
+        [OP_NOT_EQUAL] = &&TARGET_OP_NOT_EQUAL,
+        [OP_GREATER_EQUAL] = &&TARGET_OP_GREATER_EQUAL,
+        [OP_LESS_EQUAL] = &&TARGET_OP_LESS_EQUAL,
+        [OP_POPN] = &&TARGET_OP_POPN,
+        [OP_POP_JUMP_IF_FALSE] = &&TARGET_OP_POP_JUMP_IF_FALSE,
+        [OP_JUMP_IF_NOT_EQUAL] = &&TARGET_OP_JUMP_IF_NOT_EQUAL,
+        [OP_JUMP_IF_EQUAL] = &&TARGET_OP_JUMP_IF_EQUAL,
+        [OP_JUMP_IF_NOT_GREATER] = &&TARGET_OP_JUMP_IF_NOT_GREATER,
+        [OP_JUMP_IF_NOT_LESS] = &&TARGET_OP_JUMP_IF_NOT_LESS,
+        [OP_JUMP_IF_NOT_GREATER_EQUAL] = &&TARGET_OP_JUMP_IF_NOT_GREATER_EQUAL,
+        [OP_JUMP_IF_NOT_LESS_EQUAL] = &&TARGET_OP_JUMP_IF_NOT_LESS_EQUAL,
+        [OP_ADD_LOCAL_CONSTANT] = &&TARGET_OP_ADD_LOCAL_CONSTANT,
+        [OP_SUBTRACT_LOCAL_CONSTANT] = &&TARGET_OP_SUBTRACT_LOCAL_CONSTANT,
+        [OP_INCREMENT_LOOP_IF_LESS] = &&TARGET_OP_INCREMENT_LOOP_IF_LESS,
+        [OP_INCREMENT_LOOP_IF_LESS_EQUAL] =
+            &&TARGET_OP_INCREMENT_LOOP_IF_LESS_EQUAL,
+        [OP_INCREMENT_LOOP_IF_GREATER] = &&TARGET_OP_INCREMENT_LOOP_IF_GREATER,
+        [OP_INCREMENT_LOOP_IF_GREATER_EQUAL] =
+            &&TARGET_OP_INCREMENT_LOOP_IF_GREATER_EQUAL,
+        [OP_ADD_UNCHECKED] = &&TARGET_OP_ADD_UNCHECKED,
+        [OP_SUBTRACT_UNCHECKED] = &&TARGET_OP_SUBTRACT_UNCHECKED,
+        [OP_MULTIPLY_UNCHECKED] = &&TARGET_OP_MULTIPLY_UNCHECKED,
+        [OP_DIVIDE_UNCHECKED] = &&TARGET_OP_DIVIDE_UNCHECKED,
+        [OP_NEGATE_UNCHECKED] = &&TARGET_OP_NEGATE_UNCHECKED,
+        [OP_SWITCH_INTEGER] = &&TARGET_OP_SWITCH_INTEGER,
+        [OP_SWITCH_STRING] = &&TARGET_OP_SWITCH_STRING,
+        [OP_ADD_GENERIC] = &&TARGET_OP_ADD_GENERIC,
+        [OP_ADD_NUMBER] = &&TARGET_OP_ADD_NUMBER,
+        [OP_ADD_STRING] = &&TARGET_OP_ADD_STRING,
+        [OP_ADD_LOCAL_CONSTANT_GENERIC] = &&TARGET_OP_ADD_LOCAL_CONSTANT_GENERIC,
+        [OP_ADD_LOCAL_NUMBER] = &&TARGET_OP_ADD_LOCAL_NUMBER,
+        [OP_SUBTRACT_LOCAL_NUMBER] = &&TARGET_OP_SUBTRACT_LOCAL_NUMBER,
+    };
+#define HANDLER(opcode) dispatchTable[opcode]
+#define INTERPRET_LOOP  DISPATCH();
+#define CASE(name)      TARGET_##name:
+#define DEFAULT         TARGET_OP_UNKNOWN:
+#define DISPATCH() \
+        do { \
+            TRACE_INSTRUCTION(); \
+            instruction = ip++; \
+            goto *instruction->handler; \
+        } while(false)
+#else
+#define HANDLER(opcode) NULL
+#define INTERPRET_LOOP \
+        loop: \
+            TRACE_INSTRUCTION(); \
+            instruction = ip++; \
+            switch (instruction->opcode)
+#define CASE(name)      case name:
+#define DEFAULT         default:
+#define DISPATCH()      goto loop
+#endif
+
+#ifdef COMPUTED_GOTO
+    // Bytes that are not opcodes get the unknown-opcode handler.
+    for (int i = 0; i < UINT8_COUNT; i++) {
+        if (dispatchTable[i] == NULL) dispatchTable[i] = &&TARGET_OP_UNKNOWN;
+    }
+    threadChunk(code, vm.chunk, dispatchTable);
+#else
+    threadChunk(code, vm.chunk, NULL);
+#endif
+    ThreadedInstruction* ip = &code->code[code->entries[vm.ip - vm.chunk->code]];
+    ThreadedInstruction* instruction;
+    INTERPRET_LOOP
+    {
+        CASE(OP_CONSTANT) PUSH(READ_CONSTANT(0)); DISPATCH();
+        CASE(OP_INTEGER) PUSH(INT_VAL(OPERAND(0))); DISPATCH();
+        CASE(OP_DECIMAL) PUSH(NUMBER_VAL(OPERAND(0) / 10.0)); DISPATCH();
+        CASE(OP_NIL) PUSH(NIL_VAL); DISPATCH();
+        CASE(OP_TRUE) PUSH(BOOL_VAL(true)); DISPATCH();
+        CASE(OP_FALSE) PUSH(BOOL_VAL(false)); DISPATCH();
+        CASE(OP_POP) DROP(1); DISPATCH();
+        CASE(OP_GET_LOCAL) {
+            SYNC_TOP();
+            PUSH(vm.stack[OPERAND(0)]);
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL) vm.stack[OPERAND(0)] = PEEK(0); DISPATCH();
+        CASE(OP_GET_GLOBAL) {
+            int slot = OPERAND(0);
+            Value value = vm.globalValues.values[slot];
+            if (IS_UNDEFINED(value)) {
+                RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
+            }
+            PUSH(value);
+            DISPATCH();
+        }
+        CASE(OP_DEFINE_GLOBAL) {
+            vm.globalValues.values[OPERAND(0)] = POP();
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL) {
+            int slot = OPERAND(0);
+            if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+                RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
+            }
+            vm.globalValues.values[slot] = PEEK(0);
+            DISPATCH();
+        }
+        CASE(OP_EQUAL) {
+            Value b = PEEK(0);
+            Value a = PEEK(1);
+            DROP(1);
+            SET_TOP(BOOL_VAL(valuesEqual(a,b)));
+            DISPATCH();
+        }
+        CASE(OP_GREATER) COMPARE_OP(a > b); DISPATCH();
+        CASE(OP_LESS) COMPARE_OP(a < b); DISPATCH();
+        CASE(OP_ADD)
+        CASE(OP_ADD_GENERIC) {
+            Value result;
+            RECORD_TYPES(PEEK(1), PEEK(0));
+            if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {
+                QUICKEN(OP_ADD, OP_ADD_STRING);
+                SAVE_STATE();
+                concatenate();
+                LOAD_STATE();
+            } else if (addNumbers(PEEK(1), PEEK(0), &result)) {
+                QUICKEN(OP_ADD, OP_ADD_NUMBER);
+                DROP(1);
+                SET_TOP(result);
+            } else {
+                RUNTIME_ERROR(
+                        "Operands must be two numbers or two strings");
+            }
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT) BINARY_OP(subtractNumbers); DISPATCH();
+        CASE(OP_MULTIPLY) BINARY_OP(multiplyNumbers); DISPATCH();
+        CASE(OP_DIVIDE) BINARY_OP(divideNumbers); DISPATCH();
+        CASE(OP_NOT) SET_TOP(BOOL_VAL(isFalsey(PEEK(0)))); DISPATCH();
+        CASE(OP_NEGATE)
+            if (!IS_NUMBER(PEEK(0))) {
+                RUNTIME_ERROR("Operand must be a number.");
+            }
+            SET_TOP(negateNumber(PEEK(0)));
+            DISPATCH();
+        CASE(OP_PRINT) {
+            printValue(POP());
+            printf("\n");
+            DISPATCH();
+        }
+        CASE(OP_JUMP) JUMP(); DISPATCH();
+        CASE(OP_JUMP_IF_FALSE) {
+            if (isFalsey(PEEK(0))) JUMP();
+            DISPATCH();
+        }
+        CASE(OP_LOOP) JUMP(); TRACE_LOOP(); DISPATCH();
+        CASE(OP_RETURN)
+            // Exit interpreter
+            SAVE_STATE();
+            return INTERPRET_OK;
+        CASE(OP_NOT_EQUAL) {
+            Value b = PEEK(0);
+            Value a = PEEK(1);
+            DROP(1);
+            SET_TOP(BOOL_VAL(!valuesEqual(a,b)));
+            DISPATCH();
+        }
+        CASE(OP_GREATER_EQUAL) COMPARE_OP(!(a < b)); DISPATCH();
+        CASE(OP_LESS_EQUAL) COMPARE_OP(!(a > b)); DISPATCH();
+        CASE(OP_POPN) DROP(OPERAND(0)); DISPATCH();
+        CASE(OP_POP_JUMP_IF_FALSE) {
+            if (isFalsey(POP())) JUMP();
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_NOT_EQUAL) {
+            Value b = PEEK(0);
+            Value a = PEEK(1);
+            DROP(2);
+            if (!valuesEqual(a, b)) JUMP();
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_EQUAL) {
+            Value b = PEEK(0);
+            Value a = PEEK(1);
+            DROP(2);
+            if (valuesEqual(a, b)) JUMP();
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_NOT_GREATER) COMPARE_JUMP(a > b); DISPATCH();
+        CASE(OP_JUMP_IF_NOT_LESS) COMPARE_JUMP(a < b); DISPATCH();
+        CASE(OP_JUMP_IF_NOT_GREATER_EQUAL) COMPARE_JUMP(!(a < b)); DISPATCH();
+        CASE(OP_JUMP_IF_NOT_LESS_EQUAL) COMPARE_JUMP(!(a > b)); DISPATCH();
+        CASE(OP_ADD_LOCAL_CONSTANT)
+        CASE(OP_ADD_LOCAL_CONSTANT_GENERIC) {
+            SYNC_TOP();
+            Value a = vm.stack[OPERAND(0)];
+            Value b = READ_CONSTANT(1);
+            Value result;
+            RECORD_TYPES(a, b);
+            if (addNumbers(a, b, &result)) {
+                QUICKEN(OP_ADD_LOCAL_CONSTANT, OP_ADD_LOCAL_NUMBER);
+                PUSH(result);
+            } else if (IS_STRING(a) && IS_STRING(b)) {
+                PUSH(a);
+                PUSH(b);
+                SAVE_STATE();
+                concatenate();
+                LOAD_STATE();
+            } else {
+                RUNTIME_ERROR(
+                        "Operands must be two numbers or two strings");
+            }
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT_LOCAL_CONSTANT) {
+            SYNC_TOP();
+            Value a = vm.stack[OPERAND(0)];
+            Value b = READ_CONSTANT(1);
+            Value result;
+            RECORD_TYPES(a, b);
+            if (!subtractNumbers(a, b, &result)) {
+                RUNTIME_ERROR("Operands must be numbers.");
+            }
+            QUICKEN(OP_SUBTRACT_LOCAL_CONSTANT, OP_SUBTRACT_LOCAL_NUMBER);
+            PUSH(result);
+            DISPATCH();
+        }
+        CASE(OP_INCREMENT_LOOP_IF_LESS) COUNTED_LOOP(a < b); DISPATCH();
+        CASE(OP_INCREMENT_LOOP_IF_LESS_EQUAL) COUNTED_LOOP(!(a > b)); DISPATCH();
+        CASE(OP_INCREMENT_LOOP_IF_GREATER) COUNTED_LOOP(a > b); DISPATCH();
+        CASE(OP_INCREMENT_LOOP_IF_GREATER_EQUAL)
+            COUNTED_LOOP(!(a < b));
+            DISPATCH();
+        CASE(OP_ADD_UNCHECKED) UNCHECKED_OP(addKnownNumbers); DISPATCH();
+        CASE(OP_SUBTRACT_UNCHECKED)
+            UNCHECKED_OP(subtractKnownNumbers);
+            DISPATCH();
+        CASE(OP_MULTIPLY_UNCHECKED)
+            UNCHECKED_OP(multiplyKnownNumbers);
+            DISPATCH();
+        CASE(OP_DIVIDE_UNCHECKED) UNCHECKED_OP(divideKnownNumbers); DISPATCH();
+        CASE(OP_NEGATE_UNCHECKED) SET_TOP(negateNumber(PEEK(0))); DISPATCH();
+        // Each of the jumps that follow is one threaded instruction.
+        CASE(OP_SWITCH_INTEGER)
+            ip += switchCase(vm.chunk, OP_SWITCH_INTEGER, OPERAND(0),
+                             OPERAND(1), PEEK(0));
+            DISPATCH();
+        CASE(OP_SWITCH_STRING)
+            ip += switchCase(vm.chunk, OP_SWITCH_STRING, OPERAND(0),
+                             OPERAND(1), PEEK(0));
+            DISPATCH();
+        CASE(OP_ADD_NUMBER) {
+            Value result;
+            if (!addNumbers(PEEK(1), PEEK(0), &result)) {
+                DEOPTIMIZE(OP_ADD_GENERIC);
+            }
+            DROP(1);
+            SET_TOP(result);
+            DISPATCH();
+        }
+        CASE(OP_ADD_STRING) {
+            if (!IS_STRING(PEEK(0)) || !IS_STRING(PEEK(1))) {
+                DEOPTIMIZE(OP_ADD_GENERIC);
+            }
+            SAVE_STATE();
+            concatenate();
+            LOAD_STATE();
+            DISPATCH();
         }
+        // The constant was a number when these were quickened and constants
+        // never change, so only the local can fail the guard.
+        CASE(OP_ADD_LOCAL_NUMBER) {
+            SYNC_TOP();
+            Value a = vm.stack[OPERAND(0)];
+            Value b = READ_CONSTANT(1);
+            Value result;
+            if (!addNumbers(a, b, &result)) {
+                DEOPTIMIZE(OP_ADD_LOCAL_CONSTANT_GENERIC);
+            }
+            PUSH(result);
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT_LOCAL_NUMBER) {
+            SYNC_TOP();
+            Value a = vm.stack[OPERAND(0)];
+            Value b = READ_CONSTANT(1);
+            Value result;
+            if (!subtractNumbers(a, b, &result)) {
+                DEOPTIMIZE(OP_SUBTRACT_LOCAL_CONSTANT);
+            }
+            PUSH(result);
+            DISPATCH();
+        }
+        DEFAULT
+            RUNTIME_ERROR("Unknown opcode %d.", instruction->opcode);
     }
-#undef READ_BYTE
+#undef CONSTANTS
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef DROP
+#undef SET_TOP
+#undef SYNC_TOP
+#undef RELOAD_TOP
+#undef SAVE_STACK
+#undef LOAD_STACK
+#undef OPERAND
 #undef READ_CONSTANT
-#undef READ_LONG_CONSTANT
-#undef READ_STRING
-#undef READ_SHORT
-#undef READ_STRING_LONG
+#undef JUMP
+#undef OFFSET_OF
+#undef SAVE_STATE
+#undef LOAD_STATE
+#undef RUNTIME_ERROR
+#undef GLOBAL_NAME
+#undef RECORD_TYPES
 #undef BINARY_OP
+#undef UNCHECKED_OP
+#undef REWRITE
+#undef QUICKEN
+#undef DEOPTIMIZE
+#undef COMPARE
+#undef COMPARE_OP
+#undef COMPARE_JUMP
+#undef COUNTED_LOOP
+#undef TRACE_LOOP
+#undef TRACE_INSTRUCTION
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DEFAULT
+#undef HANDLER
+#undef DISPATCH
+}
+
+InterpretResult runChunk(Chunk* chunk) {
+    vm.chunk = chunk;
+    vm.ip = vm.chunk->code;
+    if (vm.profile != NULL) resetProfile(vm.profile, chunk);
+#ifdef COUNT_INSTRUCTIONS
+    vm.instructionCount = 0;
+#endif
+    // Slot zero, reserved by the compiler.
+    resetStack();
+    push(NIL_VAL);
+
+    InterpretResult result;
+    JitFunction function;
+    RegisterChunk registers;
+    initRegisterChunk(&registers);
+    if (vm.useJit && jitCompile(chunk, &function)) {
+        result = function.entry();
+        jitFree(&function);
+    } else if (vm.useRegisters && compileRegisters(chunk, &registers)) {
+        result = runRegisters(&registers);
+    } else {
+        ThreadedCode code;
+        if (vm.useTracing) initTraces(chunk);
+        result = run(&code);
+        if (vm.useTracing) freeTraces();
+        freeThreadedCode(&code);
+    }
+#ifdef COUNT_INSTRUCTIONS
+    fprintf(stderr, "%llu instructions\n", vm.instructionCount);
+#endif
+
+    freeRegisterChunk(&registers);
+    return result;
 }
 
 InterpretResult interpret(const char* source) {
+#ifdef PIPELINE
+    if (vm.usePipeline) return interpretPipelined(source);
+#endif
     Chunk chunk;
     initChunk(&chunk);
     if(!compile(source, &chunk)) {
         freeChunk(&chunk);
         return INTERPRET_COMPILE_ERROR;
     }
-    vm.chunk = &chunk;
-    vm.ip = vm.chunk->code;
-
-    InterpretResult result = run();
-
+    InterpretResult result = runChunk(&chunk);
     freeChunk(&chunk);
     return result;
 }
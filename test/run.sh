@@ -0,0 +1,151 @@
+#!/bin/sh
+# Runs every script under test/ and in bench/ with each execution mode and
+# compares the output and exit status with the default interpreter's. A
+# script with a .out file next to it must also print exactly that, and
+# one with a .err file must write exactly that to stderr. A
+# .repl file is typed into the REPL line by line instead, in every mode,
+# and must print its .out file.
+#
+# Each script also runs once recording a profile and once specialized by
+# it, with and without --optimize.
+#
+# Each script also runs on other builds of the interpreter and must
+# behave as the default build does: at -O2 and, when the processor has
+# AVX2, with -mavx2, as the SIMD scanner is only compiled into optimized
+# builds, with the portable switch dispatch of -DNO_COMPUTED_GOTO, and
+# with -DNO_REGISTER_STATE, which keeps the stack top in memory.
+#
+#   test/run.sh [script.lox ...]
+#
+# CC, DEFINES and BUILDS (name=flags pairs) can be overridden from the
+# environment; DEFINES is passed to make and to the --emit-c builds, as in
+# make DEFINES=.... Run make clean first when changing DEFINES, since make
+# does not rebuild for them.
+
+cd "$(dirname "$0")/.." || exit 1
+
+CC=${CC:-gcc}
+DEFINES=${DEFINES:-}
+MODES="--jit --trace --registers --optimize --optimize,--jit \
+--optimize,--trace --optimize,--registers --pipeline"
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+make -s DEFINES="$DEFINES" all lib > /dev/null || exit 1
+
+if [ -z "${BUILDS+set}" ]; then
+    BUILDS="sse2=-O2 switch=-DNO_COMPUTED_GOTO memory=-DNO_REGISTER_STATE"
+    grep -qw avx2 /proc/cpuinfo 2> /dev/null && BUILDS="$BUILDS avx2=-O2,-mavx2"
+fi
+for build in $BUILDS; do
+    # shellcheck disable=SC2046,SC2086
+    $CC -w -pthread -Iinclude $DEFINES $(echo "${build#*=}" | tr ',' ' ') \
+        -o "$OUT/${build%%=*}" src/*.c -lm || exit 1
+done
+
+if [ $# -eq 0 ]; then
+    set -- test/*/*.lox test/*/*.repl bench/*.lox
+fi
+
+# Output of both streams, then the exit status, which is also left in
+# $status. Error messages do not end in a newline.
+run() {
+    "$@" > "$OUT/output" 2>&1
+    status=$?
+    printf '\nexit %d\n' $status >> "$OUT/output"
+}
+
+# Only the errors and the exit status: a pipelined run executes the
+# statements before a compile error, which a normal run never starts.
+errors() {
+    "$@" 2>&1 > /dev/null
+    printf '\nexit %d\n' $?
+}
+
+failures=0
+fail() {
+    echo "FAIL $1: $2"
+    failures=$((failures + 1))
+}
+
+for script in "$@"; do
+    case "$script" in *.repl)
+        for mode in "" $MODES; do
+            flags=$(echo "$mode" | tr ',' ' ')
+            # shellcheck disable=SC2086
+            ./build $flags < "$script" > "$OUT/output" 2>&1
+            cmp -s "$OUT/output" "${script%.repl}.out" ||
+                fail "$script" "${mode:-REPL}"
+        done
+        for build in $BUILDS; do
+            "$OUT/${build%%=*}" < "$script" > "$OUT/output" 2>&1
+            cmp -s "$OUT/output" "${script%.repl}.out" ||
+                fail "$script" "${build%%=*} build"
+        done
+        continue
+    esac
+
+    run ./build "$script"
+    cp "$OUT/output" "$OUT/expected"
+    compileError=$([ $status -eq 65 ] && echo yes)
+
+    expected=${script%.lox}.out
+    if [ -f "$expected" ] && ! ./build "$script" 2> /dev/null |
+            cmp -s - "$expected"; then
+        fail "$script" "output differs from $expected"
+    fi
+    expected=${script%.lox}.err
+    if [ -f "$expected" ] && ! ./build "$script" 2>&1 > /dev/null |
+            cmp -s - "$expected"; then
+        fail "$script" "errors differ from $expected"
+    fi
+
+    for build in $BUILDS; do
+        run "$OUT/${build%%=*}" "$script"
+        cmp -s "$OUT/output" "$OUT/expected" ||
+            fail "$script" "${build%%=*} build"
+    done
+
+    for mode in $MODES; do
+        flags=$(echo "$mode" | tr ',' ' ')
+        if [ "$mode" = "--pipeline" ] && [ -n "$compileError" ]; then
+            # shellcheck disable=SC2086
+            [ "$(errors ./build $flags "$script")" = \
+              "$(errors ./build "$script")" ] || fail "$script" "$mode"
+            continue
+        fi
+        # shellcheck disable=SC2086
+        run ./build $flags "$script"
+        cmp -s "$OUT/output" "$OUT/expected" || fail "$script" "$mode"
+    done
+
+    for optimize in "" --optimize; do
+        rm -f "$OUT/profile"
+        # shellcheck disable=SC2086
+        run ./build $optimize --profile "$OUT/profile" "$script"
+        cmp -s "$OUT/output" "$OUT/expected" ||
+            fail "$script" "$optimize --profile"
+        # A script that does not compile leaves no profile to use.
+        [ -n "$compileError" ] && continue
+        # shellcheck disable=SC2086
+        run ./build $optimize --use-profile "$OUT/profile" "$script"
+        cmp -s "$OUT/output" "$OUT/expected" ||
+            fail "$script" "$optimize --use-profile"
+    done
+
+    if ./build --emit-c "$script" > "$OUT/script.c" 2> "$OUT/output"; then
+        # shellcheck disable=SC2086
+        $CC -O1 -w -pthread -Iinclude $DEFINES -o "$OUT/script" \
+            "$OUT/script.c" libclox.a -lm || { fail "$script" "cc"; continue; }
+        run "$OUT/script"
+    else
+        printf '\nexit 65\n' >> "$OUT/output"
+    fi
+    cmp -s "$OUT/output" "$OUT/expected" || fail "$script" "--emit-c"
+done
+
+if [ $failures -ne 0 ]; then
+    echo "$failures failed"
+    exit 1
+fi
+echo "$# scripts passed"